@@ -0,0 +1,454 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: 
+ *  Filename: aes_bench.cc 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: May 16, 2015
+ *  Time: 09:15:58
+ *  Description: AES(128, 192, 256 bit) benchmark, cycles/byte of AES cores
+ *****************************************************************************/
+#include <cstdio>
+#include <cstring>
+#include <cinttypes>
+#include <cstdlib>
+#include <chrono>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#include <cpuid.h>
+#endif
+
+constexpr uint8_t gmult(uint8_t a, uint8_t b) {
+    uint8_t p = 0, hbs = 0;
+
+    for (size_t i = 0; i < 8; i++) {
+        if (b & 1) 
+            p ^= a;
+
+        hbs = a & 0x80;
+        a <<= 1;
+        if (hbs) a ^= 0x1b; // 0000 0001 0001 1011    
+        b >>= 1;
+    }
+
+    return (uint8_t)p;
+}
+
+constexpr uint8_t SubBytes[256] = {
+   0x63, 0x7C, 0x77, 0x7B, 0xF2, 0x6B, 0x6F, 0xC5, 0x30, 0x01, 0x67, 0x2B, 0xFE, 0xD7, 0xAB, 0x76,
+   0xCA, 0x82, 0xC9, 0x7D, 0xFA, 0x59, 0x47, 0xF0, 0xAD, 0xD4, 0xA2, 0xAF, 0x9C, 0xA4, 0x72, 0xC0,
+   0xB7, 0xFD, 0x93, 0x26, 0x36, 0x3F, 0xF7, 0xCC, 0x34, 0xA5, 0xE5, 0xF1, 0x71, 0xD8, 0x31, 0x15,
+   0x04, 0xC7, 0x23, 0xC3, 0x18, 0x96, 0x05, 0x9A, 0x07, 0x12, 0x80, 0xE2, 0xEB, 0x27, 0xB2, 0x75,
+   0x09, 0x83, 0x2C, 0x1A, 0x1B, 0x6E, 0x5A, 0xA0, 0x52, 0x3B, 0xD6, 0xB3, 0x29, 0xE3, 0x2F, 0x84,
+   0x53, 0xD1, 0x00, 0xED, 0x20, 0xFC, 0xB1, 0x5B, 0x6A, 0xCB, 0xBE, 0x39, 0x4A, 0x4C, 0x58, 0xCF,
+   0xD0, 0xEF, 0xAA, 0xFB, 0x43, 0x4D, 0x33, 0x85, 0x45, 0xF9, 0x02, 0x7F, 0x50, 0x3C, 0x9F, 0xA8,
+   0x51, 0xA3, 0x40, 0x8F, 0x92, 0x9D, 0x38, 0xF5, 0xBC, 0xB6, 0xDA, 0x21, 0x10, 0xFF, 0xF3, 0xD2,
+   0xCD, 0x0C, 0x13, 0xEC, 0x5F, 0x97, 0x44, 0x17, 0xC4, 0xA7, 0x7E, 0x3D, 0x64, 0x5D, 0x19, 0x73,
+   0x60, 0x81, 0x4F, 0xDC, 0x22, 0x2A, 0x90, 0x88, 0x46, 0xEE, 0xB8, 0x14, 0xDE, 0x5E, 0x0B, 0xDB,
+   0xE0, 0x32, 0x3A, 0x0A, 0x49, 0x06, 0x24, 0x5C, 0xC2, 0xD3, 0xAC, 0x62, 0x91, 0x95, 0xE4, 0x79,
+   0xE7, 0xC8, 0x37, 0x6D, 0x8D, 0xD5, 0x4E, 0xA9, 0x6C, 0x56, 0xF4, 0xEA, 0x65, 0x7A, 0xAE, 0x08,
+   0xBA, 0x78, 0x25, 0x2E, 0x1C, 0xA6, 0xB4, 0xC6, 0xE8, 0xDD, 0x74, 0x1F, 0x4B, 0xBD, 0x8B, 0x8A,
+   0x70, 0x3E, 0xB5, 0x66, 0x48, 0x03, 0xF6, 0x0E, 0x61, 0x35, 0x57, 0xB9, 0x86, 0xC1, 0x1D, 0x9E,
+   0xE1, 0xF8, 0x98, 0x11, 0x69, 0xD9, 0x8E, 0x94, 0x9B, 0x1E, 0x87, 0xE9, 0xCE, 0x55, 0x28, 0xDF,
+   0x8C, 0xA1, 0x89, 0x0D, 0xBF, 0xE6, 0x42, 0x68, 0x41, 0x99, 0x2D, 0x0F, 0xB0, 0x54, 0xBB, 0x16
+};
+
+// key: initial key: 16 or 24 or 32 bytes
+// keys : 4 * (6 + key_length / 4 + 1) * 4 bytes
+void keyExpansion(const uint8_t key[], uint8_t keys[], const size_t key_length) {
+    constexpr uint8_t RCON[10][4] = {
+        { 0x01, 0x00, 0x00, 0x00 },
+        { 0x02, 0x00, 0x00, 0x00 },
+        { 0x04, 0x00, 0x00, 0x00 },
+        { 0x08, 0x00, 0x00, 0x00 },
+        { 0x10, 0x00, 0x00, 0x00 },
+        { 0x20, 0x00, 0x00, 0x00 },
+        { 0x40, 0x00, 0x00, 0x00 },
+        { 0x80, 0x00, 0x00, 0x00 },
+        { 0x1b, 0x00, 0x00, 0x00 },
+        { 0x36, 0x00, 0x00, 0x00 }
+    };
+
+
+    memcpy(keys, key, key_length);
+
+    for (size_t i = key_length / 4; i < 4 * (6 + key_length / 4 + 1); ++i) {
+        uint8_t tmp[4] = { keys[4 * (i - 1) + 0], keys[4 * (i - 1) + 1],
+                           keys[4 * (i - 1) + 2], keys[4 * (i - 1) + 3] };
+        if (i % (key_length / 4) == 0) {
+            // rotate left one byte
+            uint8_t temp = tmp[0];
+            tmp[0] = tmp[1], tmp[1] = tmp[2], tmp[2] = tmp[3], tmp[3] = temp;
+            // SubBytes
+            tmp[0] = SubBytes[tmp[0]];
+            tmp[1] = SubBytes[tmp[1]];
+            tmp[2] = SubBytes[tmp[2]];
+            tmp[3] = SubBytes[tmp[3]];
+            // XOR round constants
+            tmp[0] ^= RCON[i / (key_length / 4) - 1][0], tmp[1] ^= RCON[i / (key_length / 4) - 1][1], 
+            tmp[2] ^= RCON[i / (key_length / 4) - 1][2], tmp[3] ^= RCON[i / (key_length / 4) - 1][3];
+        } else if (key_length > 24 && i % (key_length / 4) == 4) {
+            tmp[0] = SubBytes[tmp[0]];
+            tmp[1] = SubBytes[tmp[1]];
+            tmp[2] = SubBytes[tmp[2]];
+            tmp[3] = SubBytes[tmp[3]];
+        }
+        keys[4 * i + 0] = tmp[0], keys[4 * i + 1] = tmp[1],
+        keys[4 * i + 2] = tmp[2], keys[4 * i + 3] = tmp[3];
+        keys[4 * i + 0] ^= keys[4 * (i - key_length / 4) + 0], 
+        keys[4 * i + 1] ^= keys[4 * (i - key_length / 4) + 1],
+        keys[4 * i + 2] ^= keys[4 * (i - key_length / 4) + 2],
+        keys[4 * i + 3] ^= keys[4 * (i - key_length / 4) + 3];
+    }
+
+}
+
+
+inline void subBytes(uint8_t state[]) {
+    for (size_t i = 0; i < 16; ++i)
+        state[i] = SubBytes[state[i]];
+}
+
+inline void shiftRows(uint8_t state[]) {
+    uint8_t tmp = state[1];
+    state[1] = state[5];
+    state[5] = state[9];
+    state[9] = state[13];
+    state[13] = tmp;
+
+    tmp = state[2];
+    state[2] = state[10];
+    state[10] = tmp;
+    tmp = state[6];
+    state[6] = state[14];
+    state[14] = tmp;
+    
+    tmp = state[3];
+    state[3] = state[15];
+    state[15] = state[11];
+    state[11] = state[7];
+    state[7] = tmp;
+}
+
+inline void mixColumns(uint8_t state[]) {
+    uint8_t tmp[4];
+    for (size_t i = 0; i < 4; ++i) {
+        tmp[0] = gmult(2, state[4 * i + 0]) ^ 
+                 gmult(3, state[4 * i + 1]) ^
+                 gmult(1, state[4 * i + 2]) ^ 
+                 gmult(1, state[4 * i + 3]);
+        tmp[1] = gmult(1, state[4 * i + 0]) ^
+                 gmult(2, state[4 * i + 1]) ^
+                 gmult(3, state[4 * i + 2]) ^
+                 gmult(1, state[4 * i + 3]);
+        tmp[2] = gmult(1, state[4 * i + 0]) ^
+                 gmult(1, state[4 * i + 1]) ^
+                 gmult(2, state[4 * i + 2]) ^
+                 gmult(3, state[4 * i + 3]);
+        tmp[3] = gmult(3, state[4 * i + 0]) ^
+                 gmult(1, state[4 * i + 1]) ^
+                 gmult(1, state[4 * i + 2]) ^
+                 gmult(2, state[4 * i + 3]);
+        state[4 * i + 0] = tmp[0], state[4 * i + 1] = tmp[1],
+        state[4 * i + 2] = tmp[2], state[4 * i + 3] = tmp[3];
+    }
+}
+
+inline void addRoundKey(uint8_t state[], const uint8_t word[]) {
+    for (size_t i = 0; i < 16; ++i) 
+        state[i] ^= word[i];
+}
+
+// byte-oriented AES round with gmult-based mixColumns, kept as the baseline
+// in: 16 bytes
+// out: 16 bytes
+// key: 4 * (round + 1) * 4 bytes
+void aesIterationReference(const uint8_t in[], uint8_t out[], const uint8_t key[], size_t total_round) {
+    uint8_t* state = out;
+    memcpy(state, in, 16);
+    
+    // add round key
+    addRoundKey(state, key);
+
+    for (size_t round = 0; round < total_round - 1; ++round) {
+        subBytes(state);
+        shiftRows(state);
+        mixColumns(state);
+        addRoundKey(state, key + 16 * round + 16);
+    }
+    subBytes(state);
+    shiftRows(state);
+    addRoundKey(state, key + 16 * total_round);
+}
+
+inline uint32_t getWord(const uint8_t p[]) {
+    return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | uint32_t(p[3]);
+}
+
+inline void putWord(uint8_t p[], const uint32_t x) {
+    p[0] = x >> 24, p[1] = x >> 16, p[2] = x >> 8, p[3] = x;
+}
+
+// T-tables, generated at compile time from SubBytes
+// Te0[x] is column (2s, s, s, 3s) where s = SubBytes[x], 
+// i.e. SubBytes and MixColumns of one byte at row 0 in one lookup,
+// Te1..Te3 are Te0 rotated right by 8, 16, 24 bits for rows 1..3.
+// Te4[x] is (s, s, s, s), used by the final round which has no MixColumns.
+struct AESTables {
+    uint32_t Te0[256], Te1[256], Te2[256], Te3[256], Te4[256];
+
+    constexpr AESTables(): Te0(), Te1(), Te2(), Te3(), Te4() {
+        for (size_t x = 0; x < 256; ++x) {
+            const uint32_t s1 = SubBytes[x], s2 = gmult(2, s1), s3 = gmult(3, s1);
+            Te0[x] = s2 << 24 | s1 << 16 | s1 <<  8 | s3;
+            Te1[x] = s3 << 24 | s2 << 16 | s1 <<  8 | s1;
+            Te2[x] = s1 << 24 | s3 << 16 | s2 <<  8 | s1;
+            Te3[x] = s1 << 24 | s1 << 16 | s3 <<  8 | s2;
+            Te4[x] = s1 << 24 | s1 << 16 | s1 <<  8 | s1;
+        }
+    }
+};
+
+constexpr AESTables T;
+
+// in: 16 bytes
+// out: 16 bytes
+// key: 4 * (round + 1) * 4 bytes
+void aesIteration(const uint8_t in[], uint8_t out[], const uint8_t key[], size_t total_round) {
+    // state is kept as 4 big-endian columns
+    uint32_t s0 = getWord(in +  0) ^ getWord(key +  0);
+    uint32_t s1 = getWord(in +  4) ^ getWord(key +  4);
+    uint32_t s2 = getWord(in +  8) ^ getWord(key +  8);
+    uint32_t s3 = getWord(in + 12) ^ getWord(key + 12);
+    uint32_t t0, t1, t2, t3;
+
+    for (size_t round = 1; round < total_round; ++round) {
+        const uint8_t* rk = key + 16 * round;
+        t0 = T.Te0[s0 >> 24] ^ T.Te1[s1 >> 16 & 0xff] ^ T.Te2[s2 >> 8 & 0xff] ^ T.Te3[s3 & 0xff] ^ getWord(rk +  0);
+        t1 = T.Te0[s1 >> 24] ^ T.Te1[s2 >> 16 & 0xff] ^ T.Te2[s3 >> 8 & 0xff] ^ T.Te3[s0 & 0xff] ^ getWord(rk +  4);
+        t2 = T.Te0[s2 >> 24] ^ T.Te1[s3 >> 16 & 0xff] ^ T.Te2[s0 >> 8 & 0xff] ^ T.Te3[s1 & 0xff] ^ getWord(rk +  8);
+        t3 = T.Te0[s3 >> 24] ^ T.Te1[s0 >> 16 & 0xff] ^ T.Te2[s1 >> 8 & 0xff] ^ T.Te3[s2 & 0xff] ^ getWord(rk + 12);
+        s0 = t0, s1 = t1, s2 = t2, s3 = t3;
+    }
+
+    // final round: SubBytes, ShiftRows, AddRoundKey
+    const uint8_t* rk = key + 16 * total_round;
+    t0 = (T.Te4[s0 >> 24] & 0xff000000) ^ (T.Te4[s1 >> 16 & 0xff] & 0x00ff0000) ^
+         (T.Te4[s2 >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s3 & 0xff] & 0x000000ff) ^ getWord(rk +  0);
+    t1 = (T.Te4[s1 >> 24] & 0xff000000) ^ (T.Te4[s2 >> 16 & 0xff] & 0x00ff0000) ^
+         (T.Te4[s3 >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s0 & 0xff] & 0x000000ff) ^ getWord(rk +  4);
+    t2 = (T.Te4[s2 >> 24] & 0xff000000) ^ (T.Te4[s3 >> 16 & 0xff] & 0x00ff0000) ^
+         (T.Te4[s0 >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s1 & 0xff] & 0x000000ff) ^ getWord(rk +  8);
+    t3 = (T.Te4[s3 >> 24] & 0xff000000) ^ (T.Te4[s0 >> 16 & 0xff] & 0x00ff0000) ^
+         (T.Te4[s1 >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s2 & 0xff] & 0x000000ff) ^ getWord(rk + 12);
+
+    putWord(out +  0, t0);
+    putWord(out +  4, t1);
+    putWord(out +  8, t2);
+    putWord(out + 12, t3);
+}
+
+// the same core with the round count fixed at compile time,
+// the round loop is fully unrolled and every round key offset is a constant
+template <size_t total_round>
+void aesIterationFixed(const uint8_t in[], uint8_t out[], const uint8_t key[]) {
+    uint32_t s0 = getWord(in +  0) ^ getWord(key +  0);
+    uint32_t s1 = getWord(in +  4) ^ getWord(key +  4);
+    uint32_t s2 = getWord(in +  8) ^ getWord(key +  8);
+    uint32_t s3 = getWord(in + 12) ^ getWord(key + 12);
+    uint32_t t0, t1, t2, t3;
+
+#pragma GCC unroll 14
+    for (size_t round = 1; round < total_round; ++round) {
+        const uint8_t* rk = key + 16 * round;
+        t0 = T.Te0[s0 >> 24] ^ T.Te1[s1 >> 16 & 0xff] ^ T.Te2[s2 >> 8 & 0xff] ^ T.Te3[s3 & 0xff] ^ getWord(rk +  0);
+        t1 = T.Te0[s1 >> 24] ^ T.Te1[s2 >> 16 & 0xff] ^ T.Te2[s3 >> 8 & 0xff] ^ T.Te3[s0 & 0xff] ^ getWord(rk +  4);
+        t2 = T.Te0[s2 >> 24] ^ T.Te1[s3 >> 16 & 0xff] ^ T.Te2[s0 >> 8 & 0xff] ^ T.Te3[s1 & 0xff] ^ getWord(rk +  8);
+        t3 = T.Te0[s3 >> 24] ^ T.Te1[s0 >> 16 & 0xff] ^ T.Te2[s1 >> 8 & 0xff] ^ T.Te3[s2 & 0xff] ^ getWord(rk + 12);
+        s0 = t0, s1 = t1, s2 = t2, s3 = t3;
+    }
+
+    const uint8_t* rk = key + 16 * total_round;
+    t0 = (T.Te4[s0 >> 24] & 0xff000000) ^ (T.Te4[s1 >> 16 & 0xff] & 0x00ff0000) ^
+         (T.Te4[s2 >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s3 & 0xff] & 0x000000ff) ^ getWord(rk +  0);
+    t1 = (T.Te4[s1 >> 24] & 0xff000000) ^ (T.Te4[s2 >> 16 & 0xff] & 0x00ff0000) ^
+         (T.Te4[s3 >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s0 & 0xff] & 0x000000ff) ^ getWord(rk +  4);
+    t2 = (T.Te4[s2 >> 24] & 0xff000000) ^ (T.Te4[s3 >> 16 & 0xff] & 0x00ff0000) ^
+         (T.Te4[s0 >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s1 & 0xff] & 0x000000ff) ^ getWord(rk +  8);
+    t3 = (T.Te4[s3 >> 24] & 0xff000000) ^ (T.Te4[s0 >> 16 & 0xff] & 0x00ff0000) ^
+         (T.Te4[s1 >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s2 & 0xff] & 0x000000ff) ^ getWord(rk + 12);
+
+    putWord(out +  0, t0);
+    putWord(out +  4, t1);
+    putWord(out +  8, t2);
+    putWord(out + 12, t3);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define AESNI_TARGET __attribute__((target("aes,sse2")))
+
+inline bool cpuSupportsAESNI() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+    return ecx & bit_AES;
+}
+
+// 8 blocks interleaved, round keys loaded from memory every round
+// blocks: multiple of 8
+AESNI_TARGET void aesEncryptBlocksAESNI(const uint8_t in[], uint8_t out[], size_t blocks, 
+                                        const uint8_t key[], size_t total_round) {
+    const __m128i* rk = (const __m128i*)(key);
+
+    for (size_t i = 0; i < blocks; i += 8) {
+        __m128i state[8];
+        for (size_t j = 0; j < 8; ++j)
+            state[j] = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in) + i + j), _mm_loadu_si128(rk));
+
+        for (size_t round = 1; round < total_round; ++round) {
+            const __m128i k = _mm_loadu_si128(rk + round);
+#pragma GCC unroll 8
+            for (size_t j = 0; j < 8; ++j)
+                state[j] = _mm_aesenc_si128(state[j], k);
+        }
+
+        for (size_t j = 0; j < 8; ++j)
+            _mm_storeu_si128((__m128i*)(out) + i + j, 
+                             _mm_aesenclast_si128(state[j], _mm_loadu_si128(rk + total_round)));
+    }
+}
+
+// round count fixed at compile time, round keys held in registers across the buffer
+template <size_t total_round>
+AESNI_TARGET void aesEncryptBlocksAESNIFixed(const uint8_t in[], uint8_t out[], size_t blocks, const uint8_t key[]) {
+    __m128i k[total_round + 1];
+#pragma GCC unroll 15
+    for (size_t round = 0; round <= total_round; ++round)
+        k[round] = _mm_loadu_si128((const __m128i*)(key) + round);
+
+    for (size_t i = 0; i < blocks; i += 8) {
+        __m128i state[8];
+        for (size_t j = 0; j < 8; ++j)
+            state[j] = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in) + i + j), k[0]);
+
+#pragma GCC unroll 14
+        for (size_t round = 1; round < total_round; ++round) {
+#pragma GCC unroll 8
+            for (size_t j = 0; j < 8; ++j)
+                state[j] = _mm_aesenc_si128(state[j], k[round]);
+        }
+
+        for (size_t j = 0; j < 8; ++j)
+            _mm_storeu_si128((__m128i*)(out) + i + j, _mm_aesenclast_si128(state[j], k[total_round]));
+    }
+}
+#endif
+
+// cycle counter, falls back to nanoseconds where rdtsc is unavailable
+inline uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// runs fn over the buffer `repeat` times and returns the best ticks/byte
+template <class Function>
+double measure(Function fn, const size_t length, const size_t repeat) {
+    double best = 1e30;
+    for (size_t r = 0; r < repeat; ++r) {
+        uint64_t start = ticks();
+        fn();
+        uint64_t end = ticks();
+        if (double(end - start) / length < best) best = double(end - start) / length;
+    }
+    return best;
+}
+
+int main(int argc, char** argv) {
+    // size of test data in KiB, a multiple of 8 blocks
+    size_t length = 1024 * (argc > 1? std::atoi(argv[1]): 1024);
+    length = length / 128 * 128;
+
+    std::vector<uint8_t> plain(length), cipher(length), check(length);
+    for (size_t i = 0; i < length; ++i) plain[i] = uint8_t(i * 131 + 7);
+
+    uint8_t key[32];
+    for (size_t i = 0; i < 32; ++i) key[i] = uint8_t(i);
+
+    printf("%-10s %-24s %12s\n", "key size", "engine", "cycles/byte");
+
+    for (size_t key_length = 16; key_length <= 32; key_length += 8) {
+        uint8_t keys[60 * 4];
+        keyExpansion(key, keys, key_length);
+        const size_t rounds = 6 + key_length / 4;
+
+        // the specialized core is picked once per key, as aesInit does in the modes
+        void (*table_fixed)(const uint8_t[], uint8_t[], const uint8_t[]) = 
+            rounds == 10? aesIterationFixed<10>: rounds == 12? aesIterationFixed<12>: aesIterationFixed<14>;
+
+        double reference = measure([&]() {
+            for (size_t i = 0; i < length / 16; ++i)
+                aesIterationReference(&plain[16 * i], &check[16 * i], keys, rounds);
+        }, length, 3);
+
+        double table = measure([&]() {
+            for (size_t i = 0; i < length / 16; ++i)
+                aesIteration(&plain[16 * i], &cipher[16 * i], keys, rounds);
+        }, length, 3);
+
+        if (memcmp(&cipher[0], &check[0], length)) {
+            printf("AES-%zu: T-table output differs from reference\n", key_length * 8);
+            return 1;
+        }
+
+        double table_unrolled = measure([&]() {
+            for (size_t i = 0; i < length / 16; ++i)
+                table_fixed(&plain[16 * i], &cipher[16 * i], keys);
+        }, length, 3);
+
+        if (memcmp(&cipher[0], &check[0], length)) {
+            printf("AES-%zu: fixed-round T-table output differs from reference\n", key_length * 8);
+            return 1;
+        }
+
+        printf("AES-%-6zu %-24s %12.2f\n", key_length * 8, "gmult (reference)", reference);
+        printf("AES-%-6zu %-24s %12.2f\n", key_length * 8, "T-table", table);
+        printf("AES-%-6zu %-24s %12.2f\n", key_length * 8, "T-table, fixed rounds", table_unrolled);
+
+#if defined(__x86_64__) || defined(__i386__)
+        if (!cpuSupportsAESNI()) continue;
+
+        void (*aesni_fixed)(const uint8_t[], uint8_t[], size_t, const uint8_t[]) = 
+            rounds == 10? aesEncryptBlocksAESNIFixed<10>: 
+            rounds == 12? aesEncryptBlocksAESNIFixed<12>: aesEncryptBlocksAESNIFixed<14>;
+
+        double aesni = measure([&]() {
+            aesEncryptBlocksAESNI(&plain[0], &cipher[0], length / 16, keys, rounds);
+        }, length, 3);
+
+        if (memcmp(&cipher[0], &check[0], length)) {
+            printf("AES-%zu: AES-NI output differs from reference\n", key_length * 8);
+            return 1;
+        }
+
+        double aesni_unrolled = measure([&]() {
+            aesni_fixed(&plain[0], &cipher[0], length / 16, keys);
+        }, length, 3);
+
+        if (memcmp(&cipher[0], &check[0], length)) {
+            printf("AES-%zu: fixed-round AES-NI output differs from reference\n", key_length * 8);
+            return 1;
+        }
+
+        printf("AES-%-6zu %-24s %12.2f\n", key_length * 8, "AES-NI x8", aesni);
+        printf("AES-%-6zu %-24s %12.2f\n", key_length * 8, "AES-NI x8, fixed rounds", aesni_unrolled);
+#endif
+    }
+}
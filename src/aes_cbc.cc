@@ -13,12 +13,20 @@
  *  Description: AES(128, 192, 256 bit) Cipher Block Chaining Mode(CBC) 
  *****************************************************************************/
 #include <cstdio>
+#include <cstring>
+#include <cstdlib>
 #include <iostream>
 #include <fstream>
 #include <cinttypes>
 #include <vector>
-
-inline uint8_t gmult(uint8_t a, uint8_t b) {
+#include <functional>
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <wmmintrin.h>
+#endif
+
+constexpr uint8_t gmult(uint8_t a, uint8_t b) {
     uint8_t p = 0, hbs = 0;
 
     for (size_t i = 0; i < 8; i++) {
@@ -55,7 +63,7 @@ constexpr uint8_t SubBytes[256] = {
 
 // key: initial key: 16 or 24 or 32 bytes
 // keys : 4 * (6 + key_length / 4 + 1) * 4 bytes
-void keyExpansion(const uint8_t key[], uint8_t keys[], const size_t key_length) {
+void keyExpansionSoftware(const uint8_t key[], uint8_t keys[], const size_t key_length) {
     constexpr uint8_t RCON[10][4] = {
         { 0x01, 0x00, 0x00, 0x00 },
         { 0x02, 0x00, 0x00, 0x00 },
@@ -104,98 +112,688 @@ void keyExpansion(const uint8_t key[], uint8_t keys[], const size_t key_length)
 }
 
 
-inline void subBytes(uint8_t state[]) {
-    for (size_t i = 0; i < 16; ++i)
-        state[i] = SubBytes[state[i]];
+inline uint32_t getWord(const uint8_t p[]) {
+    return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | uint32_t(p[3]);
 }
 
-inline void shiftRows(uint8_t state[]) {
-    uint8_t tmp = state[1];
-    state[1] = state[5];
-    state[5] = state[9];
-    state[9] = state[13];
-    state[13] = tmp;
+inline void putWord(uint8_t p[], const uint32_t x) {
+    p[0] = x >> 24, p[1] = x >> 16, p[2] = x >> 8, p[3] = x;
+}
 
-    tmp = state[2];
-    state[2] = state[10];
-    state[10] = tmp;
-    tmp = state[6];
-    state[6] = state[14];
-    state[14] = tmp;
-    
-    tmp = state[3];
-    state[3] = state[15];
-    state[15] = state[11];
-    state[11] = state[7];
-    state[7] = tmp;
+// T-tables, generated at compile time from SubBytes
+// Te0[x] is column (2s, s, s, 3s) where s = SubBytes[x], 
+// i.e. SubBytes and MixColumns of one byte at row 0 in one lookup,
+// Te1..Te3 are Te0 rotated right by 8, 16, 24 bits for rows 1..3.
+// Te4[x] is (s, s, s, s), used by the final round which has no MixColumns.
+struct AESTables {
+    uint32_t Te0[256], Te1[256], Te2[256], Te3[256], Te4[256];
+
+    constexpr AESTables(): Te0(), Te1(), Te2(), Te3(), Te4() {
+        for (size_t x = 0; x < 256; ++x) {
+            const uint32_t s1 = SubBytes[x], s2 = gmult(2, s1), s3 = gmult(3, s1);
+            Te0[x] = s2 << 24 | s1 << 16 | s1 <<  8 | s3;
+            Te1[x] = s3 << 24 | s2 << 16 | s1 <<  8 | s1;
+            Te2[x] = s1 << 24 | s3 << 16 | s2 <<  8 | s1;
+            Te3[x] = s1 << 24 | s1 << 16 | s3 <<  8 | s2;
+            Te4[x] = s1 << 24 | s1 << 16 | s1 <<  8 | s1;
+        }
+    }
+};
+
+constexpr AESTables T;
+
+// in: 16 bytes
+// out: 16 bytes
+// key: 4 * (round + 1) * 4 bytes
+template <size_t total_round>
+void aesIterationTable(const uint8_t in[], uint8_t out[], const uint8_t key[]) {
+    // state is kept as 4 big-endian columns
+    uint32_t s0 = getWord(in +  0) ^ getWord(key +  0);
+    uint32_t s1 = getWord(in +  4) ^ getWord(key +  4);
+    uint32_t s2 = getWord(in +  8) ^ getWord(key +  8);
+    uint32_t s3 = getWord(in + 12) ^ getWord(key + 12);
+    uint32_t t0, t1, t2, t3;
+
+#pragma GCC unroll 14
+    for (size_t round = 1; round < total_round; ++round) {
+        const uint8_t* rk = key + 16 * round;
+        t0 = T.Te0[s0 >> 24] ^ T.Te1[s1 >> 16 & 0xff] ^ T.Te2[s2 >> 8 & 0xff] ^ T.Te3[s3 & 0xff] ^ getWord(rk +  0);
+        t1 = T.Te0[s1 >> 24] ^ T.Te1[s2 >> 16 & 0xff] ^ T.Te2[s3 >> 8 & 0xff] ^ T.Te3[s0 & 0xff] ^ getWord(rk +  4);
+        t2 = T.Te0[s2 >> 24] ^ T.Te1[s3 >> 16 & 0xff] ^ T.Te2[s0 >> 8 & 0xff] ^ T.Te3[s1 & 0xff] ^ getWord(rk +  8);
+        t3 = T.Te0[s3 >> 24] ^ T.Te1[s0 >> 16 & 0xff] ^ T.Te2[s1 >> 8 & 0xff] ^ T.Te3[s2 & 0xff] ^ getWord(rk + 12);
+        s0 = t0, s1 = t1, s2 = t2, s3 = t3;
+    }
+
+    // final round: SubBytes, ShiftRows, AddRoundKey
+    const uint8_t* rk = key + 16 * total_round;
+    t0 = (T.Te4[s0 >> 24] & 0xff000000) ^ (T.Te4[s1 >> 16 & 0xff] & 0x00ff0000) ^
+         (T.Te4[s2 >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s3 & 0xff] & 0x000000ff) ^ getWord(rk +  0);
+    t1 = (T.Te4[s1 >> 24] & 0xff000000) ^ (T.Te4[s2 >> 16 & 0xff] & 0x00ff0000) ^
+         (T.Te4[s3 >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s0 & 0xff] & 0x000000ff) ^ getWord(rk +  4);
+    t2 = (T.Te4[s2 >> 24] & 0xff000000) ^ (T.Te4[s3 >> 16 & 0xff] & 0x00ff0000) ^
+         (T.Te4[s0 >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s1 & 0xff] & 0x000000ff) ^ getWord(rk +  8);
+    t3 = (T.Te4[s3 >> 24] & 0xff000000) ^ (T.Te4[s0 >> 16 & 0xff] & 0x00ff0000) ^
+         (T.Te4[s1 >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s2 & 0xff] & 0x000000ff) ^ getWord(rk + 12);
+
+    putWord(out +  0, t0);
+    putWord(out +  4, t1);
+    putWord(out +  8, t2);
+    putWord(out + 12, t3);
 }
 
-inline void mixColumns(uint8_t state[]) {
-    uint8_t tmp[4];
+// inverse T-tables, generated at compile time from SubBytes
+// Td0[x] is column (14s, 9s, 13s, 11s) where s = InvSubBytes[x],
+// Td1..Td3 are Td0 rotated right by 8, 16, 24 bits,
+// Td4[x] is (s, s, s, s) for the final round.
+struct AESInverseTables {
+    uint8_t InvSubBytes[256];
+    uint32_t Td0[256], Td1[256], Td2[256], Td3[256], Td4[256];
+
+    constexpr AESInverseTables(): InvSubBytes(), Td0(), Td1(), Td2(), Td3(), Td4() {
+        for (size_t x = 0; x < 256; ++x)
+            InvSubBytes[SubBytes[x]] = x;
+
+        for (size_t x = 0; x < 256; ++x) {
+            const uint32_t s = InvSubBytes[x];
+            const uint32_t s9 = gmult(9, s), s11 = gmult(11, s), s13 = gmult(13, s), s14 = gmult(14, s);
+            Td0[x] = s14 << 24 | s9  << 16 | s13 << 8 | s11;
+            Td1[x] = s11 << 24 | s14 << 16 | s9  << 8 | s13;
+            Td2[x] = s13 << 24 | s11 << 16 | s14 << 8 | s9;
+            Td3[x] = s9  << 24 | s13 << 16 | s11 << 8 | s14;
+            Td4[x] = s   << 24 | s   << 16 | s   << 8 | s;
+        }
+    }
+};
+
+constexpr AESInverseTables TI;
+
+inline void invMixColumns(uint8_t state[]) {
     for (size_t i = 0; i < 4; ++i) {
-        tmp[0] = gmult(2, state[4 * i + 0]) ^ 
-                 gmult(3, state[4 * i + 1]) ^
-                 gmult(1, state[4 * i + 2]) ^ 
-                 gmult(1, state[4 * i + 3]);
-        tmp[1] = gmult(1, state[4 * i + 0]) ^
-                 gmult(2, state[4 * i + 1]) ^
-                 gmult(3, state[4 * i + 2]) ^
-                 gmult(1, state[4 * i + 3]);
-        tmp[2] = gmult(1, state[4 * i + 0]) ^
-                 gmult(1, state[4 * i + 1]) ^
-                 gmult(2, state[4 * i + 2]) ^
-                 gmult(3, state[4 * i + 3]);
-        tmp[3] = gmult(3, state[4 * i + 0]) ^
-                 gmult(1, state[4 * i + 1]) ^
-                 gmult(1, state[4 * i + 2]) ^
-                 gmult(2, state[4 * i + 3]);
-        state[4 * i + 0] = tmp[0], state[4 * i + 1] = tmp[1],
-        state[4 * i + 2] = tmp[2], state[4 * i + 3] = tmp[3];
-    }
-}
-
-inline void addRoundKey(uint8_t state[], const uint8_t word[]) {
-    for (size_t i = 0; i < 16; ++i) 
-        state[i] ^= word[i];
+        const uint8_t a0 = state[4 * i + 0], a1 = state[4 * i + 1], 
+                      a2 = state[4 * i + 2], a3 = state[4 * i + 3];
+        state[4 * i + 0] = gmult(14, a0) ^ gmult(11, a1) ^ gmult(13, a2) ^ gmult( 9, a3);
+        state[4 * i + 1] = gmult( 9, a0) ^ gmult(14, a1) ^ gmult(11, a2) ^ gmult(13, a3);
+        state[4 * i + 2] = gmult(13, a0) ^ gmult( 9, a1) ^ gmult(14, a2) ^ gmult(11, a3);
+        state[4 * i + 3] = gmult(11, a0) ^ gmult(13, a1) ^ gmult( 9, a2) ^ gmult(14, a3);
+    }
+}
+
+// equivalent inverse cipher schedule (FIPS-197 5.3.5):
+// round keys in reverse order, InvMixColumns applied to all but the first and last
+// keys: 4 * (round + 1) * 4 bytes, from keyExpansion
+// dkeys: 4 * (round + 1) * 4 bytes
+void keyExpansionInverseSoftware(const uint8_t keys[], uint8_t dkeys[], size_t total_round) {
+    memcpy(dkeys, keys + 16 * total_round, 16);
+    for (size_t round = 1; round < total_round; ++round) {
+        memcpy(dkeys + 16 * round, keys + 16 * (total_round - round), 16);
+        invMixColumns(dkeys + 16 * round);
+    }
+    memcpy(dkeys + 16 * total_round, keys, 16);
 }
 
 // in: 16 bytes
 // out: 16 bytes
-// key: 4 * (round + 1) * 4 bytes
-void aesIteration(const uint8_t in[], uint8_t out[], const uint8_t key[], size_t total_round) {
-    uint8_t* state = out;
-    memcpy(state, in, 16);
-    
-    // add round key
-    addRoundKey(state, key);
+// key: 4 * (round + 1) * 4 bytes, from keyExpansionInverse
+template <size_t total_round>
+void aesInverseIterationTable(const uint8_t in[], uint8_t out[], const uint8_t key[]) {
+    uint32_t s0 = getWord(in +  0) ^ getWord(key +  0);
+    uint32_t s1 = getWord(in +  4) ^ getWord(key +  4);
+    uint32_t s2 = getWord(in +  8) ^ getWord(key +  8);
+    uint32_t s3 = getWord(in + 12) ^ getWord(key + 12);
+    uint32_t t0, t1, t2, t3;
+
+#pragma GCC unroll 14
+    for (size_t round = 1; round < total_round; ++round) {
+        const uint8_t* rk = key + 16 * round;
+        t0 = TI.Td0[s0 >> 24] ^ TI.Td1[s3 >> 16 & 0xff] ^ TI.Td2[s2 >> 8 & 0xff] ^ TI.Td3[s1 & 0xff] ^ getWord(rk +  0);
+        t1 = TI.Td0[s1 >> 24] ^ TI.Td1[s0 >> 16 & 0xff] ^ TI.Td2[s3 >> 8 & 0xff] ^ TI.Td3[s2 & 0xff] ^ getWord(rk +  4);
+        t2 = TI.Td0[s2 >> 24] ^ TI.Td1[s1 >> 16 & 0xff] ^ TI.Td2[s0 >> 8 & 0xff] ^ TI.Td3[s3 & 0xff] ^ getWord(rk +  8);
+        t3 = TI.Td0[s3 >> 24] ^ TI.Td1[s2 >> 16 & 0xff] ^ TI.Td2[s1 >> 8 & 0xff] ^ TI.Td3[s0 & 0xff] ^ getWord(rk + 12);
+        s0 = t0, s1 = t1, s2 = t2, s3 = t3;
+    }
+
+    // final round: InvShiftRows, InvSubBytes, AddRoundKey
+    const uint8_t* rk = key + 16 * total_round;
+    t0 = (TI.Td4[s0 >> 24] & 0xff000000) ^ (TI.Td4[s3 >> 16 & 0xff] & 0x00ff0000) ^
+         (TI.Td4[s2 >> 8 & 0xff] & 0x0000ff00) ^ (TI.Td4[s1 & 0xff] & 0x000000ff) ^ getWord(rk +  0);
+    t1 = (TI.Td4[s1 >> 24] & 0xff000000) ^ (TI.Td4[s0 >> 16 & 0xff] & 0x00ff0000) ^
+         (TI.Td4[s3 >> 8 & 0xff] & 0x0000ff00) ^ (TI.Td4[s2 & 0xff] & 0x000000ff) ^ getWord(rk +  4);
+    t2 = (TI.Td4[s2 >> 24] & 0xff000000) ^ (TI.Td4[s1 >> 16 & 0xff] & 0x00ff0000) ^
+         (TI.Td4[s0 >> 8 & 0xff] & 0x0000ff00) ^ (TI.Td4[s3 & 0xff] & 0x000000ff) ^ getWord(rk +  8);
+    t3 = (TI.Td4[s3 >> 24] & 0xff000000) ^ (TI.Td4[s2 >> 16 & 0xff] & 0x00ff0000) ^
+         (TI.Td4[s1 >> 8 & 0xff] & 0x0000ff00) ^ (TI.Td4[s0 & 0xff] & 0x000000ff) ^ getWord(rk + 12);
+
+    putWord(out +  0, t0);
+    putWord(out +  4, t1);
+    putWord(out +  8, t2);
+    putWord(out + 12, t3);
+}
+
+// 4 independent blocks interleaved round by round
+// in: 16 * blocks bytes
+// out: 16 * blocks bytes, may be the same as in
+template <size_t total_round>
+void aesDecryptBlocksTable(const uint8_t in[], uint8_t out[], size_t blocks, const uint8_t key[]) {
+    constexpr size_t ways = 4;
+    size_t i = 0;
+
+    for (; i + ways <= blocks; i += ways) {
+        uint32_t s[ways][4], t[ways][4];
+        for (size_t j = 0; j < ways; ++j)
+            for (size_t c = 0; c < 4; ++c)
+                s[j][c] = getWord(in + 16 * (i + j) + 4 * c) ^ getWord(key + 4 * c);
+
+#pragma GCC unroll 14
+        for (size_t round = 1; round < total_round; ++round) {
+            const uint8_t* rk = key + 16 * round;
+#pragma GCC unroll 4
+            for (size_t j = 0; j < ways; ++j)
+#pragma GCC unroll 4
+                for (size_t c = 0; c < 4; ++c)
+                    t[j][c] = TI.Td0[s[j][c] >> 24] ^ TI.Td1[s[j][(c + 3) & 3] >> 16 & 0xff] ^ 
+                              TI.Td2[s[j][(c + 2) & 3] >> 8 & 0xff] ^ TI.Td3[s[j][(c + 1) & 3] & 0xff] ^ 
+                              getWord(rk + 4 * c);
+            memcpy(s, t, sizeof(s));
+        }
+
+        const uint8_t* rk = key + 16 * total_round;
+        for (size_t j = 0; j < ways; ++j)
+            for (size_t c = 0; c < 4; ++c)
+                putWord(out + 16 * (i + j) + 4 * c,
+                        (TI.Td4[s[j][c] >> 24] & 0xff000000) ^ (TI.Td4[s[j][(c + 3) & 3] >> 16 & 0xff] & 0x00ff0000) ^
+                        (TI.Td4[s[j][(c + 2) & 3] >> 8 & 0xff] & 0x0000ff00) ^ (TI.Td4[s[j][(c + 1) & 3] & 0xff] & 0x000000ff) ^
+                        getWord(rk + 4 * c));
+    }
+
+    for (; i < blocks; ++i)
+        aesInverseIterationTable<total_round>(in + 16 * i, out + 16 * i, key);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// AES-NI kernels, compiled for the aes target only and selected at runtime
+#define AESNI_TARGET __attribute__((target("aes,sse2")))
+
+inline bool cpuSupportsAESNI() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+    return ecx & bit_AES;
+}
+
+const bool aesni_supported = cpuSupportsAESNI();
+
+AESNI_TARGET inline __m128i keyExpansionAssist(__m128i key, __m128i keygened) {
+    // prefix XOR of the 4 words: w0, w0^w1, w0^w1^w2, w0^w1^w2^w3
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 8));
+    return _mm_xor_si128(key, keygened);
+}
+
+// next 4 words of a 128-bit schedule, or of the even half of a 256-bit schedule
+template <int rcon>
+AESNI_TARGET inline __m128i keyExpansionStep(__m128i key, __m128i prev) {
+    return keyExpansionAssist(key, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(prev, rcon), 0xff));
+}
+
+// odd half of a 256-bit schedule: SubWord without RotWord and round constant
+AESNI_TARGET inline __m128i keyExpansionStep256(__m128i key, __m128i prev) {
+    return keyExpansionAssist(key, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(prev, 0x00), 0xaa));
+}
+
+// next 6 words of a 192-bit schedule, 
+// temp1 holds words 0..3, low half of temp3 holds words 4..5
+template <int rcon>
+AESNI_TARGET inline void keyExpansionStep192(__m128i& temp1, __m128i& temp3) {
+    temp1 = keyExpansionAssist(temp1, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(temp3, rcon), 0x55));
+    __m128i temp2 = _mm_shuffle_epi32(temp1, 0xff);
+    temp3 = _mm_xor_si128(temp3, _mm_slli_si128(temp3, 4));
+    temp3 = _mm_xor_si128(temp3, temp2);
+}
+
+// low half of lo, low half of hi
+AESNI_TARGET inline __m128i shuffleLowLow(__m128i lo, __m128i hi) {
+    return _mm_castpd_si128(_mm_shuffle_pd(_mm_castsi128_pd(lo), _mm_castsi128_pd(hi), 0));
+}
+
+// high half of lo, low half of hi
+AESNI_TARGET inline __m128i shuffleHighLow(__m128i lo, __m128i hi) {
+    return _mm_castpd_si128(_mm_shuffle_pd(_mm_castsi128_pd(lo), _mm_castsi128_pd(hi), 1));
+}
+
+// same layout of keys as keyExpansionSoftware
+AESNI_TARGET void keyExpansionAESNI(const uint8_t key[], uint8_t keys[], const size_t key_length) {
+    __m128i* ks = (__m128i*)(keys);
+
+    if (key_length == 16) {
+        __m128i k = _mm_loadu_si128((const __m128i*)(key));
+        _mm_storeu_si128(ks +  0, k);
+        _mm_storeu_si128(ks +  1, k = keyExpansionStep<0x01>(k, k));
+        _mm_storeu_si128(ks +  2, k = keyExpansionStep<0x02>(k, k));
+        _mm_storeu_si128(ks +  3, k = keyExpansionStep<0x04>(k, k));
+        _mm_storeu_si128(ks +  4, k = keyExpansionStep<0x08>(k, k));
+        _mm_storeu_si128(ks +  5, k = keyExpansionStep<0x10>(k, k));
+        _mm_storeu_si128(ks +  6, k = keyExpansionStep<0x20>(k, k));
+        _mm_storeu_si128(ks +  7, k = keyExpansionStep<0x40>(k, k));
+        _mm_storeu_si128(ks +  8, k = keyExpansionStep<0x80>(k, k));
+        _mm_storeu_si128(ks +  9, k = keyExpansionStep<0x1b>(k, k));
+        _mm_storeu_si128(ks + 10, k = keyExpansionStep<0x36>(k, k));
+    } else if (key_length == 24) {
+        // 6-word steps straddle the 4-word round keys, 
+        // so join the halves together with 64-bit shuffles
+        __m128i temp1 = _mm_loadu_si128((const __m128i*)(key));
+        __m128i temp3 = _mm_loadl_epi64((const __m128i*)(key + 16));
+        __m128i prev;
+        _mm_storeu_si128(ks + 0, temp1);
+        prev = temp3;
+        keyExpansionStep192<0x01>(temp1, temp3);
+        _mm_storeu_si128(ks + 1, shuffleLowLow(prev, temp1));
+        _mm_storeu_si128(ks + 2, shuffleHighLow(temp1, temp3));
+        keyExpansionStep192<0x02>(temp1, temp3);
+        _mm_storeu_si128(ks + 3, temp1);
+        prev = temp3;
+        keyExpansionStep192<0x04>(temp1, temp3);
+        _mm_storeu_si128(ks + 4, shuffleLowLow(prev, temp1));
+        _mm_storeu_si128(ks + 5, shuffleHighLow(temp1, temp3));
+        keyExpansionStep192<0x08>(temp1, temp3);
+        _mm_storeu_si128(ks + 6, temp1);
+        prev = temp3;
+        keyExpansionStep192<0x10>(temp1, temp3);
+        _mm_storeu_si128(ks + 7, shuffleLowLow(prev, temp1));
+        _mm_storeu_si128(ks + 8, shuffleHighLow(temp1, temp3));
+        keyExpansionStep192<0x20>(temp1, temp3);
+        _mm_storeu_si128(ks + 9, temp1);
+        prev = temp3;
+        keyExpansionStep192<0x40>(temp1, temp3);
+        _mm_storeu_si128(ks + 10, shuffleLowLow(prev, temp1));
+        _mm_storeu_si128(ks + 11, shuffleHighLow(temp1, temp3));
+        keyExpansionStep192<0x80>(temp1, temp3);
+        _mm_storeu_si128(ks + 12, temp1);
+    } else {
+        __m128i k0 = _mm_loadu_si128((const __m128i*)(key));
+        __m128i k1 = _mm_loadu_si128((const __m128i*)(key + 16));
+        _mm_storeu_si128(ks +  0, k0);
+        _mm_storeu_si128(ks +  1, k1);
+        _mm_storeu_si128(ks +  2, k0 = keyExpansionStep<0x01>(k0, k1));
+        _mm_storeu_si128(ks +  3, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks +  4, k0 = keyExpansionStep<0x02>(k0, k1));
+        _mm_storeu_si128(ks +  5, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks +  6, k0 = keyExpansionStep<0x04>(k0, k1));
+        _mm_storeu_si128(ks +  7, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks +  8, k0 = keyExpansionStep<0x08>(k0, k1));
+        _mm_storeu_si128(ks +  9, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks + 10, k0 = keyExpansionStep<0x10>(k0, k1));
+        _mm_storeu_si128(ks + 11, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks + 12, k0 = keyExpansionStep<0x20>(k0, k1));
+        _mm_storeu_si128(ks + 13, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks + 14, k0 = keyExpansionStep<0x40>(k0, k1));
+    }
+}
+
+template <size_t total_round>
+AESNI_TARGET void aesIterationAESNI(const uint8_t in[], uint8_t out[], const uint8_t key[]) {
+    const __m128i* rk = (const __m128i*)(key);
+    __m128i state = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in)), _mm_loadu_si128(rk));
+
+#pragma GCC unroll 14
+    for (size_t round = 1; round < total_round; ++round)
+        state = _mm_aesenc_si128(state, _mm_loadu_si128(rk + round));
+    state = _mm_aesenclast_si128(state, _mm_loadu_si128(rk + total_round));
+
+    _mm_storeu_si128((__m128i*)(out), state);
+}
+
+// equivalent inverse cipher schedule through aesimc, same layout as keyExpansionInverseSoftware
+AESNI_TARGET void keyExpansionInverseAESNI(const uint8_t keys[], uint8_t dkeys[], size_t total_round) {
+    const __m128i* ks = (const __m128i*)(keys);
+    __m128i* dks = (__m128i*)(dkeys);
+
+    _mm_storeu_si128(dks, _mm_loadu_si128(ks + total_round));
+    for (size_t round = 1; round < total_round; ++round)
+        _mm_storeu_si128(dks + round, _mm_aesimc_si128(_mm_loadu_si128(ks + total_round - round)));
+    _mm_storeu_si128(dks + total_round, _mm_loadu_si128(ks));
+}
+
+template <size_t total_round>
+AESNI_TARGET void aesInverseIterationAESNI(const uint8_t in[], uint8_t out[], const uint8_t key[]) {
+    const __m128i* rk = (const __m128i*)(key);
+    __m128i state = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in)), _mm_loadu_si128(rk));
+
+#pragma GCC unroll 14
+    for (size_t round = 1; round < total_round; ++round)
+        state = _mm_aesdec_si128(state, _mm_loadu_si128(rk + round));
+    state = _mm_aesdeclast_si128(state, _mm_loadu_si128(rk + total_round));
+
+    _mm_storeu_si128((__m128i*)(out), state);
+}
+
+// 8 independent blocks interleaved round by round
+// in: 16 * blocks bytes
+// out: 16 * blocks bytes, may be the same as in
+template <size_t total_round>
+AESNI_TARGET void aesDecryptBlocksAESNI(const uint8_t in[], uint8_t out[], size_t blocks, const uint8_t key[]) {
+    constexpr size_t ways = 8;
+    const __m128i* src = (const __m128i*)(in);
+    __m128i* dst = (__m128i*)(out);
+    size_t i = 0;
+
+    // round keys are loaded once and kept in registers across the whole buffer
+    __m128i k[total_round + 1];
+#pragma GCC unroll 15
+    for (size_t round = 0; round <= total_round; ++round)
+        k[round] = _mm_loadu_si128((const __m128i*)(key) + round);
+
+    for (; i + ways <= blocks; i += ways) {
+        __m128i state[ways];
+        for (size_t j = 0; j < ways; ++j)
+            state[j] = _mm_xor_si128(_mm_loadu_si128(src + i + j), k[0]);
+
+#pragma GCC unroll 14
+        for (size_t round = 1; round < total_round; ++round) {
+#pragma GCC unroll 8
+            for (size_t j = 0; j < ways; ++j)
+                state[j] = _mm_aesdec_si128(state[j], k[round]);
+        }
+
+        for (size_t j = 0; j < ways; ++j)
+            _mm_storeu_si128(dst + i + j, _mm_aesdeclast_si128(state[j], k[total_round]));
+    }
+
+    for (; i < blocks; ++i)
+        aesInverseIterationAESNI<total_round>(in + 16 * i, out + 16 * i, key);
+}
+#else
+const bool aesni_supported = false;
+#endif
+
+// key expansion used by the modes below,
+// AES-NI when the CPU has it, T-tables otherwise
+void keyExpansion(const uint8_t key[], uint8_t keys[], const size_t key_length) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (aesni_supported) return keyExpansionAESNI(key, keys, key_length);
+#endif
+    keyExpansionSoftware(key, keys, key_length);
+}
+
+// keys: from keyExpansion
+// dkeys: 4 * (round + 1) * 4 bytes, decryption round keys
+void keyExpansionInverse(const uint8_t keys[], uint8_t dkeys[], size_t total_round) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (aesni_supported) return keyExpansionInverseAESNI(keys, dkeys, total_round);
+#endif
+    keyExpansionInverseSoftware(keys, dkeys, total_round);
+}
+
+
+// one stream of a multi-stream encryption, as it sits in a lane of the lane cores
+struct CBCLane {
+    // round keys of the stream
+    const uint8_t* keys;
+    const uint8_t* in;
+    uint8_t* out;
+    // blocks left
+    size_t blocks;
+    // last cipher block, or IV
+    uint8_t feedback[16];
+};
+
+// ways lanes interleaved round by round like aesEncryptBlocksTable, 
+// the state and feedback words in locals, so the table lookups of one chain overlap the latency of the others.
+// Round keys of every lane are gathered into one local table first, the streams need not share a key.
+template <size_t total_round, size_t ways>
+void cbcLanesTable(CBCLane lanes[], const size_t blocks) {
+    uint32_t k[total_round + 1][ways][4];
+    uint32_t feedback[ways][4];
+    for (size_t j = 0; j < ways; ++j) {
+        for (size_t round = 0; round <= total_round; ++round)
+            for (size_t c = 0; c < 4; ++c)
+                k[round][j][c] = getWord(lanes[j].keys + 16 * round + 4 * c);
+        for (size_t c = 0; c < 4; ++c)
+            feedback[j][c] = getWord(lanes[j].feedback + 4 * c);
+    }
+
+    for (size_t i = 0; i < blocks; ++i) {
+        uint32_t s[ways][4], t[ways][4];
+        for (size_t j = 0; j < ways; ++j)
+            for (size_t c = 0; c < 4; ++c)
+                s[j][c] = feedback[j][c] ^ getWord(lanes[j].in + 16 * i + 4 * c) ^ k[0][j][c];
+
+#pragma GCC unroll 14
+        for (size_t round = 1; round < total_round; ++round) {
+#pragma GCC unroll 4
+            for (size_t j = 0; j < ways; ++j)
+#pragma GCC unroll 4
+                for (size_t c = 0; c < 4; ++c)
+                    t[j][c] = T.Te0[s[j][c] >> 24] ^ T.Te1[s[j][(c + 1) & 3] >> 16 & 0xff] ^ 
+                              T.Te2[s[j][(c + 2) & 3] >> 8 & 0xff] ^ T.Te3[s[j][(c + 3) & 3] & 0xff] ^ 
+                              k[round][j][c];
+            memcpy(s, t, sizeof(s));
+        }
 
-    for (size_t round = 0; round < total_round - 1; ++round) {
-        subBytes(state);
-        shiftRows(state);
-        mixColumns(state);
-        addRoundKey(state, key + 16 * round + 16);
+        for (size_t j = 0; j < ways; ++j)
+            for (size_t c = 0; c < 4; ++c) {
+                feedback[j][c] = (T.Te4[s[j][c] >> 24] & 0xff000000) ^ (T.Te4[s[j][(c + 1) & 3] >> 16 & 0xff] & 0x00ff0000) ^
+                                 (T.Te4[s[j][(c + 2) & 3] >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s[j][(c + 3) & 3] & 0xff] & 0x000000ff) ^
+                                 k[total_round][j][c];
+                putWord(lanes[j].out + 16 * i + 4 * c, feedback[j][c]);
+            }
     }
-    subBytes(state);
-    shiftRows(state);
-    addRoundKey(state, key + 16 * total_round);
+
+    for (size_t j = 0; j < ways; ++j) {
+        for (size_t c = 0; c < 4; ++c)
+            putWord(lanes[j].feedback + 4 * c, feedback[j][c]);
+        lanes[j].in += 16 * blocks, lanes[j].out += 16 * blocks;
+    }
+}
+
+// count independent streams, each advanced by blocks blocks and its in, out and feedback updated,
+// through the 4, 2 and 1-way kernels
+template <size_t total_round>
+void cbcEncryptLanesTable(CBCLane lanes[], const size_t count, const size_t blocks) {
+    size_t j = 0;
+    for (; j + 4 <= count; j += 4) cbcLanesTable<total_round, 4>(lanes + j, blocks);
+    if (j + 2 <= count) cbcLanesTable<total_round, 2>(lanes + j, blocks), j += 2;
+    if (j + 1 <= count) cbcLanesTable<total_round, 1>(lanes + j, blocks);
 }
 
+#if defined(__x86_64__) || defined(__i386__)
+// ways lanes interleaved round by round, the feedback blocks stay in registers.
+// The streams need not share a key, their round keys are gathered into one local table first
+// so that every round key is a fixed offset from the stack.
+template <size_t total_round, size_t ways>
+AESNI_TARGET void cbcLanesAESNI(CBCLane lanes[], const size_t blocks) {
+    const __m128i* src[ways];
+    __m128i* dst[ways];
+    __m128i k[total_round + 1][ways];
+    __m128i feedback[ways];
+    for (size_t j = 0; j < ways; ++j) {
+        src[j] = (const __m128i*)(lanes[j].in);
+        dst[j] = (__m128i*)(lanes[j].out);
+        feedback[j] = _mm_loadu_si128((const __m128i*)(lanes[j].feedback));
+        for (size_t round = 0; round <= total_round; ++round)
+            k[round][j] = _mm_loadu_si128((const __m128i*)(lanes[j].keys) + round);
+    }
+
+    for (size_t i = 0; i < blocks; ++i) {
+        __m128i state[ways];
+#pragma GCC unroll 8
+        for (size_t j = 0; j < ways; ++j)
+            state[j] = _mm_xor_si128(_mm_xor_si128(feedback[j], _mm_loadu_si128(src[j] + i)), k[0][j]);
+
+#pragma GCC unroll 14
+        for (size_t round = 1; round < total_round; ++round) {
+#pragma GCC unroll 8
+            for (size_t j = 0; j < ways; ++j)
+                state[j] = _mm_aesenc_si128(state[j], k[round][j]);
+        }
 
-void aes_cbc(const void* plain, size_t length, const void* key, const size_t key_length, const void* IV, void* cipher) {
+#pragma GCC unroll 8
+        for (size_t j = 0; j < ways; ++j) {
+            feedback[j] = _mm_aesenclast_si128(state[j], k[total_round][j]);
+            _mm_storeu_si128(dst[j] + i, feedback[j]);
+        }
+    }
+
+    for (size_t j = 0; j < ways; ++j) {
+        _mm_storeu_si128((__m128i*)(lanes[j].feedback), feedback[j]);
+        lanes[j].in += 16 * blocks, lanes[j].out += 16 * blocks;
+    }
+}
+
+// same as cbcEncryptLanesTable, the lanes go through the 8, 4, 2 and 1-way kernels
+template <size_t total_round>
+void cbcEncryptLanesAESNI(CBCLane lanes[], const size_t count, const size_t blocks) {
+    size_t j = 0;
+    for (; j + 8 <= count; j += 8) cbcLanesAESNI<total_round, 8>(lanes + j, blocks);
+    if (j + 4 <= count) cbcLanesAESNI<total_round, 4>(lanes + j, blocks), j += 4;
+    if (j + 2 <= count) cbcLanesAESNI<total_round, 2>(lanes + j, blocks), j += 2;
+    if (j + 1 <= count) cbcLanesAESNI<total_round, 1>(lanes + j, blocks);
+}
+#endif
+
+// expanded keys and the cores specialized for their key size,
+// built once per key by aesInit and shared by every call
+struct alignas(64) AESContext {
     uint8_t keys[60 * 4];
-    keyExpansion((uint8_t*)(key), keys, key_length);
+    // decryption round keys, see keyExpansionInverse
+    uint8_t dkeys[60 * 4];
+    // one block
+    void (*encrypt)(const uint8_t in[], uint8_t out[], const uint8_t key[]);
+    // 16 * blocks bytes, with dkeys
+    void (*decrypt_blocks)(const uint8_t in[], uint8_t out[], size_t blocks, const uint8_t key[]);
+    // streams of keys of this size, see cbcEncryptLanesTable
+    void (*encrypt_lanes)(CBCLane lanes[], size_t count, size_t blocks);
+};
+
+// AES-NI when the CPU has it, T-tables otherwise
+template <size_t total_round>
+void aesSelectCores(AESContext& context) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (aesni_supported) {
+        context.encrypt = aesIterationAESNI<total_round>;
+        context.decrypt_blocks = aesDecryptBlocksAESNI<total_round>;
+        context.encrypt_lanes = cbcEncryptLanesAESNI<total_round>;
+        return;
+    }
+#endif
+    context.encrypt = aesIterationTable<total_round>;
+    context.decrypt_blocks = aesDecryptBlocksTable<total_round>;
+    context.encrypt_lanes = cbcEncryptLanesTable<total_round>;
+}
 
+// key_length: 16, 24 or 32 bytes
+// the only dispatch on key size, the modes call the specialized cores directly
+void aesInit(AESContext& context, const void* key, const size_t key_length) {
+    keyExpansion((const uint8_t*)(key), context.keys, key_length);
+    keyExpansionInverse(context.keys, context.dkeys, 6 + key_length / 4);
+    if (key_length == 16) aesSelectCores<10>(context);
+    else if (key_length == 24) aesSelectCores<12>(context);
+    else aesSelectCores<14>(context);
+}
+
+void aes_cbc(const void* plain, size_t length, const AESContext& context, const void* IV, void* cipher) {
     uint8_t buffer[16];
     memcpy(buffer, IV, 16);
 
     for (size_t i = 0; i < length / 16; ++i) {
         for (size_t j = 0; j < 16; ++j) 
             buffer[j] ^= ((uint8_t*)(plain))[16 * i + j];
-        aesIteration(buffer, (uint8_t*)(cipher) + 16 * i, keys, 6 + key_length / 4);
+        context.encrypt(buffer, (uint8_t*)(cipher) + 16 * i, context.keys);
         memcpy(buffer, (uint8_t*)(cipher) + 16 * i, 16);
     }
 }
 
+// Unlike encryption, each plain block depends only on two cipher blocks,
+// P[i] = D(C[i]) ^ C[i - 1], so cipher blocks are decrypted a batch at a time 
+// through the multi-block core.
+// cipher and plain may be the same buffer.
+void aes_cbc_decrypt(const void* cipher, size_t length, const AESContext& context, const void* IV, void* plain) {
+    const uint8_t* cipher_ = (const uint8_t*)(cipher);
+    uint8_t* plain_ = (uint8_t*)(plain);
+
+    constexpr size_t batch = 64;
+    // cipher blocks of the batch, kept for chaining in case plain overwrites them
+    uint8_t saved[16 * batch];
+    uint8_t feedback[16];
+    memcpy(feedback, IV, 16);
+
+    for (size_t i = 0; i < length / 16; i += batch) {
+        const size_t blocks = std::min(batch, length / 16 - i);
+        memcpy(saved, cipher_ + 16 * i, 16 * blocks);
+
+        context.decrypt_blocks(saved, plain_ + 16 * i, blocks, context.dkeys);
+
+        for (size_t j = 0; j < 16; ++j)
+            plain_[16 * i + j] ^= feedback[j];
+        for (size_t j = 16; j < 16 * blocks; ++j)
+            plain_[16 * i + j] ^= saved[j - 16];
+        memcpy(feedback, saved + 16 * (blocks - 1), 16);
+    }
+}
+
+// one stream of aes_cbc_multi
+// length: multiple of 16 bytes
+struct CBCJob {
+    const AESContext* context;
+    const void* IV;
+    const void* plain;
+    size_t length;
+    void* cipher;
+};
+
+// CBC encryption of many independent streams, each with its own key, IV and buffers.
+// A single stream is bound by the latency of one block encryption, 
+// so up to 8 streams advance in lockstep through the lane cores, 
+// as far as the shortest of them goes, and a stream that ends hands its lane to the next one.
+// Streams of one key size share a lane core and go through together.
+void aes_cbc_multi(const CBCJob jobs[], const size_t count) {
+    constexpr size_t ways = 8;
+
+    std::vector<size_t> order(count);
+    for (size_t i = 0; i < count; ++i) order[i] = i;
+    std::stable_sort(order.begin(), order.end(), [&](const size_t a, const size_t b) {
+        return std::less<decltype(AESContext::encrypt_lanes)>()(jobs[a].context->encrypt_lanes, 
+                                                                jobs[b].context->encrypt_lanes);
+    });
+
+    for (size_t group = 0, end; group < count; group = end) {
+        const auto encrypt_lanes = jobs[order[group]].context->encrypt_lanes;
+        for (end = group; end < count && jobs[order[end]].context->encrypt_lanes == encrypt_lanes; ) ++end;
+
+        CBCLane lanes[ways];
+        size_t active = 0, next = group;
+
+        // next stream of the group with at least one block into lane
+        auto start = [&](CBCLane& lane) {
+            while (next < end) {
+                const CBCJob& job = jobs[order[next++]];
+                if (job.length < 16) continue;
+                lane.keys = job.context->keys;
+                lane.in = (const uint8_t*)(job.plain);
+                lane.out = (uint8_t*)(job.cipher);
+                lane.blocks = job.length / 16;
+                memcpy(lane.feedback, job.IV, 16);
+                return true;
+            }
+            return false;
+        };
+
+        while (active < ways && start(lanes[active])) ++active;
+
+        while (active) {
+            size_t blocks = lanes[0].blocks;
+            for (size_t j = 1; j < active; ++j) blocks = std::min(blocks, lanes[j].blocks);
+
+            encrypt_lanes(lanes, active, blocks);
+
+            for (size_t j = 0; j < active; ++j) lanes[j].blocks -= blocks;
+            // finished lanes take the next stream, or the last busy lane when there is none
+            for (size_t j = 0; j < active; ) {
+                if (lanes[j].blocks || start(lanes[j])) ++j;
+                else lanes[j] = lanes[--active];
+            }
+        }
+    }
+}
+
 int main(int argc, char** argv) {
     if (argc == 1) return 0;
 
@@ -223,7 +821,7 @@ int main(int argc, char** argv) {
     unsigned char IV[16] = { 0 };
     size_t key_length = 0;
 
-    if (argc == 3) {
+    if (argc >= 3) {
         fin.open(argv[2]);
         fin.seekg(0, std::ios::beg);
         char buffer[3] = { 0 };
@@ -240,9 +838,34 @@ int main(int argc, char** argv) {
         return 0;
     }
 
+    AESContext context;
+    aesInit(context, key, key_length);
+
+    // optional arguments: "decrypt", 
+    // "records=N" to encrypt every N bytes, a multiple of 16, as a stream of its own
+    bool decrypt = false;
+    size_t record = 0;
+    for (int i = 3; i < argc; ++i) {
+        if (!strcmp(argv[i], "decrypt")) decrypt = true;
+        else if (!strncmp(argv[i], "records=", 8)) record = std::atoi(argv[i] + 8);
+    }
+
+    if (record % 16) {
+        printf("Length of records should be multiple of 16 bytes. \n");
+        return 0;
+    }
 
     std::vector<char> cipher(buffer.length(), 0);
-    aes_cbc(buffer.data(), buffer.length(), key, key_length, IV, &cipher[0]);
+    if (decrypt) {
+        aes_cbc_decrypt(buffer.data(), buffer.length(), context, IV, &cipher[0]);
+    } else if (record) {
+        std::vector<CBCJob> jobs;
+        for (size_t i = 0; i < buffer.length(); i += record)
+            jobs.push_back({ &context, IV, buffer.data() + i, std::min(record, buffer.length() - i), &cipher[i] });
+        aes_cbc_multi(jobs.data(), jobs.size());
+    } else {
+        aes_cbc(buffer.data(), buffer.length(), context, IV, &cipher[0]);
+    }
 
     for (size_t i = 0; i < buffer.length(); ++i)
         printf("%02x", int(cipher[i]) & 0xff);
@@ -0,0 +1,778 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: 
+ *  Filename: aes_ccm.cc 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: May 16, 2015
+ *  Time: 17:05:51
+ *  Description: AES(128, 192, 256 bit) Counter with CBC-MAC (CCM), RFC 3610
+ *****************************************************************************/
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <fstream>
+#include <cinttypes>
+#include <vector>
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <wmmintrin.h>
+#endif
+
+constexpr uint8_t gmult(uint8_t a, uint8_t b) {
+    uint8_t p = 0, hbs = 0;
+
+    for (size_t i = 0; i < 8; i++) {
+        if (b & 1) 
+            p ^= a;
+
+        hbs = a & 0x80;
+        a <<= 1;
+        if (hbs) a ^= 0x1b; // 0000 0001 0001 1011    
+        b >>= 1;
+    }
+
+    return (uint8_t)p;
+}
+
+constexpr uint8_t SubBytes[256] = {
+   0x63, 0x7C, 0x77, 0x7B, 0xF2, 0x6B, 0x6F, 0xC5, 0x30, 0x01, 0x67, 0x2B, 0xFE, 0xD7, 0xAB, 0x76,
+   0xCA, 0x82, 0xC9, 0x7D, 0xFA, 0x59, 0x47, 0xF0, 0xAD, 0xD4, 0xA2, 0xAF, 0x9C, 0xA4, 0x72, 0xC0,
+   0xB7, 0xFD, 0x93, 0x26, 0x36, 0x3F, 0xF7, 0xCC, 0x34, 0xA5, 0xE5, 0xF1, 0x71, 0xD8, 0x31, 0x15,
+   0x04, 0xC7, 0x23, 0xC3, 0x18, 0x96, 0x05, 0x9A, 0x07, 0x12, 0x80, 0xE2, 0xEB, 0x27, 0xB2, 0x75,
+   0x09, 0x83, 0x2C, 0x1A, 0x1B, 0x6E, 0x5A, 0xA0, 0x52, 0x3B, 0xD6, 0xB3, 0x29, 0xE3, 0x2F, 0x84,
+   0x53, 0xD1, 0x00, 0xED, 0x20, 0xFC, 0xB1, 0x5B, 0x6A, 0xCB, 0xBE, 0x39, 0x4A, 0x4C, 0x58, 0xCF,
+   0xD0, 0xEF, 0xAA, 0xFB, 0x43, 0x4D, 0x33, 0x85, 0x45, 0xF9, 0x02, 0x7F, 0x50, 0x3C, 0x9F, 0xA8,
+   0x51, 0xA3, 0x40, 0x8F, 0x92, 0x9D, 0x38, 0xF5, 0xBC, 0xB6, 0xDA, 0x21, 0x10, 0xFF, 0xF3, 0xD2,
+   0xCD, 0x0C, 0x13, 0xEC, 0x5F, 0x97, 0x44, 0x17, 0xC4, 0xA7, 0x7E, 0x3D, 0x64, 0x5D, 0x19, 0x73,
+   0x60, 0x81, 0x4F, 0xDC, 0x22, 0x2A, 0x90, 0x88, 0x46, 0xEE, 0xB8, 0x14, 0xDE, 0x5E, 0x0B, 0xDB,
+   0xE0, 0x32, 0x3A, 0x0A, 0x49, 0x06, 0x24, 0x5C, 0xC2, 0xD3, 0xAC, 0x62, 0x91, 0x95, 0xE4, 0x79,
+   0xE7, 0xC8, 0x37, 0x6D, 0x8D, 0xD5, 0x4E, 0xA9, 0x6C, 0x56, 0xF4, 0xEA, 0x65, 0x7A, 0xAE, 0x08,
+   0xBA, 0x78, 0x25, 0x2E, 0x1C, 0xA6, 0xB4, 0xC6, 0xE8, 0xDD, 0x74, 0x1F, 0x4B, 0xBD, 0x8B, 0x8A,
+   0x70, 0x3E, 0xB5, 0x66, 0x48, 0x03, 0xF6, 0x0E, 0x61, 0x35, 0x57, 0xB9, 0x86, 0xC1, 0x1D, 0x9E,
+   0xE1, 0xF8, 0x98, 0x11, 0x69, 0xD9, 0x8E, 0x94, 0x9B, 0x1E, 0x87, 0xE9, 0xCE, 0x55, 0x28, 0xDF,
+   0x8C, 0xA1, 0x89, 0x0D, 0xBF, 0xE6, 0x42, 0x68, 0x41, 0x99, 0x2D, 0x0F, 0xB0, 0x54, 0xBB, 0x16
+};
+
+// key: initial key: 16 or 24 or 32 bytes
+// keys : 4 * (6 + key_length / 4 + 1) * 4 bytes
+void keyExpansionSoftware(const uint8_t key[], uint8_t keys[], const size_t key_length) {
+    constexpr uint8_t RCON[10][4] = {
+        { 0x01, 0x00, 0x00, 0x00 },
+        { 0x02, 0x00, 0x00, 0x00 },
+        { 0x04, 0x00, 0x00, 0x00 },
+        { 0x08, 0x00, 0x00, 0x00 },
+        { 0x10, 0x00, 0x00, 0x00 },
+        { 0x20, 0x00, 0x00, 0x00 },
+        { 0x40, 0x00, 0x00, 0x00 },
+        { 0x80, 0x00, 0x00, 0x00 },
+        { 0x1b, 0x00, 0x00, 0x00 },
+        { 0x36, 0x00, 0x00, 0x00 }
+    };
+
+
+    memcpy(keys, key, key_length);
+
+    for (size_t i = key_length / 4; i < 4 * (6 + key_length / 4 + 1); ++i) {
+        uint8_t tmp[4] = { keys[4 * (i - 1) + 0], keys[4 * (i - 1) + 1],
+                           keys[4 * (i - 1) + 2], keys[4 * (i - 1) + 3] };
+        if (i % (key_length / 4) == 0) {
+            // rotate left one byte
+            uint8_t temp = tmp[0];
+            tmp[0] = tmp[1], tmp[1] = tmp[2], tmp[2] = tmp[3], tmp[3] = temp;
+            // SubBytes
+            tmp[0] = SubBytes[tmp[0]];
+            tmp[1] = SubBytes[tmp[1]];
+            tmp[2] = SubBytes[tmp[2]];
+            tmp[3] = SubBytes[tmp[3]];
+            // XOR round constants
+            tmp[0] ^= RCON[i / (key_length / 4) - 1][0], tmp[1] ^= RCON[i / (key_length / 4) - 1][1], 
+            tmp[2] ^= RCON[i / (key_length / 4) - 1][2], tmp[3] ^= RCON[i / (key_length / 4) - 1][3];
+        } else if (key_length > 24 && i % (key_length / 4) == 4) {
+            tmp[0] = SubBytes[tmp[0]];
+            tmp[1] = SubBytes[tmp[1]];
+            tmp[2] = SubBytes[tmp[2]];
+            tmp[3] = SubBytes[tmp[3]];
+        }
+        keys[4 * i + 0] = tmp[0], keys[4 * i + 1] = tmp[1],
+        keys[4 * i + 2] = tmp[2], keys[4 * i + 3] = tmp[3];
+        keys[4 * i + 0] ^= keys[4 * (i - key_length / 4) + 0], 
+        keys[4 * i + 1] ^= keys[4 * (i - key_length / 4) + 1],
+        keys[4 * i + 2] ^= keys[4 * (i - key_length / 4) + 2],
+        keys[4 * i + 3] ^= keys[4 * (i - key_length / 4) + 3];
+    }
+
+}
+
+inline uint32_t getWord(const uint8_t p[]) {
+    return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | uint32_t(p[3]);
+}
+
+inline void putWord(uint8_t p[], const uint32_t x) {
+    p[0] = x >> 24, p[1] = x >> 16, p[2] = x >> 8, p[3] = x;
+}
+
+// T-tables, generated at compile time from SubBytes
+// Te0[x] is column (2s, s, s, 3s) where s = SubBytes[x], 
+// i.e. SubBytes and MixColumns of one byte at row 0 in one lookup,
+// Te1..Te3 are Te0 rotated right by 8, 16, 24 bits for rows 1..3.
+// Te4[x] is (s, s, s, s), used by the final round which has no MixColumns.
+struct AESTables {
+    uint32_t Te0[256], Te1[256], Te2[256], Te3[256], Te4[256];
+
+    constexpr AESTables(): Te0(), Te1(), Te2(), Te3(), Te4() {
+        for (size_t x = 0; x < 256; ++x) {
+            const uint32_t s1 = SubBytes[x], s2 = gmult(2, s1), s3 = gmult(3, s1);
+            Te0[x] = s2 << 24 | s1 << 16 | s1 <<  8 | s3;
+            Te1[x] = s3 << 24 | s2 << 16 | s1 <<  8 | s1;
+            Te2[x] = s1 << 24 | s3 << 16 | s2 <<  8 | s1;
+            Te3[x] = s1 << 24 | s1 << 16 | s3 <<  8 | s2;
+            Te4[x] = s1 << 24 | s1 << 16 | s1 <<  8 | s1;
+        }
+    }
+};
+
+constexpr AESTables T;
+
+// in: 16 bytes
+// out: 16 bytes
+// key: 4 * (round + 1) * 4 bytes
+template <size_t total_round>
+void aesIterationTable(const uint8_t in[], uint8_t out[], const uint8_t key[]) {
+    // state is kept as 4 big-endian columns
+    uint32_t s0 = getWord(in +  0) ^ getWord(key +  0);
+    uint32_t s1 = getWord(in +  4) ^ getWord(key +  4);
+    uint32_t s2 = getWord(in +  8) ^ getWord(key +  8);
+    uint32_t s3 = getWord(in + 12) ^ getWord(key + 12);
+    uint32_t t0, t1, t2, t3;
+
+#pragma GCC unroll 14
+    for (size_t round = 1; round < total_round; ++round) {
+        const uint8_t* rk = key + 16 * round;
+        t0 = T.Te0[s0 >> 24] ^ T.Te1[s1 >> 16 & 0xff] ^ T.Te2[s2 >> 8 & 0xff] ^ T.Te3[s3 & 0xff] ^ getWord(rk +  0);
+        t1 = T.Te0[s1 >> 24] ^ T.Te1[s2 >> 16 & 0xff] ^ T.Te2[s3 >> 8 & 0xff] ^ T.Te3[s0 & 0xff] ^ getWord(rk +  4);
+        t2 = T.Te0[s2 >> 24] ^ T.Te1[s3 >> 16 & 0xff] ^ T.Te2[s0 >> 8 & 0xff] ^ T.Te3[s1 & 0xff] ^ getWord(rk +  8);
+        t3 = T.Te0[s3 >> 24] ^ T.Te1[s0 >> 16 & 0xff] ^ T.Te2[s1 >> 8 & 0xff] ^ T.Te3[s2 & 0xff] ^ getWord(rk + 12);
+        s0 = t0, s1 = t1, s2 = t2, s3 = t3;
+    }
+
+    // final round: SubBytes, ShiftRows, AddRoundKey
+    const uint8_t* rk = key + 16 * total_round;
+    t0 = (T.Te4[s0 >> 24] & 0xff000000) ^ (T.Te4[s1 >> 16 & 0xff] & 0x00ff0000) ^
+         (T.Te4[s2 >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s3 & 0xff] & 0x000000ff) ^ getWord(rk +  0);
+    t1 = (T.Te4[s1 >> 24] & 0xff000000) ^ (T.Te4[s2 >> 16 & 0xff] & 0x00ff0000) ^
+         (T.Te4[s3 >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s0 & 0xff] & 0x000000ff) ^ getWord(rk +  4);
+    t2 = (T.Te4[s2 >> 24] & 0xff000000) ^ (T.Te4[s3 >> 16 & 0xff] & 0x00ff0000) ^
+         (T.Te4[s0 >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s1 & 0xff] & 0x000000ff) ^ getWord(rk +  8);
+    t3 = (T.Te4[s3 >> 24] & 0xff000000) ^ (T.Te4[s0 >> 16 & 0xff] & 0x00ff0000) ^
+         (T.Te4[s1 >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s2 & 0xff] & 0x000000ff) ^ getWord(rk + 12);
+
+    putWord(out +  0, t0);
+    putWord(out +  4, t1);
+    putWord(out +  8, t2);
+    putWord(out + 12, t3);
+}
+
+// 4 independent blocks interleaved round by round, 
+// so the table lookups of one block overlap the latency of the others
+// in: 16 * blocks bytes
+// out: 16 * blocks bytes, may be the same as in
+template <size_t total_round>
+void aesEncryptBlocksTable(const uint8_t in[], uint8_t out[], size_t blocks, const uint8_t key[]) {
+    constexpr size_t ways = 4;
+    size_t i = 0;
+
+    for (; i + ways <= blocks; i += ways) {
+        uint32_t s[ways][4], t[ways][4];
+        for (size_t j = 0; j < ways; ++j)
+            for (size_t c = 0; c < 4; ++c)
+                s[j][c] = getWord(in + 16 * (i + j) + 4 * c) ^ getWord(key + 4 * c);
+
+#pragma GCC unroll 14
+        for (size_t round = 1; round < total_round; ++round) {
+            const uint8_t* rk = key + 16 * round;
+            for (size_t j = 0; j < ways; ++j)
+                for (size_t c = 0; c < 4; ++c)
+                    t[j][c] = T.Te0[s[j][c] >> 24] ^ T.Te1[s[j][(c + 1) & 3] >> 16 & 0xff] ^ 
+                              T.Te2[s[j][(c + 2) & 3] >> 8 & 0xff] ^ T.Te3[s[j][(c + 3) & 3] & 0xff] ^ 
+                              getWord(rk + 4 * c);
+            memcpy(s, t, sizeof(s));
+        }
+
+        const uint8_t* rk = key + 16 * total_round;
+        for (size_t j = 0; j < ways; ++j)
+            for (size_t c = 0; c < 4; ++c)
+                putWord(out + 16 * (i + j) + 4 * c,
+                        (T.Te4[s[j][c] >> 24] & 0xff000000) ^ (T.Te4[s[j][(c + 1) & 3] >> 16 & 0xff] & 0x00ff0000) ^
+                        (T.Te4[s[j][(c + 2) & 3] >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s[j][(c + 3) & 3] & 0xff] & 0x000000ff) ^
+                        getWord(rk + 4 * c));
+    }
+
+    for (; i < blocks; ++i)
+        aesIterationTable<total_round>(in + 16 * i, out + 16 * i, key);
+}
+
+// exactly 2 independent blocks interleaved round by round, 
+// for CCM, where the CBC-MAC block and the counter block of each step are the only work available
+// in: 32 bytes
+// out: 32 bytes, may be the same as in
+template <size_t total_round>
+void aesEncrypt2Table(const uint8_t in[], uint8_t out[], const uint8_t key[]) {
+    uint32_t a0 = getWord(in +  0) ^ getWord(key +  0), b0 = getWord(in + 16) ^ getWord(key +  0);
+    uint32_t a1 = getWord(in +  4) ^ getWord(key +  4), b1 = getWord(in + 20) ^ getWord(key +  4);
+    uint32_t a2 = getWord(in +  8) ^ getWord(key +  8), b2 = getWord(in + 24) ^ getWord(key +  8);
+    uint32_t a3 = getWord(in + 12) ^ getWord(key + 12), b3 = getWord(in + 28) ^ getWord(key + 12);
+
+#pragma GCC unroll 14
+    for (size_t round = 1; round < total_round; ++round) {
+        const uint8_t* rk = key + 16 * round;
+        const uint32_t k0 = getWord(rk + 0), k1 = getWord(rk + 4), k2 = getWord(rk + 8), k3 = getWord(rk + 12);
+        const uint32_t t0 = T.Te0[a0 >> 24] ^ T.Te1[a1 >> 16 & 0xff] ^ T.Te2[a2 >> 8 & 0xff] ^ T.Te3[a3 & 0xff] ^ k0;
+        const uint32_t u0 = T.Te0[b0 >> 24] ^ T.Te1[b1 >> 16 & 0xff] ^ T.Te2[b2 >> 8 & 0xff] ^ T.Te3[b3 & 0xff] ^ k0;
+        const uint32_t t1 = T.Te0[a1 >> 24] ^ T.Te1[a2 >> 16 & 0xff] ^ T.Te2[a3 >> 8 & 0xff] ^ T.Te3[a0 & 0xff] ^ k1;
+        const uint32_t u1 = T.Te0[b1 >> 24] ^ T.Te1[b2 >> 16 & 0xff] ^ T.Te2[b3 >> 8 & 0xff] ^ T.Te3[b0 & 0xff] ^ k1;
+        const uint32_t t2 = T.Te0[a2 >> 24] ^ T.Te1[a3 >> 16 & 0xff] ^ T.Te2[a0 >> 8 & 0xff] ^ T.Te3[a1 & 0xff] ^ k2;
+        const uint32_t u2 = T.Te0[b2 >> 24] ^ T.Te1[b3 >> 16 & 0xff] ^ T.Te2[b0 >> 8 & 0xff] ^ T.Te3[b1 & 0xff] ^ k2;
+        const uint32_t t3 = T.Te0[a3 >> 24] ^ T.Te1[a0 >> 16 & 0xff] ^ T.Te2[a1 >> 8 & 0xff] ^ T.Te3[a2 & 0xff] ^ k3;
+        const uint32_t u3 = T.Te0[b3 >> 24] ^ T.Te1[b0 >> 16 & 0xff] ^ T.Te2[b1 >> 8 & 0xff] ^ T.Te3[b2 & 0xff] ^ k3;
+        a0 = t0, a1 = t1, a2 = t2, a3 = t3;
+        b0 = u0, b1 = u1, b2 = u2, b3 = u3;
+    }
+
+    // final round: SubBytes, ShiftRows, AddRoundKey
+    const uint8_t* rk = key + 16 * total_round;
+    const uint32_t a[4] = { a0, a1, a2, a3 }, b[4] = { b0, b1, b2, b3 };
+    for (size_t c = 0; c < 4; ++c) {
+        putWord(out + 4 * c, 
+                (T.Te4[a[c] >> 24] & 0xff000000) ^ (T.Te4[a[(c + 1) & 3] >> 16 & 0xff] & 0x00ff0000) ^
+                (T.Te4[a[(c + 2) & 3] >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[a[(c + 3) & 3] & 0xff] & 0x000000ff) ^
+                getWord(rk + 4 * c));
+        putWord(out + 16 + 4 * c, 
+                (T.Te4[b[c] >> 24] & 0xff000000) ^ (T.Te4[b[(c + 1) & 3] >> 16 & 0xff] & 0x00ff0000) ^
+                (T.Te4[b[(c + 2) & 3] >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[b[(c + 3) & 3] & 0xff] & 0x000000ff) ^
+                getWord(rk + 4 * c));
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// AES-NI kernels, compiled for the aes target only and selected at runtime
+#define AESNI_TARGET __attribute__((target("aes,sse2")))
+
+inline bool cpuSupportsAESNI() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+    return ecx & bit_AES;
+}
+
+const bool aesni_supported = cpuSupportsAESNI();
+
+AESNI_TARGET inline __m128i keyExpansionAssist(__m128i key, __m128i keygened) {
+    // prefix XOR of the 4 words: w0, w0^w1, w0^w1^w2, w0^w1^w2^w3
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 8));
+    return _mm_xor_si128(key, keygened);
+}
+
+// next 4 words of a 128-bit schedule, or of the even half of a 256-bit schedule
+template <int rcon>
+AESNI_TARGET inline __m128i keyExpansionStep(__m128i key, __m128i prev) {
+    return keyExpansionAssist(key, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(prev, rcon), 0xff));
+}
+
+// odd half of a 256-bit schedule: SubWord without RotWord and round constant
+AESNI_TARGET inline __m128i keyExpansionStep256(__m128i key, __m128i prev) {
+    return keyExpansionAssist(key, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(prev, 0x00), 0xaa));
+}
+
+// next 6 words of a 192-bit schedule, 
+// temp1 holds words 0..3, low half of temp3 holds words 4..5
+template <int rcon>
+AESNI_TARGET inline void keyExpansionStep192(__m128i& temp1, __m128i& temp3) {
+    temp1 = keyExpansionAssist(temp1, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(temp3, rcon), 0x55));
+    __m128i temp2 = _mm_shuffle_epi32(temp1, 0xff);
+    temp3 = _mm_xor_si128(temp3, _mm_slli_si128(temp3, 4));
+    temp3 = _mm_xor_si128(temp3, temp2);
+}
+
+// low half of lo, low half of hi
+AESNI_TARGET inline __m128i shuffleLowLow(__m128i lo, __m128i hi) {
+    return _mm_castpd_si128(_mm_shuffle_pd(_mm_castsi128_pd(lo), _mm_castsi128_pd(hi), 0));
+}
+
+// high half of lo, low half of hi
+AESNI_TARGET inline __m128i shuffleHighLow(__m128i lo, __m128i hi) {
+    return _mm_castpd_si128(_mm_shuffle_pd(_mm_castsi128_pd(lo), _mm_castsi128_pd(hi), 1));
+}
+
+// same layout of keys as keyExpansionSoftware
+AESNI_TARGET void keyExpansionAESNI(const uint8_t key[], uint8_t keys[], const size_t key_length) {
+    __m128i* ks = (__m128i*)(keys);
+
+    if (key_length == 16) {
+        __m128i k = _mm_loadu_si128((const __m128i*)(key));
+        _mm_storeu_si128(ks +  0, k);
+        _mm_storeu_si128(ks +  1, k = keyExpansionStep<0x01>(k, k));
+        _mm_storeu_si128(ks +  2, k = keyExpansionStep<0x02>(k, k));
+        _mm_storeu_si128(ks +  3, k = keyExpansionStep<0x04>(k, k));
+        _mm_storeu_si128(ks +  4, k = keyExpansionStep<0x08>(k, k));
+        _mm_storeu_si128(ks +  5, k = keyExpansionStep<0x10>(k, k));
+        _mm_storeu_si128(ks +  6, k = keyExpansionStep<0x20>(k, k));
+        _mm_storeu_si128(ks +  7, k = keyExpansionStep<0x40>(k, k));
+        _mm_storeu_si128(ks +  8, k = keyExpansionStep<0x80>(k, k));
+        _mm_storeu_si128(ks +  9, k = keyExpansionStep<0x1b>(k, k));
+        _mm_storeu_si128(ks + 10, k = keyExpansionStep<0x36>(k, k));
+    } else if (key_length == 24) {
+        // 6-word steps straddle the 4-word round keys, 
+        // so join the halves together with 64-bit shuffles
+        __m128i temp1 = _mm_loadu_si128((const __m128i*)(key));
+        __m128i temp3 = _mm_loadl_epi64((const __m128i*)(key + 16));
+        __m128i prev;
+        _mm_storeu_si128(ks + 0, temp1);
+        prev = temp3;
+        keyExpansionStep192<0x01>(temp1, temp3);
+        _mm_storeu_si128(ks + 1, shuffleLowLow(prev, temp1));
+        _mm_storeu_si128(ks + 2, shuffleHighLow(temp1, temp3));
+        keyExpansionStep192<0x02>(temp1, temp3);
+        _mm_storeu_si128(ks + 3, temp1);
+        prev = temp3;
+        keyExpansionStep192<0x04>(temp1, temp3);
+        _mm_storeu_si128(ks + 4, shuffleLowLow(prev, temp1));
+        _mm_storeu_si128(ks + 5, shuffleHighLow(temp1, temp3));
+        keyExpansionStep192<0x08>(temp1, temp3);
+        _mm_storeu_si128(ks + 6, temp1);
+        prev = temp3;
+        keyExpansionStep192<0x10>(temp1, temp3);
+        _mm_storeu_si128(ks + 7, shuffleLowLow(prev, temp1));
+        _mm_storeu_si128(ks + 8, shuffleHighLow(temp1, temp3));
+        keyExpansionStep192<0x20>(temp1, temp3);
+        _mm_storeu_si128(ks + 9, temp1);
+        prev = temp3;
+        keyExpansionStep192<0x40>(temp1, temp3);
+        _mm_storeu_si128(ks + 10, shuffleLowLow(prev, temp1));
+        _mm_storeu_si128(ks + 11, shuffleHighLow(temp1, temp3));
+        keyExpansionStep192<0x80>(temp1, temp3);
+        _mm_storeu_si128(ks + 12, temp1);
+    } else {
+        __m128i k0 = _mm_loadu_si128((const __m128i*)(key));
+        __m128i k1 = _mm_loadu_si128((const __m128i*)(key + 16));
+        _mm_storeu_si128(ks +  0, k0);
+        _mm_storeu_si128(ks +  1, k1);
+        _mm_storeu_si128(ks +  2, k0 = keyExpansionStep<0x01>(k0, k1));
+        _mm_storeu_si128(ks +  3, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks +  4, k0 = keyExpansionStep<0x02>(k0, k1));
+        _mm_storeu_si128(ks +  5, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks +  6, k0 = keyExpansionStep<0x04>(k0, k1));
+        _mm_storeu_si128(ks +  7, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks +  8, k0 = keyExpansionStep<0x08>(k0, k1));
+        _mm_storeu_si128(ks +  9, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks + 10, k0 = keyExpansionStep<0x10>(k0, k1));
+        _mm_storeu_si128(ks + 11, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks + 12, k0 = keyExpansionStep<0x20>(k0, k1));
+        _mm_storeu_si128(ks + 13, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks + 14, k0 = keyExpansionStep<0x40>(k0, k1));
+    }
+}
+
+template <size_t total_round>
+AESNI_TARGET void aesIterationAESNI(const uint8_t in[], uint8_t out[], const uint8_t key[]) {
+    const __m128i* rk = (const __m128i*)(key);
+    __m128i state = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in)), _mm_loadu_si128(rk));
+
+#pragma GCC unroll 14
+    for (size_t round = 1; round < total_round; ++round)
+        state = _mm_aesenc_si128(state, _mm_loadu_si128(rk + round));
+    state = _mm_aesenclast_si128(state, _mm_loadu_si128(rk + total_round));
+
+    _mm_storeu_si128((__m128i*)(out), state);
+}
+
+// 8 independent blocks interleaved round by round, 
+// which keeps the pipelined AES unit busy instead of waiting on each aesenc
+// in: 16 * blocks bytes
+// out: 16 * blocks bytes, may be the same as in
+template <size_t total_round>
+AESNI_TARGET void aesEncryptBlocksAESNI(const uint8_t in[], uint8_t out[], size_t blocks, const uint8_t key[]) {
+    constexpr size_t ways = 8;
+    const __m128i* src = (const __m128i*)(in);
+    __m128i* dst = (__m128i*)(out);
+    size_t i = 0;
+
+    // round keys are loaded once and kept in registers across the whole buffer
+    __m128i k[total_round + 1];
+#pragma GCC unroll 15
+    for (size_t round = 0; round <= total_round; ++round)
+        k[round] = _mm_loadu_si128((const __m128i*)(key) + round);
+
+    for (; i + ways <= blocks; i += ways) {
+        __m128i state[ways];
+        for (size_t j = 0; j < ways; ++j)
+            state[j] = _mm_xor_si128(_mm_loadu_si128(src + i + j), k[0]);
+
+#pragma GCC unroll 14
+        for (size_t round = 1; round < total_round; ++round) {
+            for (size_t j = 0; j < ways; ++j)
+                state[j] = _mm_aesenc_si128(state[j], k[round]);
+        }
+
+        for (size_t j = 0; j < ways; ++j)
+            _mm_storeu_si128(dst + i + j, _mm_aesenclast_si128(state[j], k[total_round]));
+    }
+
+    for (; i < blocks; ++i)
+        aesIterationAESNI<total_round>(in + 16 * i, out + 16 * i, key);
+}
+
+// exactly 2 independent blocks, each aesenc of one block issued next to the other's
+// in: 32 bytes
+// out: 32 bytes, may be the same as in
+template <size_t total_round>
+AESNI_TARGET void aesEncrypt2AESNI(const uint8_t in[], uint8_t out[], const uint8_t key[]) {
+    const __m128i* rk = (const __m128i*)(key);
+    const __m128i k0 = _mm_loadu_si128(rk);
+    __m128i a = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in)), k0);
+    __m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in) + 1), k0);
+
+#pragma GCC unroll 14
+    for (size_t round = 1; round < total_round; ++round) {
+        const __m128i k = _mm_loadu_si128(rk + round);
+        a = _mm_aesenc_si128(a, k);
+        b = _mm_aesenc_si128(b, k);
+    }
+
+    const __m128i k = _mm_loadu_si128(rk + total_round);
+    _mm_storeu_si128((__m128i*)(out), _mm_aesenclast_si128(a, k));
+    _mm_storeu_si128((__m128i*)(out) + 1, _mm_aesenclast_si128(b, k));
+}
+#else
+const bool aesni_supported = false;
+#endif
+
+// key expansion used by the modes below,
+// AES-NI when the CPU has it, T-tables otherwise
+void keyExpansion(const uint8_t key[], uint8_t keys[], const size_t key_length) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (aesni_supported) return keyExpansionAESNI(key, keys, key_length);
+#endif
+    keyExpansionSoftware(key, keys, key_length);
+}
+
+// expanded keys and the cores specialized for the key size,
+// built once per key by aesInit and shared by every call
+struct alignas(64) AESContext {
+    uint8_t keys[60 * 4];
+    // one block
+    void (*encrypt)(const uint8_t in[], uint8_t out[], const uint8_t key[]);
+    // 16 * blocks bytes
+    void (*encrypt_blocks)(const uint8_t in[], uint8_t out[], size_t blocks, const uint8_t key[]);
+    // exactly 2 blocks, 32 bytes, interleaved
+    void (*encrypt2)(const uint8_t in[], uint8_t out[], const uint8_t key[]);
+};
+
+// AES-NI when the CPU has it, T-tables otherwise
+template <size_t total_round>
+void aesSelectCores(AESContext& context) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (aesni_supported) {
+        context.encrypt = aesIterationAESNI<total_round>;
+        context.encrypt_blocks = aesEncryptBlocksAESNI<total_round>;
+        context.encrypt2 = aesEncrypt2AESNI<total_round>;
+        return;
+    }
+#endif
+    context.encrypt = aesIterationTable<total_round>;
+    context.encrypt_blocks = aesEncryptBlocksTable<total_round>;
+    context.encrypt2 = aesEncrypt2Table<total_round>;
+}
+
+// key_length: 16, 24 or 32 bytes
+// the only dispatch on key size, the modes call the specialized cores directly
+void aesInit(AESContext& context, const void* key, const size_t key_length) {
+    keyExpansion((const uint8_t*)(key), context.keys, key_length);
+    if (key_length == 16) aesSelectCores<10>(context);
+    else if (key_length == 24) aesSelectCores<12>(context);
+    else aesSelectCores<14>(context);
+}
+
+// out = a ^ b, 16 bytes
+inline void xorBlock(uint8_t out[], const uint8_t a[], const uint8_t b[]) {
+    uint64_t x[2], y[2];
+    memcpy(x, a, 16);
+    memcpy(y, b, 16);
+    x[0] ^= y[0], x[1] ^= y[1];
+    memcpy(out, x, 16);
+}
+
+// nonce_length: 7 to 13 bytes, the length field takes the other 15 - nonce_length bytes
+// tag_length: 4, 6, 8, 10, 12, 14 or 16 bytes
+// length: must fit in the length field
+bool ccmValidParameters(const size_t length, const size_t nonce_length, const size_t tag_length) {
+    if (nonce_length < 7 || nonce_length > 13) return false;
+    if (tag_length < 4 || tag_length > 16 || tag_length % 2) return false;
+    const size_t L = 15 - nonce_length;
+    return L >= sizeof(size_t) || length >> (8 * L) == 0;
+}
+
+// CBC-MAC state, the blocks of B0 || encoded AAD are chained as they fill up;
+// the last one is left in pending so that it can share an encryption with a counter block
+struct CCMMac {
+    uint8_t x[16];
+    uint8_t pending[16];
+    size_t fill;
+};
+
+// append bytes to the MAC input
+void ccmAbsorb(CCMMac& mac, const uint8_t in[], size_t length, const AESContext& context) {
+    while (length) {
+        if (mac.fill == 16) {
+            xorBlock(mac.x, mac.x, mac.pending);
+            context.encrypt(mac.x, mac.x, context.keys);
+            memset(mac.pending, 0, 16);
+            mac.fill = 0;
+        }
+        const size_t n = std::min(length, 16 - mac.fill);
+        memcpy(mac.pending + mac.fill, in, n);
+        mac.fill += n, in += n, length -= n;
+    }
+}
+
+// B0 and the encoded AAD go into the MAC, counter gets A1
+// counter: 16 bytes
+void ccmStart(CCMMac& mac, uint8_t counter[], const size_t length, 
+              const uint8_t nonce[], const size_t nonce_length, 
+              const uint8_t aad[], const size_t aad_length, 
+              const size_t tag_length, const AESContext& context) {
+    const size_t L = 15 - nonce_length;
+
+    // B0: flags || nonce || length, big-endian in L bytes
+    uint8_t b0[16] = { 0 };
+    b0[0] = (aad_length? 0x40: 0) | (tag_length - 2) / 2 << 3 | (L - 1);
+    memcpy(b0 + 1, nonce, nonce_length);
+    for (size_t i = 0; i < L && i < sizeof(size_t); ++i)
+        b0[15 - i] = length >> (8 * i);
+
+    memset(mac.x, 0, 16);
+    memset(mac.pending, 0, 16);
+    mac.fill = 0;
+    ccmAbsorb(mac, b0, 16, context);
+
+    if (aad_length) {
+        // length of AAD in 2, 6 or 10 bytes
+        uint8_t encoded[10];
+        size_t encoded_length;
+        const uint64_t a = aad_length;
+        if (a < 0xff00) {
+            encoded[0] = a >> 8, encoded[1] = a;
+            encoded_length = 2;
+        } else if (a >> 32 == 0) {
+            encoded[0] = 0xff, encoded[1] = 0xfe;
+            for (size_t i = 0; i < 4; ++i) encoded[2 + i] = a >> (24 - 8 * i);
+            encoded_length = 6;
+        } else {
+            encoded[0] = 0xff, encoded[1] = 0xff;
+            for (size_t i = 0; i < 8; ++i) encoded[2 + i] = a >> (56 - 8 * i);
+            encoded_length = 10;
+        }
+        ccmAbsorb(mac, encoded, encoded_length, context);
+        ccmAbsorb(mac, aad, aad_length, context);
+    }
+
+    // A1: flags || nonce || 1
+    memset(counter, 0, 16);
+    counter[0] = L - 1;
+    memcpy(counter + 1, nonce, nonce_length);
+    counter[15] = 1;
+}
+
+// increment counter block, big-endian in the last L bytes
+inline void ccmIncrement(uint8_t counter[], const size_t L) {
+    for (size_t i = 15; i >= 16 - L; --i)
+        if (++counter[i]) break;
+}
+
+// One pass over the payload. 
+// The CBC-MAC chain and the keystream are independent, 
+// so each step encrypts the pending MAC block and the next counter block together through encrypt2,
+// their rounds interleaved,
+// and the payload block comes back as the following pending MAC block.
+// The last step pairs the final MAC block with A0, whose keystream masks the tag.
+// decrypt: the MAC is over the output instead of the input
+// tag: tag_length bytes
+void ccmCrypt(const uint8_t in[], const size_t length, uint8_t out[], 
+              CCMMac& mac, uint8_t counter[], const size_t nonce_length, 
+              const bool decrypt, uint8_t tag[], const size_t tag_length, 
+              const AESContext& context) {
+    const size_t L = 15 - nonce_length;
+    // x || keystream
+    uint8_t buffer[32];
+
+    for (size_t i = 0; i < length; i += 16) {
+        const size_t n = std::min<size_t>(16, length - i);
+
+        xorBlock(buffer, mac.x, mac.pending);
+        memcpy(buffer + 16, counter, 16);
+        context.encrypt2(buffer, buffer, context.keys);
+        memcpy(mac.x, buffer, 16);
+        ccmIncrement(counter, L);
+
+        memset(mac.pending, 0, 16);
+        if (n == 16) {
+            // in and out may be the same buffer, the plaintext is taken before it is overwritten
+            if (!decrypt) memcpy(mac.pending, in + i, 16);
+            xorBlock(out + i, in + i, buffer + 16);
+            if (decrypt) memcpy(mac.pending, out + i, 16);
+        } else {
+            // short last block, the MAC input is zero padded
+            for (size_t j = 0; j < n; ++j) {
+                const uint8_t p = decrypt? in[i + j] ^ buffer[16 + j]: in[i + j];
+                mac.pending[j] = p;
+                out[i + j] = in[i + j] ^ buffer[16 + j];
+            }
+        }
+    }
+
+    // A0: flags || nonce || 0
+    memset(counter + 16 - L, 0, L);
+    xorBlock(buffer, mac.x, mac.pending);
+    memcpy(buffer + 16, counter, 16);
+    context.encrypt2(buffer, buffer, context.keys);
+
+    for (size_t i = 0; i < tag_length; ++i)
+        tag[i] = buffer[i] ^ buffer[16 + i];
+}
+
+// nonce: nonce_length bytes, 7 to 13
+// tag: tag_length bytes, 4 to 16 and even
+// parameters are expected to pass ccmValidParameters
+void aes_ccm(const void* plain, const size_t length, 
+             const void* aad, const size_t aad_length, 
+             const void* nonce, const size_t nonce_length, 
+             const AESContext& context, 
+             void* cipher, void* tag, const size_t tag_length) {
+    CCMMac mac;
+    uint8_t counter[16];
+    ccmStart(mac, counter, length, (const uint8_t*)(nonce), nonce_length, 
+             (const uint8_t*)(aad), aad_length, tag_length, context);
+    ccmCrypt((const uint8_t*)(plain), length, (uint8_t*)(cipher), mac, counter, nonce_length, 
+             false, (uint8_t*)(tag), tag_length, context);
+}
+
+// returns whether tag is authentic, the comparison takes the same time wherever the tags differ
+// plain is zeroed when it is not, so that unauthenticated data never leaves
+bool aes_ccm_decrypt(const void* cipher, const size_t length, 
+                     const void* aad, const size_t aad_length, 
+                     const void* nonce, const size_t nonce_length, 
+                     const AESContext& context, 
+                     const void* tag, const size_t tag_length, void* plain) {
+    CCMMac mac;
+    uint8_t counter[16];
+    uint8_t expected[16];
+    ccmStart(mac, counter, length, (const uint8_t*)(nonce), nonce_length, 
+             (const uint8_t*)(aad), aad_length, tag_length, context);
+    ccmCrypt((const uint8_t*)(cipher), length, (uint8_t*)(plain), mac, counter, nonce_length, 
+             true, expected, tag_length, context);
+
+    uint8_t diff = 0;
+    for (size_t i = 0; i < tag_length; ++i)
+        diff |= expected[i] ^ ((const uint8_t*)(tag))[i];
+
+    if (diff) {
+        memset(plain, 0, length);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    if (argc == 1) return 0;
+
+    std::ifstream fin(argv[1]);
+
+    fin.seekg(0, std::ios::end);
+    std::string buffer;
+    size_t len = fin.tellg();
+    buffer.reserve(len);
+    fin.seekg(0, std::ios::beg);
+
+    buffer.assign((std::istreambuf_iterator<char>(fin)),
+                   std::istreambuf_iterator<char>());
+
+    fin.close();
+
+    // 128 bit or 192 bit or 256 bit key size
+    unsigned char key[32] = { 0 };
+    size_t key_length = 0;
+
+    if (argc >= 3) {
+        fin.open(argv[2]);
+        fin.seekg(0, std::ios::beg);
+        char buffer[3] = { 0 };
+        for (size_t i = 0; i < 32; ++i) {
+            if (!fin.read(buffer, 2)) break;
+            key[i] = std::stoi(buffer, 0, 16);
+            ++key_length;
+        }
+        fin.close();
+    }
+    
+    if (key_length != 16 && key_length != 24 && key_length != 32) {
+        printf("Length of key should be 16 or 24 or 32 bytes. \n");
+        return 0;
+    }
+
+    // optional arguments: "decrypt", the input is then ciphertext || tag, 
+    // "nonce=N" for the nonce length, 12 by default, "tag=M" for the tag length, 16 by default
+    bool decrypt = false;
+    size_t nonce_length = 12;
+    size_t tag_length = 16;
+    for (int i = 3; i < argc; ++i) {
+        if (!strcmp(argv[i], "decrypt")) decrypt = true;
+        else if (!strncmp(argv[i], "nonce=", 6)) nonce_length = std::atoi(argv[i] + 6);
+        else if (!strncmp(argv[i], "tag=", 4)) tag_length = std::atoi(argv[i] + 4);
+    }
+
+    if (decrypt && buffer.length() < tag_length) {
+        printf("Input is shorter than the tag. \n");
+        return 0;
+    }
+
+    const size_t length = decrypt? buffer.length() - tag_length: buffer.length();
+    if (!ccmValidParameters(length, nonce_length, tag_length)) {
+        printf("Nonce should be 7 to 13 bytes, tag 4 to 16 bytes and even. \n");
+        return 0;
+    }
+
+    unsigned char nonce[13] = { 0 };
+    unsigned char add_data[1];
+    unsigned char tag[16];
+
+    AESContext context;
+    aesInit(context, key, key_length);
+
+    std::vector<char> out(length + 1, 0);
+    if (decrypt) {
+        if (!aes_ccm_decrypt(buffer.data(), length, add_data, 0, nonce, nonce_length, context,
+                             buffer.data() + length, tag_length, &out[0])) {
+            printf("Authentication failed. \n");
+            return 0;
+        }
+    } else {
+        aes_ccm(buffer.data(), length, add_data, 0, nonce, nonce_length, context, &out[0], tag, tag_length);
+    }
+
+    for (size_t i = 0; i < length; ++i)
+        printf("%02x", int(out[i]) & 0xff);
+    printf("\n");
+
+    if (!decrypt) {
+        printf("\n");
+        for (size_t i = 0; i < tag_length; ++i)
+            printf("%02x", tag[i]);
+        printf("\n");
+    }
+    
+}
@@ -13,12 +13,18 @@
  *  Description: AES(128, 192, 256 bit) Electronic Codebook Mode(ECB) 
  *****************************************************************************/
 #include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <fstream>
 #include <cinttypes>
 #include <vector>
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <wmmintrin.h>
+#endif
 
-inline uint8_t gmult(uint8_t a, uint8_t b) {
+constexpr uint8_t gmult(uint8_t a, uint8_t b) {
     uint8_t p = 0, hbs = 0;
 
     for (size_t i = 0; i < 8; i++) {
@@ -55,7 +61,7 @@ constexpr uint8_t SubBytes[256] = {
 
 // key: initial key: 16 or 24 or 32 bytes
 // keys : 4 * (6 + key_length / 4 + 1) * 4 bytes
-void keyExpansion(const uint8_t key[], uint8_t keys[], const size_t key_length) {
+void keyExpansionSoftware(const uint8_t key[], uint8_t keys[], const size_t key_length) {
     constexpr uint8_t RCON[10][4] = {
         { 0x01, 0x00, 0x00, 0x00 },
         { 0x02, 0x00, 0x00, 0x00 },
@@ -104,88 +110,874 @@ void keyExpansion(const uint8_t key[], uint8_t keys[], const size_t key_length)
 }
 
 
-inline void subBytes(uint8_t state[]) {
-    for (size_t i = 0; i < 16; ++i)
-        state[i] = SubBytes[state[i]];
+inline uint32_t getWord(const uint8_t p[]) {
+    return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | uint32_t(p[3]);
 }
 
-inline void shiftRows(uint8_t state[]) {
-    uint8_t tmp = state[1];
-    state[1] = state[5];
-    state[5] = state[9];
-    state[9] = state[13];
-    state[13] = tmp;
+inline void putWord(uint8_t p[], const uint32_t x) {
+    p[0] = x >> 24, p[1] = x >> 16, p[2] = x >> 8, p[3] = x;
+}
 
-    tmp = state[2];
-    state[2] = state[10];
-    state[10] = tmp;
-    tmp = state[6];
-    state[6] = state[14];
-    state[14] = tmp;
-    
-    tmp = state[3];
-    state[3] = state[15];
-    state[15] = state[11];
-    state[11] = state[7];
-    state[7] = tmp;
+// T-tables, generated at compile time from SubBytes
+// Te0[x] is column (2s, s, s, 3s) where s = SubBytes[x], 
+// i.e. SubBytes and MixColumns of one byte at row 0 in one lookup,
+// Te1..Te3 are Te0 rotated right by 8, 16, 24 bits for rows 1..3.
+// Te4[x] is (s, s, s, s), used by the final round which has no MixColumns.
+struct AESTables {
+    uint32_t Te0[256], Te1[256], Te2[256], Te3[256], Te4[256];
+
+    constexpr AESTables(): Te0(), Te1(), Te2(), Te3(), Te4() {
+        for (size_t x = 0; x < 256; ++x) {
+            const uint32_t s1 = SubBytes[x], s2 = gmult(2, s1), s3 = gmult(3, s1);
+            Te0[x] = s2 << 24 | s1 << 16 | s1 <<  8 | s3;
+            Te1[x] = s3 << 24 | s2 << 16 | s1 <<  8 | s1;
+            Te2[x] = s1 << 24 | s3 << 16 | s2 <<  8 | s1;
+            Te3[x] = s1 << 24 | s1 << 16 | s3 <<  8 | s2;
+            Te4[x] = s1 << 24 | s1 << 16 | s1 <<  8 | s1;
+        }
+    }
+};
+
+constexpr AESTables T;
+
+// in: 16 bytes
+// out: 16 bytes
+// key: 4 * (round + 1) * 4 bytes
+template <size_t total_round>
+void aesIterationTable(const uint8_t in[], uint8_t out[], const uint8_t key[]) {
+    // state is kept as 4 big-endian columns
+    uint32_t s0 = getWord(in +  0) ^ getWord(key +  0);
+    uint32_t s1 = getWord(in +  4) ^ getWord(key +  4);
+    uint32_t s2 = getWord(in +  8) ^ getWord(key +  8);
+    uint32_t s3 = getWord(in + 12) ^ getWord(key + 12);
+    uint32_t t0, t1, t2, t3;
+
+#pragma GCC unroll 14
+    for (size_t round = 1; round < total_round; ++round) {
+        const uint8_t* rk = key + 16 * round;
+        t0 = T.Te0[s0 >> 24] ^ T.Te1[s1 >> 16 & 0xff] ^ T.Te2[s2 >> 8 & 0xff] ^ T.Te3[s3 & 0xff] ^ getWord(rk +  0);
+        t1 = T.Te0[s1 >> 24] ^ T.Te1[s2 >> 16 & 0xff] ^ T.Te2[s3 >> 8 & 0xff] ^ T.Te3[s0 & 0xff] ^ getWord(rk +  4);
+        t2 = T.Te0[s2 >> 24] ^ T.Te1[s3 >> 16 & 0xff] ^ T.Te2[s0 >> 8 & 0xff] ^ T.Te3[s1 & 0xff] ^ getWord(rk +  8);
+        t3 = T.Te0[s3 >> 24] ^ T.Te1[s0 >> 16 & 0xff] ^ T.Te2[s1 >> 8 & 0xff] ^ T.Te3[s2 & 0xff] ^ getWord(rk + 12);
+        s0 = t0, s1 = t1, s2 = t2, s3 = t3;
+    }
+
+    // final round: SubBytes, ShiftRows, AddRoundKey
+    const uint8_t* rk = key + 16 * total_round;
+    t0 = (T.Te4[s0 >> 24] & 0xff000000) ^ (T.Te4[s1 >> 16 & 0xff] & 0x00ff0000) ^
+         (T.Te4[s2 >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s3 & 0xff] & 0x000000ff) ^ getWord(rk +  0);
+    t1 = (T.Te4[s1 >> 24] & 0xff000000) ^ (T.Te4[s2 >> 16 & 0xff] & 0x00ff0000) ^
+         (T.Te4[s3 >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s0 & 0xff] & 0x000000ff) ^ getWord(rk +  4);
+    t2 = (T.Te4[s2 >> 24] & 0xff000000) ^ (T.Te4[s3 >> 16 & 0xff] & 0x00ff0000) ^
+         (T.Te4[s0 >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s1 & 0xff] & 0x000000ff) ^ getWord(rk +  8);
+    t3 = (T.Te4[s3 >> 24] & 0xff000000) ^ (T.Te4[s0 >> 16 & 0xff] & 0x00ff0000) ^
+         (T.Te4[s1 >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s2 & 0xff] & 0x000000ff) ^ getWord(rk + 12);
+
+    putWord(out +  0, t0);
+    putWord(out +  4, t1);
+    putWord(out +  8, t2);
+    putWord(out + 12, t3);
+}
+
+// 4 independent blocks interleaved round by round, 
+// so the table lookups of one block overlap the latency of the others
+// in: 16 * blocks bytes
+// out: 16 * blocks bytes, may be the same as in
+template <size_t total_round>
+void aesEncryptBlocksTable(const uint8_t in[], uint8_t out[], size_t blocks, const uint8_t key[]) {
+    constexpr size_t ways = 4;
+    size_t i = 0;
+
+    for (; i + ways <= blocks; i += ways) {
+        uint32_t s[ways][4], t[ways][4];
+        for (size_t j = 0; j < ways; ++j)
+            for (size_t c = 0; c < 4; ++c)
+                s[j][c] = getWord(in + 16 * (i + j) + 4 * c) ^ getWord(key + 4 * c);
+
+#pragma GCC unroll 14
+        for (size_t round = 1; round < total_round; ++round) {
+            const uint8_t* rk = key + 16 * round;
+#pragma GCC unroll 4
+            for (size_t j = 0; j < ways; ++j)
+#pragma GCC unroll 4
+                for (size_t c = 0; c < 4; ++c)
+                    t[j][c] = T.Te0[s[j][c] >> 24] ^ T.Te1[s[j][(c + 1) & 3] >> 16 & 0xff] ^ 
+                              T.Te2[s[j][(c + 2) & 3] >> 8 & 0xff] ^ T.Te3[s[j][(c + 3) & 3] & 0xff] ^ 
+                              getWord(rk + 4 * c);
+            memcpy(s, t, sizeof(s));
+        }
+
+        const uint8_t* rk = key + 16 * total_round;
+        for (size_t j = 0; j < ways; ++j)
+            for (size_t c = 0; c < 4; ++c)
+                putWord(out + 16 * (i + j) + 4 * c,
+                        (T.Te4[s[j][c] >> 24] & 0xff000000) ^ (T.Te4[s[j][(c + 1) & 3] >> 16 & 0xff] & 0x00ff0000) ^
+                        (T.Te4[s[j][(c + 2) & 3] >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s[j][(c + 3) & 3] & 0xff] & 0x000000ff) ^
+                        getWord(rk + 4 * c));
+    }
+
+    for (; i < blocks; ++i)
+        aesIterationTable<total_round>(in + 16 * i, out + 16 * i, key);
 }
 
-inline void mixColumns(uint8_t state[]) {
-    uint8_t tmp[4];
+// inverse T-tables, generated at compile time from SubBytes
+// Td0[x] is column (14s, 9s, 13s, 11s) where s = InvSubBytes[x],
+// Td1..Td3 are Td0 rotated right by 8, 16, 24 bits,
+// Td4[x] is (s, s, s, s) for the final round.
+struct AESInverseTables {
+    uint8_t InvSubBytes[256];
+    uint32_t Td0[256], Td1[256], Td2[256], Td3[256], Td4[256];
+
+    constexpr AESInverseTables(): InvSubBytes(), Td0(), Td1(), Td2(), Td3(), Td4() {
+        for (size_t x = 0; x < 256; ++x)
+            InvSubBytes[SubBytes[x]] = x;
+
+        for (size_t x = 0; x < 256; ++x) {
+            const uint32_t s = InvSubBytes[x];
+            const uint32_t s9 = gmult(9, s), s11 = gmult(11, s), s13 = gmult(13, s), s14 = gmult(14, s);
+            Td0[x] = s14 << 24 | s9  << 16 | s13 << 8 | s11;
+            Td1[x] = s11 << 24 | s14 << 16 | s9  << 8 | s13;
+            Td2[x] = s13 << 24 | s11 << 16 | s14 << 8 | s9;
+            Td3[x] = s9  << 24 | s13 << 16 | s11 << 8 | s14;
+            Td4[x] = s   << 24 | s   << 16 | s   << 8 | s;
+        }
+    }
+};
+
+constexpr AESInverseTables TI;
+
+inline void invMixColumns(uint8_t state[]) {
     for (size_t i = 0; i < 4; ++i) {
-        tmp[0] = gmult(2, state[4 * i + 0]) ^ 
-                 gmult(3, state[4 * i + 1]) ^
-                 gmult(1, state[4 * i + 2]) ^ 
-                 gmult(1, state[4 * i + 3]);
-        tmp[1] = gmult(1, state[4 * i + 0]) ^
-                 gmult(2, state[4 * i + 1]) ^
-                 gmult(3, state[4 * i + 2]) ^
-                 gmult(1, state[4 * i + 3]);
-        tmp[2] = gmult(1, state[4 * i + 0]) ^
-                 gmult(1, state[4 * i + 1]) ^
-                 gmult(2, state[4 * i + 2]) ^
-                 gmult(3, state[4 * i + 3]);
-        tmp[3] = gmult(3, state[4 * i + 0]) ^
-                 gmult(1, state[4 * i + 1]) ^
-                 gmult(1, state[4 * i + 2]) ^
-                 gmult(2, state[4 * i + 3]);
-        state[4 * i + 0] = tmp[0], state[4 * i + 1] = tmp[1],
-        state[4 * i + 2] = tmp[2], state[4 * i + 3] = tmp[3];
-    }
-}
-
-inline void addRoundKey(uint8_t state[], const uint8_t word[]) {
-    for (size_t i = 0; i < 16; ++i) 
-        state[i] ^= word[i];
+        const uint8_t a0 = state[4 * i + 0], a1 = state[4 * i + 1], 
+                      a2 = state[4 * i + 2], a3 = state[4 * i + 3];
+        state[4 * i + 0] = gmult(14, a0) ^ gmult(11, a1) ^ gmult(13, a2) ^ gmult( 9, a3);
+        state[4 * i + 1] = gmult( 9, a0) ^ gmult(14, a1) ^ gmult(11, a2) ^ gmult(13, a3);
+        state[4 * i + 2] = gmult(13, a0) ^ gmult( 9, a1) ^ gmult(14, a2) ^ gmult(11, a3);
+        state[4 * i + 3] = gmult(11, a0) ^ gmult(13, a1) ^ gmult( 9, a2) ^ gmult(14, a3);
+    }
+}
+
+// equivalent inverse cipher schedule (FIPS-197 5.3.5):
+// round keys in reverse order, InvMixColumns applied to all but the first and last
+// keys: 4 * (round + 1) * 4 bytes, from keyExpansion
+// dkeys: 4 * (round + 1) * 4 bytes
+void keyExpansionInverseSoftware(const uint8_t keys[], uint8_t dkeys[], size_t total_round) {
+    memcpy(dkeys, keys + 16 * total_round, 16);
+    for (size_t round = 1; round < total_round; ++round) {
+        memcpy(dkeys + 16 * round, keys + 16 * (total_round - round), 16);
+        invMixColumns(dkeys + 16 * round);
+    }
+    memcpy(dkeys + 16 * total_round, keys, 16);
 }
 
 // in: 16 bytes
 // out: 16 bytes
-// key: 4 * (round + 1) * 4 bytes
-void aesIteration(const uint8_t in[], uint8_t out[], const uint8_t key[], size_t total_round) {
-    uint8_t* state = out;
-    memcpy(state, in, 16);
-    
-    // add round key
-    addRoundKey(state, key);
+// key: 4 * (round + 1) * 4 bytes, from keyExpansionInverse
+template <size_t total_round>
+void aesInverseIterationTable(const uint8_t in[], uint8_t out[], const uint8_t key[]) {
+    uint32_t s0 = getWord(in +  0) ^ getWord(key +  0);
+    uint32_t s1 = getWord(in +  4) ^ getWord(key +  4);
+    uint32_t s2 = getWord(in +  8) ^ getWord(key +  8);
+    uint32_t s3 = getWord(in + 12) ^ getWord(key + 12);
+    uint32_t t0, t1, t2, t3;
+
+#pragma GCC unroll 14
+    for (size_t round = 1; round < total_round; ++round) {
+        const uint8_t* rk = key + 16 * round;
+        t0 = TI.Td0[s0 >> 24] ^ TI.Td1[s3 >> 16 & 0xff] ^ TI.Td2[s2 >> 8 & 0xff] ^ TI.Td3[s1 & 0xff] ^ getWord(rk +  0);
+        t1 = TI.Td0[s1 >> 24] ^ TI.Td1[s0 >> 16 & 0xff] ^ TI.Td2[s3 >> 8 & 0xff] ^ TI.Td3[s2 & 0xff] ^ getWord(rk +  4);
+        t2 = TI.Td0[s2 >> 24] ^ TI.Td1[s1 >> 16 & 0xff] ^ TI.Td2[s0 >> 8 & 0xff] ^ TI.Td3[s3 & 0xff] ^ getWord(rk +  8);
+        t3 = TI.Td0[s3 >> 24] ^ TI.Td1[s2 >> 16 & 0xff] ^ TI.Td2[s1 >> 8 & 0xff] ^ TI.Td3[s0 & 0xff] ^ getWord(rk + 12);
+        s0 = t0, s1 = t1, s2 = t2, s3 = t3;
+    }
+
+    // final round: InvShiftRows, InvSubBytes, AddRoundKey
+    const uint8_t* rk = key + 16 * total_round;
+    t0 = (TI.Td4[s0 >> 24] & 0xff000000) ^ (TI.Td4[s3 >> 16 & 0xff] & 0x00ff0000) ^
+         (TI.Td4[s2 >> 8 & 0xff] & 0x0000ff00) ^ (TI.Td4[s1 & 0xff] & 0x000000ff) ^ getWord(rk +  0);
+    t1 = (TI.Td4[s1 >> 24] & 0xff000000) ^ (TI.Td4[s0 >> 16 & 0xff] & 0x00ff0000) ^
+         (TI.Td4[s3 >> 8 & 0xff] & 0x0000ff00) ^ (TI.Td4[s2 & 0xff] & 0x000000ff) ^ getWord(rk +  4);
+    t2 = (TI.Td4[s2 >> 24] & 0xff000000) ^ (TI.Td4[s1 >> 16 & 0xff] & 0x00ff0000) ^
+         (TI.Td4[s0 >> 8 & 0xff] & 0x0000ff00) ^ (TI.Td4[s3 & 0xff] & 0x000000ff) ^ getWord(rk +  8);
+    t3 = (TI.Td4[s3 >> 24] & 0xff000000) ^ (TI.Td4[s2 >> 16 & 0xff] & 0x00ff0000) ^
+         (TI.Td4[s1 >> 8 & 0xff] & 0x0000ff00) ^ (TI.Td4[s0 & 0xff] & 0x000000ff) ^ getWord(rk + 12);
+
+    putWord(out +  0, t0);
+    putWord(out +  4, t1);
+    putWord(out +  8, t2);
+    putWord(out + 12, t3);
+}
+
+// 4 independent blocks interleaved round by round
+// in: 16 * blocks bytes
+// out: 16 * blocks bytes, may be the same as in
+template <size_t total_round>
+void aesDecryptBlocksTable(const uint8_t in[], uint8_t out[], size_t blocks, const uint8_t key[]) {
+    constexpr size_t ways = 4;
+    size_t i = 0;
+
+    for (; i + ways <= blocks; i += ways) {
+        uint32_t s[ways][4], t[ways][4];
+        for (size_t j = 0; j < ways; ++j)
+            for (size_t c = 0; c < 4; ++c)
+                s[j][c] = getWord(in + 16 * (i + j) + 4 * c) ^ getWord(key + 4 * c);
+
+#pragma GCC unroll 14
+        for (size_t round = 1; round < total_round; ++round) {
+            const uint8_t* rk = key + 16 * round;
+#pragma GCC unroll 4
+            for (size_t j = 0; j < ways; ++j)
+#pragma GCC unroll 4
+                for (size_t c = 0; c < 4; ++c)
+                    t[j][c] = TI.Td0[s[j][c] >> 24] ^ TI.Td1[s[j][(c + 3) & 3] >> 16 & 0xff] ^ 
+                              TI.Td2[s[j][(c + 2) & 3] >> 8 & 0xff] ^ TI.Td3[s[j][(c + 1) & 3] & 0xff] ^ 
+                              getWord(rk + 4 * c);
+            memcpy(s, t, sizeof(s));
+        }
+
+        const uint8_t* rk = key + 16 * total_round;
+        for (size_t j = 0; j < ways; ++j)
+            for (size_t c = 0; c < 4; ++c)
+                putWord(out + 16 * (i + j) + 4 * c,
+                        (TI.Td4[s[j][c] >> 24] & 0xff000000) ^ (TI.Td4[s[j][(c + 3) & 3] >> 16 & 0xff] & 0x00ff0000) ^
+                        (TI.Td4[s[j][(c + 2) & 3] >> 8 & 0xff] & 0x0000ff00) ^ (TI.Td4[s[j][(c + 1) & 3] & 0xff] & 0x000000ff) ^
+                        getWord(rk + 4 * c));
+    }
+
+    for (; i < blocks; ++i)
+        aesInverseIterationTable<total_round>(in + 16 * i, out + 16 * i, key);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// AES-NI kernels, compiled for the aes target only and selected at runtime
+#define AESNI_TARGET __attribute__((target("aes,sse2")))
+
+inline bool cpuSupportsAESNI() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+    return ecx & bit_AES;
+}
+
+const bool aesni_supported = cpuSupportsAESNI();
+
+AESNI_TARGET inline __m128i keyExpansionAssist(__m128i key, __m128i keygened) {
+    // prefix XOR of the 4 words: w0, w0^w1, w0^w1^w2, w0^w1^w2^w3
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 8));
+    return _mm_xor_si128(key, keygened);
+}
+
+// next 4 words of a 128-bit schedule, or of the even half of a 256-bit schedule
+template <int rcon>
+AESNI_TARGET inline __m128i keyExpansionStep(__m128i key, __m128i prev) {
+    return keyExpansionAssist(key, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(prev, rcon), 0xff));
+}
+
+// odd half of a 256-bit schedule: SubWord without RotWord and round constant
+AESNI_TARGET inline __m128i keyExpansionStep256(__m128i key, __m128i prev) {
+    return keyExpansionAssist(key, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(prev, 0x00), 0xaa));
+}
+
+// next 6 words of a 192-bit schedule, 
+// temp1 holds words 0..3, low half of temp3 holds words 4..5
+template <int rcon>
+AESNI_TARGET inline void keyExpansionStep192(__m128i& temp1, __m128i& temp3) {
+    temp1 = keyExpansionAssist(temp1, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(temp3, rcon), 0x55));
+    __m128i temp2 = _mm_shuffle_epi32(temp1, 0xff);
+    temp3 = _mm_xor_si128(temp3, _mm_slli_si128(temp3, 4));
+    temp3 = _mm_xor_si128(temp3, temp2);
+}
+
+// low half of lo, low half of hi
+AESNI_TARGET inline __m128i shuffleLowLow(__m128i lo, __m128i hi) {
+    return _mm_castpd_si128(_mm_shuffle_pd(_mm_castsi128_pd(lo), _mm_castsi128_pd(hi), 0));
+}
+
+// high half of lo, low half of hi
+AESNI_TARGET inline __m128i shuffleHighLow(__m128i lo, __m128i hi) {
+    return _mm_castpd_si128(_mm_shuffle_pd(_mm_castsi128_pd(lo), _mm_castsi128_pd(hi), 1));
+}
+
+// same layout of keys as keyExpansionSoftware
+AESNI_TARGET void keyExpansionAESNI(const uint8_t key[], uint8_t keys[], const size_t key_length) {
+    __m128i* ks = (__m128i*)(keys);
+
+    if (key_length == 16) {
+        __m128i k = _mm_loadu_si128((const __m128i*)(key));
+        _mm_storeu_si128(ks +  0, k);
+        _mm_storeu_si128(ks +  1, k = keyExpansionStep<0x01>(k, k));
+        _mm_storeu_si128(ks +  2, k = keyExpansionStep<0x02>(k, k));
+        _mm_storeu_si128(ks +  3, k = keyExpansionStep<0x04>(k, k));
+        _mm_storeu_si128(ks +  4, k = keyExpansionStep<0x08>(k, k));
+        _mm_storeu_si128(ks +  5, k = keyExpansionStep<0x10>(k, k));
+        _mm_storeu_si128(ks +  6, k = keyExpansionStep<0x20>(k, k));
+        _mm_storeu_si128(ks +  7, k = keyExpansionStep<0x40>(k, k));
+        _mm_storeu_si128(ks +  8, k = keyExpansionStep<0x80>(k, k));
+        _mm_storeu_si128(ks +  9, k = keyExpansionStep<0x1b>(k, k));
+        _mm_storeu_si128(ks + 10, k = keyExpansionStep<0x36>(k, k));
+    } else if (key_length == 24) {
+        // 6-word steps straddle the 4-word round keys, 
+        // so join the halves together with 64-bit shuffles
+        __m128i temp1 = _mm_loadu_si128((const __m128i*)(key));
+        __m128i temp3 = _mm_loadl_epi64((const __m128i*)(key + 16));
+        __m128i prev;
+        _mm_storeu_si128(ks + 0, temp1);
+        prev = temp3;
+        keyExpansionStep192<0x01>(temp1, temp3);
+        _mm_storeu_si128(ks + 1, shuffleLowLow(prev, temp1));
+        _mm_storeu_si128(ks + 2, shuffleHighLow(temp1, temp3));
+        keyExpansionStep192<0x02>(temp1, temp3);
+        _mm_storeu_si128(ks + 3, temp1);
+        prev = temp3;
+        keyExpansionStep192<0x04>(temp1, temp3);
+        _mm_storeu_si128(ks + 4, shuffleLowLow(prev, temp1));
+        _mm_storeu_si128(ks + 5, shuffleHighLow(temp1, temp3));
+        keyExpansionStep192<0x08>(temp1, temp3);
+        _mm_storeu_si128(ks + 6, temp1);
+        prev = temp3;
+        keyExpansionStep192<0x10>(temp1, temp3);
+        _mm_storeu_si128(ks + 7, shuffleLowLow(prev, temp1));
+        _mm_storeu_si128(ks + 8, shuffleHighLow(temp1, temp3));
+        keyExpansionStep192<0x20>(temp1, temp3);
+        _mm_storeu_si128(ks + 9, temp1);
+        prev = temp3;
+        keyExpansionStep192<0x40>(temp1, temp3);
+        _mm_storeu_si128(ks + 10, shuffleLowLow(prev, temp1));
+        _mm_storeu_si128(ks + 11, shuffleHighLow(temp1, temp3));
+        keyExpansionStep192<0x80>(temp1, temp3);
+        _mm_storeu_si128(ks + 12, temp1);
+    } else {
+        __m128i k0 = _mm_loadu_si128((const __m128i*)(key));
+        __m128i k1 = _mm_loadu_si128((const __m128i*)(key + 16));
+        _mm_storeu_si128(ks +  0, k0);
+        _mm_storeu_si128(ks +  1, k1);
+        _mm_storeu_si128(ks +  2, k0 = keyExpansionStep<0x01>(k0, k1));
+        _mm_storeu_si128(ks +  3, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks +  4, k0 = keyExpansionStep<0x02>(k0, k1));
+        _mm_storeu_si128(ks +  5, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks +  6, k0 = keyExpansionStep<0x04>(k0, k1));
+        _mm_storeu_si128(ks +  7, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks +  8, k0 = keyExpansionStep<0x08>(k0, k1));
+        _mm_storeu_si128(ks +  9, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks + 10, k0 = keyExpansionStep<0x10>(k0, k1));
+        _mm_storeu_si128(ks + 11, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks + 12, k0 = keyExpansionStep<0x20>(k0, k1));
+        _mm_storeu_si128(ks + 13, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks + 14, k0 = keyExpansionStep<0x40>(k0, k1));
+    }
+}
+
+template <size_t total_round>
+AESNI_TARGET void aesIterationAESNI(const uint8_t in[], uint8_t out[], const uint8_t key[]) {
+    const __m128i* rk = (const __m128i*)(key);
+    __m128i state = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in)), _mm_loadu_si128(rk));
+
+#pragma GCC unroll 14
+    for (size_t round = 1; round < total_round; ++round)
+        state = _mm_aesenc_si128(state, _mm_loadu_si128(rk + round));
+    state = _mm_aesenclast_si128(state, _mm_loadu_si128(rk + total_round));
+
+    _mm_storeu_si128((__m128i*)(out), state);
+}
+
+// 8 independent blocks interleaved round by round, 
+// which keeps the pipelined AES unit busy instead of waiting on each aesenc
+// in: 16 * blocks bytes
+// out: 16 * blocks bytes, may be the same as in
+template <size_t total_round>
+AESNI_TARGET void aesEncryptBlocksAESNI(const uint8_t in[], uint8_t out[], size_t blocks, const uint8_t key[]) {
+    constexpr size_t ways = 8;
+    const __m128i* src = (const __m128i*)(in);
+    __m128i* dst = (__m128i*)(out);
+    size_t i = 0;
+
+    // round keys are loaded once and kept in registers across the whole buffer
+    __m128i k[total_round + 1];
+#pragma GCC unroll 15
+    for (size_t round = 0; round <= total_round; ++round)
+        k[round] = _mm_loadu_si128((const __m128i*)(key) + round);
+
+    for (; i + ways <= blocks; i += ways) {
+        __m128i state[ways];
+        for (size_t j = 0; j < ways; ++j)
+            state[j] = _mm_xor_si128(_mm_loadu_si128(src + i + j), k[0]);
+
+#pragma GCC unroll 14
+        for (size_t round = 1; round < total_round; ++round) {
+#pragma GCC unroll 8
+            for (size_t j = 0; j < ways; ++j)
+                state[j] = _mm_aesenc_si128(state[j], k[round]);
+        }
+
+        for (size_t j = 0; j < ways; ++j)
+            _mm_storeu_si128(dst + i + j, _mm_aesenclast_si128(state[j], k[total_round]));
+    }
+
+    for (; i < blocks; ++i)
+        aesIterationAESNI<total_round>(in + 16 * i, out + 16 * i, key);
+}
+
+// equivalent inverse cipher schedule through aesimc, same layout as keyExpansionInverseSoftware
+AESNI_TARGET void keyExpansionInverseAESNI(const uint8_t keys[], uint8_t dkeys[], size_t total_round) {
+    const __m128i* ks = (const __m128i*)(keys);
+    __m128i* dks = (__m128i*)(dkeys);
+
+    _mm_storeu_si128(dks, _mm_loadu_si128(ks + total_round));
+    for (size_t round = 1; round < total_round; ++round)
+        _mm_storeu_si128(dks + round, _mm_aesimc_si128(_mm_loadu_si128(ks + total_round - round)));
+    _mm_storeu_si128(dks + total_round, _mm_loadu_si128(ks));
+}
+
+template <size_t total_round>
+AESNI_TARGET void aesInverseIterationAESNI(const uint8_t in[], uint8_t out[], const uint8_t key[]) {
+    const __m128i* rk = (const __m128i*)(key);
+    __m128i state = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in)), _mm_loadu_si128(rk));
+
+#pragma GCC unroll 14
+    for (size_t round = 1; round < total_round; ++round)
+        state = _mm_aesdec_si128(state, _mm_loadu_si128(rk + round));
+    state = _mm_aesdeclast_si128(state, _mm_loadu_si128(rk + total_round));
+
+    _mm_storeu_si128((__m128i*)(out), state);
+}
+
+// 8 independent blocks interleaved round by round
+// in: 16 * blocks bytes
+// out: 16 * blocks bytes, may be the same as in
+template <size_t total_round>
+AESNI_TARGET void aesDecryptBlocksAESNI(const uint8_t in[], uint8_t out[], size_t blocks, const uint8_t key[]) {
+    constexpr size_t ways = 8;
+    const __m128i* src = (const __m128i*)(in);
+    __m128i* dst = (__m128i*)(out);
+    size_t i = 0;
+
+    // round keys are loaded once and kept in registers across the whole buffer
+    __m128i k[total_round + 1];
+#pragma GCC unroll 15
+    for (size_t round = 0; round <= total_round; ++round)
+        k[round] = _mm_loadu_si128((const __m128i*)(key) + round);
+
+    for (; i + ways <= blocks; i += ways) {
+        __m128i state[ways];
+        for (size_t j = 0; j < ways; ++j)
+            state[j] = _mm_xor_si128(_mm_loadu_si128(src + i + j), k[0]);
+
+#pragma GCC unroll 14
+        for (size_t round = 1; round < total_round; ++round) {
+#pragma GCC unroll 8
+            for (size_t j = 0; j < ways; ++j)
+                state[j] = _mm_aesdec_si128(state[j], k[round]);
+        }
+
+        for (size_t j = 0; j < ways; ++j)
+            _mm_storeu_si128(dst + i + j, _mm_aesdeclast_si128(state[j], k[total_round]));
+    }
+
+    for (; i < blocks; ++i)
+        aesInverseIterationAESNI<total_round>(in + 16 * i, out + 16 * i, key);
+}
+#else
+const bool aesni_supported = false;
+#endif
+
+// key expansion used by the modes below,
+// AES-NI when the CPU has it, T-tables otherwise
+void keyExpansion(const uint8_t key[], uint8_t keys[], const size_t key_length) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (aesni_supported) return keyExpansionAESNI(key, keys, key_length);
+#endif
+    keyExpansionSoftware(key, keys, key_length);
+}
+
+// keys: from keyExpansion
+// dkeys: 4 * (round + 1) * 4 bytes, decryption round keys
+void keyExpansionInverse(const uint8_t keys[], uint8_t dkeys[], size_t total_round) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (aesni_supported) return keyExpansionInverseAESNI(keys, dkeys, total_round);
+#endif
+    keyExpansionInverseSoftware(keys, dkeys, total_round);
+}
+
+// Bitsliced constant-time AES, after Kasper & Schwabe and BearSSL's aes_ct64:
+// 4 blocks are spread over 8 64-bit bit planes q[0..7], 
+// q[i] holds bit i of every byte of the 4 blocks,
+// so SubBytes is a boolean circuit and no lookup depends on data or key.
+// W is uint64_t (4 blocks), or a vector of 64-bit lanes, each lane 4 more blocks.
+#define BITSLICED_INLINE __attribute__((always_inline)) inline
+
+typedef uint64_t BitPlanes128 __attribute__((vector_size(16)));
+typedef uint64_t BitPlanes256 __attribute__((vector_size(32)));
+
+// SubBytes on bit planes, Boyar-Peralta circuit of 113 gates
+template <class W>
+BITSLICED_INLINE void bitslicedSubBytes(W q[]) {
+    // x0 is the high bit, x7 the low bit
+    const W x0 = q[7], x1 = q[6], x2 = q[5], x3 = q[4], 
+            x4 = q[3], x5 = q[2], x6 = q[1], x7 = q[0];
+
+    // top linear transformation
+    const W y14 = x3 ^ x5,  y13 = x0 ^ x6,  y9  = x0 ^ x3,  y8  = x0 ^ x5;
+    const W t0  = x1 ^ x2,  y1  = t0 ^ x7,  y4  = y1 ^ x3,  y12 = y13 ^ y14;
+    const W y2  = y1 ^ x0,  y5  = y1 ^ x6,  y3  = y5 ^ y8,  t1  = x4 ^ y12;
+    const W y15 = t1 ^ x5,  y20 = t1 ^ x1,  y6  = y15 ^ x7, y10 = y15 ^ t0;
+    const W y11 = y20 ^ y9, y7  = x7 ^ y11, y17 = y10 ^ y11, y19 = y10 ^ y8;
+    const W y16 = t0 ^ y11, y21 = y13 ^ y16, y18 = x0 ^ y16;
+
+    // non-linear section
+    const W t2  = y12 & y15, t3  = y3 & y6,   t4  = t3 ^ t2,   t5  = y4 & x7;
+    const W t6  = t5 ^ t2,   t7  = y13 & y16, t8  = y5 & y1,   t9  = t8 ^ t7;
+    const W t10 = y2 & y7,   t11 = t10 ^ t7,  t12 = y9 & y11,  t13 = y14 & y17;
+    const W t14 = t13 ^ t12, t15 = y8 & y10,  t16 = t15 ^ t12, t17 = t4 ^ t14;
+    const W t18 = t6 ^ t16,  t19 = t9 ^ t14,  t20 = t11 ^ t16, t21 = t17 ^ y20;
+    const W t22 = t18 ^ y19, t23 = t19 ^ y21, t24 = t20 ^ y18;
+
+    const W t25 = t21 ^ t22, t26 = t21 & t23, t27 = t24 ^ t26, t28 = t25 & t27;
+    const W t29 = t28 ^ t22, t30 = t23 ^ t24, t31 = t22 ^ t26, t32 = t31 & t30;
+    const W t33 = t32 ^ t24, t34 = t23 ^ t33, t35 = t27 ^ t33, t36 = t24 & t35;
+    const W t37 = t36 ^ t34, t38 = t27 ^ t36, t39 = t29 & t38, t40 = t25 ^ t39;
+
+    const W t41 = t40 ^ t37, t42 = t29 ^ t33, t43 = t29 ^ t40, t44 = t33 ^ t37;
+    const W t45 = t42 ^ t41;
+    const W z0  = t44 & y15, z1  = t37 & y6,  z2  = t33 & x7,  z3  = t43 & y16;
+    const W z4  = t40 & y1,  z5  = t29 & y7,  z6  = t42 & y11, z7  = t45 & y17;
+    const W z8  = t41 & y10, z9  = t44 & y12, z10 = t37 & y3,  z11 = t33 & y4;
+    const W z12 = t43 & y13, z13 = t40 & y5,  z14 = t29 & y2,  z15 = t42 & y9;
+    const W z16 = t45 & y14, z17 = t41 & y8;
+
+    // bottom linear transformation
+    const W t46 = z15 ^ z16, t47 = z10 ^ z11, t48 = z5 ^ z13,  t49 = z9 ^ z10;
+    const W t50 = z2 ^ z12,  t51 = z2 ^ z5,   t52 = z7 ^ z8,   t53 = z0 ^ z3;
+    const W t54 = z6 ^ z7,   t55 = z16 ^ z17, t56 = z12 ^ t48, t57 = t50 ^ t53;
+    const W t58 = z4 ^ t46,  t59 = z3 ^ t54,  t60 = t46 ^ t57, t61 = z14 ^ t57;
+    const W t62 = t52 ^ t58, t63 = t49 ^ t58, t64 = z4 ^ t59,  t65 = t61 ^ t62;
+    const W t66 = z1 ^ t63,  t67 = t64 ^ t65;
+
+    const W s0 = t59 ^ t63,  s3 = t53 ^ t66, s4 = t51 ^ t66, s5 = t47 ^ t65;
+    const W s6 = t56 ^ ~t62, s7 = t48 ^ ~t60, s1 = t64 ^ ~s3, s2 = t55 ^ ~t67;
+
+    q[7] = s0, q[6] = s1, q[5] = s2, q[4] = s3;
+    q[3] = s4, q[2] = s5, q[1] = s6, q[0] = s7;
+}
+
+template <class W>
+BITSLICED_INLINE void bitslicedSwap(W& x, W& y, const uint64_t cl, const uint64_t ch, const int s) {
+    const W a = x, b = y;
+    x = (a & cl) | ((b & cl) << s);
+    y = ((a & ch) >> s) | (b & ch);
+}
+
+// transposes between bit planes and bytes, its own inverse
+template <class W>
+BITSLICED_INLINE void bitslicedOrtho(W q[]) {
+    constexpr uint64_t m1l = 0x5555555555555555, m1h = 0xAAAAAAAAAAAAAAAA;
+    constexpr uint64_t m2l = 0x3333333333333333, m2h = 0xCCCCCCCCCCCCCCCC;
+    constexpr uint64_t m4l = 0x0F0F0F0F0F0F0F0F, m4h = 0xF0F0F0F0F0F0F0F0;
+
+    bitslicedSwap(q[0], q[1], m1l, m1h, 1), bitslicedSwap(q[2], q[3], m1l, m1h, 1);
+    bitslicedSwap(q[4], q[5], m1l, m1h, 1), bitslicedSwap(q[6], q[7], m1l, m1h, 1);
+    bitslicedSwap(q[0], q[2], m2l, m2h, 2), bitslicedSwap(q[1], q[3], m2l, m2h, 2);
+    bitslicedSwap(q[4], q[6], m2l, m2h, 2), bitslicedSwap(q[5], q[7], m2l, m2h, 2);
+    bitslicedSwap(q[0], q[4], m4l, m4h, 4), bitslicedSwap(q[1], q[5], m4l, m4h, 4);
+    bitslicedSwap(q[2], q[6], m4l, m4h, 4), bitslicedSwap(q[3], q[7], m4l, m4h, 4);
+}
+
+template <class W>
+BITSLICED_INLINE void bitslicedShiftRows(W q[]) {
+    for (size_t i = 0; i < 8; ++i) {
+        const W x = q[i];
+        q[i] = (x & 0x000000000000FFFF)
+             | ((x & 0x00000000FFF00000) >> 4) | ((x & 0x00000000000F0000) << 12)
+             | ((x & 0x0000FF0000000000) >> 8) | ((x & 0x000000FF00000000) << 8)
+             | ((x & 0xF000000000000000) >> 12) | ((x & 0x0FFF000000000000) << 4);
+    }
+}
+
+template <class W>
+BITSLICED_INLINE void bitslicedMixColumns(W q[]) {
+    // r: every column rotated by one row, s: rotated by two rows
+    W x[8], r[8], s[8];
+    for (size_t i = 0; i < 8; ++i) {
+        x[i] = q[i];
+        r[i] = (x[i] >> 16) | (x[i] << 48);
+        s[i] = x[i] ^ r[i];
+        s[i] = (s[i] >> 32) | (s[i] << 32);
+    }
+
+    q[0] = x[7] ^ r[7] ^ r[0] ^ s[0];
+    q[1] = x[0] ^ r[0] ^ x[7] ^ r[7] ^ r[1] ^ s[1];
+    q[2] = x[1] ^ r[1] ^ r[2] ^ s[2];
+    q[3] = x[2] ^ r[2] ^ x[7] ^ r[7] ^ r[3] ^ s[3];
+    q[4] = x[3] ^ r[3] ^ x[7] ^ r[7] ^ r[4] ^ s[4];
+    q[5] = x[4] ^ r[4] ^ r[5] ^ s[5];
+    q[6] = x[5] ^ r[5] ^ r[6] ^ s[6];
+    q[7] = x[6] ^ r[6] ^ r[7] ^ s[7];
+}
+
+// key: 8 * (round + 1) bit planes, the same round key in every block slot
+template <class W>
+BITSLICED_INLINE void bitslicedEncrypt(W q[], const uint64_t key[], size_t total_round) {
+    for (size_t i = 0; i < 8; ++i) q[i] ^= key[i];
+
+    for (size_t round = 1; round < total_round; ++round) {
+        bitslicedSubBytes(q);
+        bitslicedShiftRows(q);
+        bitslicedMixColumns(q);
+        for (size_t i = 0; i < 8; ++i) q[i] ^= key[8 * round + i];
+    }
+    bitslicedSubBytes(q);
+    bitslicedShiftRows(q);
+    for (size_t i = 0; i < 8; ++i) q[i] ^= key[8 * total_round + i];
+}
+
+inline uint32_t getWordLE(const uint8_t p[]) {
+    return uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24;
+}
+
+inline void putWordLE(uint8_t p[], const uint32_t x) {
+    p[0] = x, p[1] = x >> 8, p[2] = x >> 16, p[3] = x >> 24;
+}
+
+// spreads the 4 little-endian words of a block over two 64-bit words,
+// 16 bits of each byte pair at a time, ready for bitslicedOrtho
+inline void bitslicedInterleaveIn(uint64_t& q0, uint64_t& q1, const uint8_t in[]) {
+    uint64_t x[4];
+    for (size_t i = 0; i < 4; ++i) {
+        x[i] = getWordLE(in + 4 * i);
+        x[i] = (x[i] | x[i] << 16) & 0x0000FFFF0000FFFF;
+        x[i] = (x[i] | x[i] <<  8) & 0x00FF00FF00FF00FF;
+    }
+    q0 = x[0] | x[2] << 8;
+    q1 = x[1] | x[3] << 8;
+}
+
+inline void bitslicedInterleaveOut(uint8_t out[], const uint64_t q0, const uint64_t q1) {
+    uint64_t x[4] = { q0 & 0x00FF00FF00FF00FF, q1 & 0x00FF00FF00FF00FF,
+                      q0 >> 8 & 0x00FF00FF00FF00FF, q1 >> 8 & 0x00FF00FF00FF00FF };
+    for (size_t i = 0; i < 4; ++i) {
+        x[i] = (x[i] | x[i] >> 8) & 0x0000FFFF0000FFFF;
+        putWordLE(out + 4 * i, uint32_t(x[i]) | uint32_t(x[i] >> 16));
+    }
+}
+
+// SubWord of the key schedule through the same circuit
+inline uint32_t bitslicedSubWord(const uint32_t x) {
+    uint64_t q[8] = { x };
+    bitslicedOrtho(q);
+    bitslicedSubBytes(q);
+    bitslicedOrtho(q);
+    return uint32_t(q[0]);
+}
+
+// key: initial key: 16 or 24 or 32 bytes
+// keys : 8 * (6 + key_length / 4 + 1) bit planes
+// byte_keys: 4 * (6 + key_length / 4 + 1) * 4 bytes, the same schedule laid out as keyExpansion's,
+//            derived without table lookups
+void keyExpansionBitsliced(const uint8_t key[], uint64_t keys[], uint8_t byte_keys[], const size_t key_length) {
+    constexpr uint32_t RCON[10] = { 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36 };
+    const size_t nk = key_length / 4, total_round = 6 + nk;
+    uint32_t words[60];
+
+    for (size_t i = 0; i < nk; ++i)
+        words[i] = getWordLE(key + 4 * i);
+
+    for (size_t i = nk; i < 4 * (total_round + 1); ++i) {
+        uint32_t tmp = words[i - 1];
+        if (i % nk == 0)
+            tmp = bitslicedSubWord(tmp >> 8 | tmp << 24) ^ RCON[i / nk - 1];
+        else if (nk > 6 && i % nk == 4)
+            tmp = bitslicedSubWord(tmp);
+        words[i] = words[i - nk] ^ tmp;
+    }
+
+    for (size_t i = 0; i < 4 * (total_round + 1); ++i)
+        putWordLE(byte_keys + 4 * i, words[i]);
+
+    // each round key goes into all 4 block slots
+    for (size_t round = 0; round <= total_round; ++round) {
+        uint8_t round_key[16];
+        for (size_t i = 0; i < 4; ++i)
+            putWordLE(round_key + 4 * i, words[4 * round + i]);
+
+        uint64_t* q = keys + 8 * round;
+        bitslicedInterleaveIn(q[0], q[4], round_key);
+        q[1] = q[2] = q[3] = q[0];
+        q[5] = q[6] = q[7] = q[4];
+        bitslicedOrtho(q);
+    }
+}
+
+// W holds sizeof(W) / 8 lanes of 4 blocks each
+// in: 16 * blocks bytes
+// out: 16 * blocks bytes, may be the same as in
+template <class W>
+BITSLICED_INLINE void aesEncryptBlocksBitslicedLanes(const uint8_t in[], uint8_t out[], size_t blocks, 
+                                                     const uint64_t key[], size_t total_round) {
+    constexpr size_t lanes = sizeof(W) / 8, ways = 4 * lanes;
 
-    for (size_t round = 0; round < total_round - 1; ++round) {
-        subBytes(state);
-        shiftRows(state);
-        mixColumns(state);
-        addRoundKey(state, key + 16 * round + 16);
+    for (size_t i = 0; i < blocks; i += ways) {
+        const size_t n = std::min(ways, blocks - i);
+        // a short batch is padded with zero blocks
+        uint8_t buffer[16 * ways] = { 0 };
+        memcpy(buffer, in + 16 * i, 16 * n);
+
+        W q[8];
+        for (size_t lane = 0; lane < lanes; ++lane) {
+            uint64_t x[8];
+            for (size_t j = 0; j < 4; ++j)
+                bitslicedInterleaveIn(x[j], x[j + 4], buffer + 16 * (4 * lane + j));
+            for (size_t j = 0; j < 8; ++j)
+                ((uint64_t*)(q + j))[lane] = x[j];
+        }
+
+        bitslicedOrtho(q);
+        bitslicedEncrypt(q, key, total_round);
+        bitslicedOrtho(q);
+
+        for (size_t lane = 0; lane < lanes; ++lane) {
+            uint64_t x[8];
+            for (size_t j = 0; j < 8; ++j)
+                x[j] = ((const uint64_t*)(q + j))[lane];
+            for (size_t j = 0; j < 4; ++j)
+                bitslicedInterleaveOut(buffer + 16 * (4 * lane + j), x[j], x[j + 4]);
+        }
+
+        memcpy(out + 16 * i, buffer, 16 * n);
     }
-    subBytes(state);
-    shiftRows(state);
-    addRoundKey(state, key + 16 * total_round);
 }
 
-void aes_ecb(const void* plain, size_t length, const void* key, const size_t key_length, void* cipher) {
+#if defined(__x86_64__) || defined(__i386__)
+// 16 blocks per call in 256-bit registers
+__attribute__((target("avx2")))
+void aesEncryptBlocksBitslicedAVX2(const uint8_t in[], uint8_t out[], size_t blocks, 
+                                   const uint64_t key[], size_t total_round) {
+    aesEncryptBlocksBitslicedLanes<BitPlanes256>(in, out, blocks, key, total_round);
+}
+
+inline bool cpuSupportsAVX2() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+const bool avx2_supported = cpuSupportsAVX2();
+#endif
+
+// in: 16 * blocks bytes
+// out: 16 * blocks bytes, may be the same as in
+// key: 8 * (round + 1) bit planes, from keyExpansionBitsliced
+void aesEncryptBlocksBitsliced(const uint8_t in[], uint8_t out[], size_t blocks, 
+                               const uint64_t key[], size_t total_round) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (avx2_supported) return aesEncryptBlocksBitslicedAVX2(in, out, blocks, key, total_round);
+#endif
+    // 8 blocks per call in 128-bit registers where there is SIMD, 
+    // the compiler falls back to pairs of 64-bit words otherwise
+    aesEncryptBlocksBitslicedLanes<BitPlanes128>(in, out, blocks, key, total_round);
+}
+
+// engines selectable at the entry points
+// Auto: AES-NI when the CPU has it, T-tables otherwise
+// Table: T-tables only
+// Bitsliced: constant-time, for hosts without AES-NI where T-tables leak through the cache
+enum class AESEngine { Auto, Table, Bitsliced };
+
+// "table" or "bitsliced", anything else is Auto
+AESEngine parseEngine(const char* name) {
+    if (!strcmp(name, "table")) return AESEngine::Table;
+    if (!strcmp(name, "bitsliced")) return AESEngine::Bitsliced;
+    return AESEngine::Auto;
+}
+
+// expanded keys and the cores specialized for their key size,
+// built once per key by aesInit and shared by every call
+struct alignas(64) AESContext {
+    AESEngine engine;
+    size_t total_round;
     uint8_t keys[60 * 4];
-    keyExpansion((uint8_t*)(key), keys, key_length);
+    // decryption round keys, see keyExpansionInverse
+    uint8_t dkeys[60 * 4];
+    // Bitsliced only, see keyExpansionBitsliced
+    uint64_t bitsliced_keys[15 * 8];
+    // Auto and Table only, 16 * blocks bytes
+    void (*encrypt_blocks)(const uint8_t in[], uint8_t out[], size_t blocks, const uint8_t key[]);
+    // 16 * blocks bytes, with dkeys; 
+    // null for Bitsliced without AES-NI, where only table-driven decryption would be available
+    void (*decrypt_blocks)(const uint8_t in[], uint8_t out[], size_t blocks, const uint8_t key[]);
+};
+
+// Auto: AES-NI when the CPU has it, T-tables otherwise
+// Table: T-tables
+template <size_t total_round>
+void aesSelectCores(AESContext& context, const AESEngine engine) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (aesni_supported && engine == AESEngine::Auto) {
+        context.encrypt_blocks = aesEncryptBlocksAESNI<total_round>;
+        context.decrypt_blocks = aesDecryptBlocksAESNI<total_round>;
+        return;
+    }
+#endif
+    context.encrypt_blocks = aesEncryptBlocksTable<total_round>;
+    context.decrypt_blocks = aesDecryptBlocksTable<total_round>;
+}
+
+// key_length: 16, 24 or 32 bytes
+// Bitsliced contexts expand the key without table lookups and encrypt with the bitsliced core.
+// There being no bitsliced inverse cipher, they decrypt with AES-NI, 
+// and cannot decrypt on CPUs without it rather than fall back to key-indexed tables.
+// The only dispatch on key size, the modes call the specialized cores directly.
+void aesInit(AESContext& context, const void* key, const size_t key_length, 
+             const AESEngine engine = AESEngine::Auto) {
+    context.engine = engine;
+    context.total_round = 6 + key_length / 4;
+
+    if (engine == AESEngine::Bitsliced) {
+        keyExpansionBitsliced((const uint8_t*)(key), context.bitsliced_keys, context.keys, key_length);
+        context.encrypt_blocks = nullptr;
+        context.decrypt_blocks = nullptr;
+#if defined(__x86_64__) || defined(__i386__)
+        if (aesni_supported) {
+            keyExpansionInverseAESNI(context.keys, context.dkeys, context.total_round);
+            if (key_length == 16) aesSelectCores<10>(context, AESEngine::Auto);
+            else if (key_length == 24) aesSelectCores<12>(context, AESEngine::Auto);
+            else aesSelectCores<14>(context, AESEngine::Auto);
+        }
+#endif
+        return;
+    }
 
-    for (size_t i = 0; i < length / 16; ++i)
-        aesIteration((uint8_t*)(plain) + 16 * i, (uint8_t*)(cipher) + 16 * i, keys, 6 + key_length / 4);
+    if (engine == AESEngine::Table) {
+        keyExpansionSoftware((const uint8_t*)(key), context.keys, key_length);
+        keyExpansionInverseSoftware(context.keys, context.dkeys, context.total_round);
+    } else {
+        keyExpansion((const uint8_t*)(key), context.keys, key_length);
+        keyExpansionInverse(context.keys, context.dkeys, context.total_round);
+    }
+
+    if (key_length == 16) aesSelectCores<10>(context, engine);
+    else if (key_length == 24) aesSelectCores<12>(context, engine);
+    else aesSelectCores<14>(context, engine);
+}
+
+void aes_ecb(const void* plain, size_t length, const AESContext& context, void* cipher) {
+    const uint8_t* plain_ = (const uint8_t*)(plain);
+    uint8_t* cipher_ = (uint8_t*)(cipher);
+
+    if (context.engine == AESEngine::Bitsliced)
+        aesEncryptBlocksBitsliced(plain_, cipher_, length / 16, context.bitsliced_keys, context.total_round);
+    else
+        context.encrypt_blocks(plain_, cipher_, length / 16, context.keys);
+}
+
+// Decryption runs the equivalent inverse cipher through the multi-block core,
+// AES-NI when the CPU has it, inverse T-tables otherwise.
+// Bitsliced contexts decrypt with AES-NI only; 
+// returns false, writing nothing, for a Bitsliced context on a CPU without AES-NI.
+bool aes_ecb_decrypt(const void* cipher, size_t length, const AESContext& context, void* plain) {
+    const uint8_t* cipher_ = (const uint8_t*)(cipher);
+    uint8_t* plain_ = (uint8_t*)(plain);
+
+    if (!context.decrypt_blocks) return false;
+    context.decrypt_blocks(cipher_, plain_, length / 16, context.dkeys);
+    return true;
 }
 
 int main(int argc, char** argv) {
@@ -213,7 +1005,7 @@ int main(int argc, char** argv) {
     unsigned char key[32] = { 0 };
     size_t key_length = 0;
 
-    if (argc == 3) {
+    if (argc >= 3) {
         fin.open(argv[2]);
         fin.seekg(0, std::ios::beg);
         char buffer[3] = { 0 };
@@ -230,8 +1022,25 @@ int main(int argc, char** argv) {
         return 0;
     }
 
+    // optional arguments: engine name, "decrypt"
+    AESEngine engine = AESEngine::Auto;
+    bool decrypt = false;
+    for (int i = 3; i < argc; ++i) {
+        if (!strcmp(argv[i], "decrypt")) decrypt = true;
+        else engine = parseEngine(argv[i]);
+    }
+
+    AESContext context;
+    aesInit(context, key, key_length, engine);
+
     std::vector<char> cipher(buffer.length(), 0);
-    aes_ecb(buffer.data(), buffer.length(), key, key_length, &cipher[0]);
+    if (decrypt) {
+        if (!aes_ecb_decrypt(buffer.data(), buffer.length(), context, &cipher[0])) {
+            printf("Bitsliced engine decrypts only with AES-NI. \n");
+            return 0;
+        }
+    } else
+        aes_ecb(buffer.data(), buffer.length(), context, &cipher[0]);
 
     for (size_t i = 0; i < buffer.length(); ++i)
         printf("%02x", int(cipher[i]) & 0xff);
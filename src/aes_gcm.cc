@@ -10,19 +10,31 @@
  *  E-mail: hoojamis@gmail.com
  *  Date: May 17, 2015
  *  Time: 16:25:47
- *  Description: AES (128 bit) GCM
- *               block size 16 bytes, PKCS7 padding
- *               IV: 12 bytes (explicitly given) concatenate with counter (4 bytes)
- *               range of counter is [1, UINT_MAX]
+ *  Description: AES(128, 192, 256 bit) GCM
+ *               any message length, no padding; one-shot or streaming
+ *               IV: 12 bytes (explicitly given) concatenate with counter (4 bytes),
+ *                   other lengths derive the initial counter block through GHASH
+ *               counter wraps modulo 2^32 (inc32)
  *****************************************************************************/
 #include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <fstream>
 #include <cinttypes>
 #include <vector>
+#include <list>
+#include <unordered_map>
+#include <utility>
+#include <iterator>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <wmmintrin.h>
+#include <tmmintrin.h>
+#endif
 #include <cassert>
+#include <algorithm>
 
-inline uint8_t gmult(uint8_t a, uint8_t b) {
+constexpr uint8_t gmult(uint8_t a, uint8_t b) {
     uint8_t p = 0, hbs = 0;
 
     for (size_t i = 0; i < 8; i++) {
@@ -57,9 +69,9 @@ constexpr uint8_t SubBytes[256] = {
    0x8C, 0xA1, 0x89, 0x0D, 0xBF, 0xE6, 0x42, 0x68, 0x41, 0x99, 0x2D, 0x0F, 0xB0, 0x54, 0xBB, 0x16
 };
 
-// key: initial key: 16 bytes
-// keys : 44 * 4 bytes
-void keyExpansion(const uint8_t key[], uint8_t keys[]) {
+// key: initial key: 16 or 24 or 32 bytes
+// keys : 4 * (6 + key_length / 4 + 1) * 4 bytes
+void keyExpansionSoftware(const uint8_t key[], uint8_t keys[], const size_t key_length) {
     constexpr uint8_t RCON[10][4] = {
         { 0x01, 0x00, 0x00, 0x00 },
         { 0x02, 0x00, 0x00, 0x00 },
@@ -74,12 +86,12 @@ void keyExpansion(const uint8_t key[], uint8_t keys[]) {
     };
 
 
-    memcpy(keys, key, 4 * 4);
+    memcpy(keys, key, key_length);
 
-    for (size_t i = 4; i < 44; ++i) {
+    for (size_t i = key_length / 4; i < 4 * (6 + key_length / 4 + 1); ++i) {
         uint8_t tmp[4] = { keys[4 * (i - 1) + 0], keys[4 * (i - 1) + 1],
                            keys[4 * (i - 1) + 2], keys[4 * (i - 1) + 3] };
-        if (i % 4 == 0) {
+        if (i % (key_length / 4) == 0) {
             // rotate left one byte
             uint8_t temp = tmp[0];
             tmp[0] = tmp[1], tmp[1] = tmp[2], tmp[2] = tmp[3], tmp[3] = temp;
@@ -89,225 +101,1120 @@ void keyExpansion(const uint8_t key[], uint8_t keys[]) {
             tmp[2] = SubBytes[tmp[2]];
             tmp[3] = SubBytes[tmp[3]];
             // XOR round constants
-            tmp[0] ^= RCON[i / 4 - 1][0], tmp[1] ^= RCON[i / 4 - 1][1], 
-            tmp[2] ^= RCON[i / 4 - 1][2], tmp[3] ^= RCON[i / 4 - 1][3];
+            tmp[0] ^= RCON[i / (key_length / 4) - 1][0], tmp[1] ^= RCON[i / (key_length / 4) - 1][1], 
+            tmp[2] ^= RCON[i / (key_length / 4) - 1][2], tmp[3] ^= RCON[i / (key_length / 4) - 1][3];
+        } else if (key_length > 24 && i % (key_length / 4) == 4) {
+            tmp[0] = SubBytes[tmp[0]];
+            tmp[1] = SubBytes[tmp[1]];
+            tmp[2] = SubBytes[tmp[2]];
+            tmp[3] = SubBytes[tmp[3]];
         }
         keys[4 * i + 0] = tmp[0], keys[4 * i + 1] = tmp[1],
         keys[4 * i + 2] = tmp[2], keys[4 * i + 3] = tmp[3];
-        keys[4 * i + 0] ^= keys[4 * (i - 4) + 0], 
-        keys[4 * i + 1] ^= keys[4 * (i - 4) + 1],
-        keys[4 * i + 2] ^= keys[4 * (i - 4) + 2],
-        keys[4 * i + 3] ^= keys[4 * (i - 4) + 3];
+        keys[4 * i + 0] ^= keys[4 * (i - key_length / 4) + 0], 
+        keys[4 * i + 1] ^= keys[4 * (i - key_length / 4) + 1],
+        keys[4 * i + 2] ^= keys[4 * (i - key_length / 4) + 2],
+        keys[4 * i + 3] ^= keys[4 * (i - key_length / 4) + 3];
     }
+
 }
 
+inline uint32_t getWord(const uint8_t p[]) {
+    return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | uint32_t(p[3]);
+}
 
-inline void subBytes(uint8_t state[]) {
-    for (size_t i = 0; i < 16; ++i)
-        state[i] = SubBytes[state[i]];
-}
-
-inline void shiftRows(uint8_t state[]) {
-    uint8_t tmp = state[1];
-    state[1] = state[5];
-    state[5] = state[9];
-    state[9] = state[13];
-    state[13] = tmp;
-
-    tmp = state[2];
-    state[2] = state[10];
-    state[10] = tmp;
-    tmp = state[6];
-    state[6] = state[14];
-    state[14] = tmp;
-    
-    tmp = state[3];
-    state[3] = state[15];
-    state[15] = state[11];
-    state[11] = state[7];
-    state[7] = tmp;
-}
-
-inline void mixColumns(uint8_t state[]) {
-    uint8_t tmp[4];
-    for (size_t i = 0; i < 4; ++i) {
-        tmp[0] = gmult(2, state[4 * i + 0]) ^ 
-                 gmult(3, state[4 * i + 1]) ^
-                 gmult(1, state[4 * i + 2]) ^ 
-                 gmult(1, state[4 * i + 3]);
-        tmp[1] = gmult(1, state[4 * i + 0]) ^
-                 gmult(2, state[4 * i + 1]) ^
-                 gmult(3, state[4 * i + 2]) ^
-                 gmult(1, state[4 * i + 3]);
-        tmp[2] = gmult(1, state[4 * i + 0]) ^
-                 gmult(1, state[4 * i + 1]) ^
-                 gmult(2, state[4 * i + 2]) ^
-                 gmult(3, state[4 * i + 3]);
-        tmp[3] = gmult(3, state[4 * i + 0]) ^
-                 gmult(1, state[4 * i + 1]) ^
-                 gmult(1, state[4 * i + 2]) ^
-                 gmult(2, state[4 * i + 3]);
-        state[4 * i + 0] = tmp[0], state[4 * i + 1] = tmp[1],
-        state[4 * i + 2] = tmp[2], state[4 * i + 3] = tmp[3];
-    }
-}
-
-inline void addRoundKey(uint8_t state[], const uint8_t word[]) {
-    for (size_t i = 0; i < 16; ++i) 
-        state[i] ^= word[i];
+inline void putWord(uint8_t p[], const uint32_t x) {
+    p[0] = x >> 24, p[1] = x >> 16, p[2] = x >> 8, p[3] = x;
 }
 
+// T-tables, generated at compile time from SubBytes
+// Te0[x] is column (2s, s, s, 3s) where s = SubBytes[x], 
+// i.e. SubBytes and MixColumns of one byte at row 0 in one lookup,
+// Te1..Te3 are Te0 rotated right by 8, 16, 24 bits for rows 1..3.
+// Te4[x] is (s, s, s, s), used by the final round which has no MixColumns.
+struct AESTables {
+    uint32_t Te0[256], Te1[256], Te2[256], Te3[256], Te4[256];
+
+    constexpr AESTables(): Te0(), Te1(), Te2(), Te3(), Te4() {
+        for (size_t x = 0; x < 256; ++x) {
+            const uint32_t s1 = SubBytes[x], s2 = gmult(2, s1), s3 = gmult(3, s1);
+            Te0[x] = s2 << 24 | s1 << 16 | s1 <<  8 | s3;
+            Te1[x] = s3 << 24 | s2 << 16 | s1 <<  8 | s1;
+            Te2[x] = s1 << 24 | s3 << 16 | s2 <<  8 | s1;
+            Te3[x] = s1 << 24 | s1 << 16 | s3 <<  8 | s2;
+            Te4[x] = s1 << 24 | s1 << 16 | s1 <<  8 | s1;
+        }
+    }
+};
+
+constexpr AESTables T;
+
 // in: 16 bytes
 // out: 16 bytes
-// key: 44 * 4 bytes
-void aesIteration(const uint8_t in[], uint8_t out[], const uint8_t key[]) {
-    uint8_t* state = out;
-    memcpy(state, in, 16);
-    
-    // add round key
-    addRoundKey(state, key);
+// key: 4 * (round + 1) * 4 bytes
+template <size_t total_round>
+void aesIterationTable(const uint8_t in[], uint8_t out[], const uint8_t key[]) {
+    // state is kept as 4 big-endian columns
+    uint32_t s0 = getWord(in +  0) ^ getWord(key +  0);
+    uint32_t s1 = getWord(in +  4) ^ getWord(key +  4);
+    uint32_t s2 = getWord(in +  8) ^ getWord(key +  8);
+    uint32_t s3 = getWord(in + 12) ^ getWord(key + 12);
+    uint32_t t0, t1, t2, t3;
 
-    for (size_t round = 0; round < 9; ++round) {
-        subBytes(state);
-        shiftRows(state);
-        mixColumns(state);
-        addRoundKey(state, key + 16 * round + 16);
+#pragma GCC unroll 14
+    for (size_t round = 1; round < total_round; ++round) {
+        const uint8_t* rk = key + 16 * round;
+        t0 = T.Te0[s0 >> 24] ^ T.Te1[s1 >> 16 & 0xff] ^ T.Te2[s2 >> 8 & 0xff] ^ T.Te3[s3 & 0xff] ^ getWord(rk +  0);
+        t1 = T.Te0[s1 >> 24] ^ T.Te1[s2 >> 16 & 0xff] ^ T.Te2[s3 >> 8 & 0xff] ^ T.Te3[s0 & 0xff] ^ getWord(rk +  4);
+        t2 = T.Te0[s2 >> 24] ^ T.Te1[s3 >> 16 & 0xff] ^ T.Te2[s0 >> 8 & 0xff] ^ T.Te3[s1 & 0xff] ^ getWord(rk +  8);
+        t3 = T.Te0[s3 >> 24] ^ T.Te1[s0 >> 16 & 0xff] ^ T.Te2[s1 >> 8 & 0xff] ^ T.Te3[s2 & 0xff] ^ getWord(rk + 12);
+        s0 = t0, s1 = t1, s2 = t2, s3 = t3;
     }
-    subBytes(state);
-    shiftRows(state);
-    addRoundKey(state, key + 16 * 10);
+
+    // final round: SubBytes, ShiftRows, AddRoundKey
+    const uint8_t* rk = key + 16 * total_round;
+    t0 = (T.Te4[s0 >> 24] & 0xff000000) ^ (T.Te4[s1 >> 16 & 0xff] & 0x00ff0000) ^
+         (T.Te4[s2 >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s3 & 0xff] & 0x000000ff) ^ getWord(rk +  0);
+    t1 = (T.Te4[s1 >> 24] & 0xff000000) ^ (T.Te4[s2 >> 16 & 0xff] & 0x00ff0000) ^
+         (T.Te4[s3 >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s0 & 0xff] & 0x000000ff) ^ getWord(rk +  4);
+    t2 = (T.Te4[s2 >> 24] & 0xff000000) ^ (T.Te4[s3 >> 16 & 0xff] & 0x00ff0000) ^
+         (T.Te4[s0 >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s1 & 0xff] & 0x000000ff) ^ getWord(rk +  8);
+    t3 = (T.Te4[s3 >> 24] & 0xff000000) ^ (T.Te4[s0 >> 16 & 0xff] & 0x00ff0000) ^
+         (T.Te4[s1 >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s2 & 0xff] & 0x000000ff) ^ getWord(rk + 12);
+
+    putWord(out +  0, t0);
+    putWord(out +  4, t1);
+    putWord(out +  8, t2);
+    putWord(out + 12, t3);
 }
 
-// X: 16 bytes
-// Y: 16 bytes
-// out: 16 bytes
-void galois_multiply(const uint8_t X[], const uint8_t Y[], uint8_t out[]) {
-    uint8_t V[16];
-    memcpy(V, Y, 16);
-    uint8_t Z[16] = { 0 };
-
-    for (size_t i = 0; i < 16; ++i) {
-        for (size_t j = 0; j < 8; ++j) {
-            if (X[i] & 1 << (7 - j))
-                for (size_t k = 0; k < 16; ++k) Z[k] ^= V[k];
-
-            if (V[15] & 1) {
-                for (size_t k = 0; k < 16; ++k) {
-                    if (k && V[15 - k] & 1)
-                        V[16 - k] |= 0x80;
-                    V[15 - k] >>= 1;
-                }
-                
-                V[0] ^= 0xe1;
-            } else {
-                for (size_t k = 0; k < 16; ++k) {
-                    if (k && V[15 - k] & 1)
-                        V[16 - k] |= 0x80;
-                    V[15 - k] >>= 1;
-                }
-            }
+// 4 independent blocks interleaved round by round, 
+// so the table lookups of one block overlap the latency of the others
+// in: 16 * blocks bytes
+// out: 16 * blocks bytes, may be the same as in
+template <size_t total_round>
+void aesEncryptBlocksTable(const uint8_t in[], uint8_t out[], size_t blocks, const uint8_t key[]) {
+    constexpr size_t ways = 4;
+    size_t i = 0;
+
+    for (; i + ways <= blocks; i += ways) {
+        uint32_t s[ways][4], t[ways][4];
+        for (size_t j = 0; j < ways; ++j)
+            for (size_t c = 0; c < 4; ++c)
+                s[j][c] = getWord(in + 16 * (i + j) + 4 * c) ^ getWord(key + 4 * c);
+
+#pragma GCC unroll 14
+        for (size_t round = 1; round < total_round; ++round) {
+            const uint8_t* rk = key + 16 * round;
+#pragma GCC unroll 4
+            for (size_t j = 0; j < ways; ++j)
+#pragma GCC unroll 4
+                for (size_t c = 0; c < 4; ++c)
+                    t[j][c] = T.Te0[s[j][c] >> 24] ^ T.Te1[s[j][(c + 1) & 3] >> 16 & 0xff] ^ 
+                              T.Te2[s[j][(c + 2) & 3] >> 8 & 0xff] ^ T.Te3[s[j][(c + 3) & 3] & 0xff] ^ 
+                              getWord(rk + 4 * c);
+            memcpy(s, t, sizeof(s));
         }
+
+        const uint8_t* rk = key + 16 * total_round;
+        for (size_t j = 0; j < ways; ++j)
+            for (size_t c = 0; c < 4; ++c)
+                putWord(out + 16 * (i + j) + 4 * c,
+                        (T.Te4[s[j][c] >> 24] & 0xff000000) ^ (T.Te4[s[j][(c + 1) & 3] >> 16 & 0xff] & 0x00ff0000) ^
+                        (T.Te4[s[j][(c + 2) & 3] >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s[j][(c + 3) & 3] & 0xff] & 0x000000ff) ^
+                        getWord(rk + 4 * c));
     }
-    
-    memcpy(out, Z, 16);
+
+    for (; i < blocks; ++i)
+        aesIterationTable<total_round>(in + 16 * i, out + 16 * i, key);
 }
 
-// in: len bytes
-// hash_key: 16 bytes
-// out: ??? bytes
-void gHash(const uint8_t in[], const size_t len, const uint8_t hash_key[], uint8_t out[]) {
-    memset(out, 0x00, 16);
-    for (size_t i = 0; i < len / 16; ++i) {
-        uint8_t tmp[16];
+#if defined(__x86_64__) || defined(__i386__)
+// AES-NI kernels, compiled for the aes target only and selected at runtime
+#define AESNI_TARGET __attribute__((target("aes,sse2")))
+
+inline bool cpuSupportsAESNI() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+    return ecx & bit_AES;
+}
+
+const bool aesni_supported = cpuSupportsAESNI();
+
+AESNI_TARGET inline __m128i keyExpansionAssist(__m128i key, __m128i keygened) {
+    // prefix XOR of the 4 words: w0, w0^w1, w0^w1^w2, w0^w1^w2^w3
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 8));
+    return _mm_xor_si128(key, keygened);
+}
+
+// next 4 words of a 128-bit schedule, or of the even half of a 256-bit schedule
+template <int rcon>
+AESNI_TARGET inline __m128i keyExpansionStep(__m128i key, __m128i prev) {
+    return keyExpansionAssist(key, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(prev, rcon), 0xff));
+}
+
+// odd half of a 256-bit schedule: SubWord without RotWord and round constant
+AESNI_TARGET inline __m128i keyExpansionStep256(__m128i key, __m128i prev) {
+    return keyExpansionAssist(key, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(prev, 0x00), 0xaa));
+}
+
+// next 6 words of a 192-bit schedule, 
+// temp1 holds words 0..3, low half of temp3 holds words 4..5
+template <int rcon>
+AESNI_TARGET inline void keyExpansionStep192(__m128i& temp1, __m128i& temp3) {
+    temp1 = keyExpansionAssist(temp1, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(temp3, rcon), 0x55));
+    __m128i temp2 = _mm_shuffle_epi32(temp1, 0xff);
+    temp3 = _mm_xor_si128(temp3, _mm_slli_si128(temp3, 4));
+    temp3 = _mm_xor_si128(temp3, temp2);
+}
+
+// low half of lo, low half of hi
+AESNI_TARGET inline __m128i shuffleLowLow(__m128i lo, __m128i hi) {
+    return _mm_castpd_si128(_mm_shuffle_pd(_mm_castsi128_pd(lo), _mm_castsi128_pd(hi), 0));
+}
+
+// high half of lo, low half of hi
+AESNI_TARGET inline __m128i shuffleHighLow(__m128i lo, __m128i hi) {
+    return _mm_castpd_si128(_mm_shuffle_pd(_mm_castsi128_pd(lo), _mm_castsi128_pd(hi), 1));
+}
+
+// same layout of keys as keyExpansionSoftware
+AESNI_TARGET void keyExpansionAESNI(const uint8_t key[], uint8_t keys[], const size_t key_length) {
+    __m128i* ks = (__m128i*)(keys);
+
+    if (key_length == 16) {
+        __m128i k = _mm_loadu_si128((const __m128i*)(key));
+        _mm_storeu_si128(ks +  0, k);
+        _mm_storeu_si128(ks +  1, k = keyExpansionStep<0x01>(k, k));
+        _mm_storeu_si128(ks +  2, k = keyExpansionStep<0x02>(k, k));
+        _mm_storeu_si128(ks +  3, k = keyExpansionStep<0x04>(k, k));
+        _mm_storeu_si128(ks +  4, k = keyExpansionStep<0x08>(k, k));
+        _mm_storeu_si128(ks +  5, k = keyExpansionStep<0x10>(k, k));
+        _mm_storeu_si128(ks +  6, k = keyExpansionStep<0x20>(k, k));
+        _mm_storeu_si128(ks +  7, k = keyExpansionStep<0x40>(k, k));
+        _mm_storeu_si128(ks +  8, k = keyExpansionStep<0x80>(k, k));
+        _mm_storeu_si128(ks +  9, k = keyExpansionStep<0x1b>(k, k));
+        _mm_storeu_si128(ks + 10, k = keyExpansionStep<0x36>(k, k));
+    } else if (key_length == 24) {
+        // 6-word steps straddle the 4-word round keys, 
+        // so join the halves together with 64-bit shuffles
+        __m128i temp1 = _mm_loadu_si128((const __m128i*)(key));
+        __m128i temp3 = _mm_loadl_epi64((const __m128i*)(key + 16));
+        __m128i prev;
+        _mm_storeu_si128(ks + 0, temp1);
+        prev = temp3;
+        keyExpansionStep192<0x01>(temp1, temp3);
+        _mm_storeu_si128(ks + 1, shuffleLowLow(prev, temp1));
+        _mm_storeu_si128(ks + 2, shuffleHighLow(temp1, temp3));
+        keyExpansionStep192<0x02>(temp1, temp3);
+        _mm_storeu_si128(ks + 3, temp1);
+        prev = temp3;
+        keyExpansionStep192<0x04>(temp1, temp3);
+        _mm_storeu_si128(ks + 4, shuffleLowLow(prev, temp1));
+        _mm_storeu_si128(ks + 5, shuffleHighLow(temp1, temp3));
+        keyExpansionStep192<0x08>(temp1, temp3);
+        _mm_storeu_si128(ks + 6, temp1);
+        prev = temp3;
+        keyExpansionStep192<0x10>(temp1, temp3);
+        _mm_storeu_si128(ks + 7, shuffleLowLow(prev, temp1));
+        _mm_storeu_si128(ks + 8, shuffleHighLow(temp1, temp3));
+        keyExpansionStep192<0x20>(temp1, temp3);
+        _mm_storeu_si128(ks + 9, temp1);
+        prev = temp3;
+        keyExpansionStep192<0x40>(temp1, temp3);
+        _mm_storeu_si128(ks + 10, shuffleLowLow(prev, temp1));
+        _mm_storeu_si128(ks + 11, shuffleHighLow(temp1, temp3));
+        keyExpansionStep192<0x80>(temp1, temp3);
+        _mm_storeu_si128(ks + 12, temp1);
+    } else {
+        __m128i k0 = _mm_loadu_si128((const __m128i*)(key));
+        __m128i k1 = _mm_loadu_si128((const __m128i*)(key + 16));
+        _mm_storeu_si128(ks +  0, k0);
+        _mm_storeu_si128(ks +  1, k1);
+        _mm_storeu_si128(ks +  2, k0 = keyExpansionStep<0x01>(k0, k1));
+        _mm_storeu_si128(ks +  3, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks +  4, k0 = keyExpansionStep<0x02>(k0, k1));
+        _mm_storeu_si128(ks +  5, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks +  6, k0 = keyExpansionStep<0x04>(k0, k1));
+        _mm_storeu_si128(ks +  7, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks +  8, k0 = keyExpansionStep<0x08>(k0, k1));
+        _mm_storeu_si128(ks +  9, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks + 10, k0 = keyExpansionStep<0x10>(k0, k1));
+        _mm_storeu_si128(ks + 11, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks + 12, k0 = keyExpansionStep<0x20>(k0, k1));
+        _mm_storeu_si128(ks + 13, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks + 14, k0 = keyExpansionStep<0x40>(k0, k1));
+    }
+}
+
+template <size_t total_round>
+AESNI_TARGET void aesIterationAESNI(const uint8_t in[], uint8_t out[], const uint8_t key[]) {
+    const __m128i* rk = (const __m128i*)(key);
+    __m128i state = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in)), _mm_loadu_si128(rk));
+
+#pragma GCC unroll 14
+    for (size_t round = 1; round < total_round; ++round)
+        state = _mm_aesenc_si128(state, _mm_loadu_si128(rk + round));
+    state = _mm_aesenclast_si128(state, _mm_loadu_si128(rk + total_round));
+
+    _mm_storeu_si128((__m128i*)(out), state);
+}
+
+// 8 independent blocks interleaved round by round, 
+// which keeps the pipelined AES unit busy instead of waiting on each aesenc
+// in: 16 * blocks bytes
+// out: 16 * blocks bytes, may be the same as in
+template <size_t total_round>
+AESNI_TARGET void aesEncryptBlocksAESNI(const uint8_t in[], uint8_t out[], size_t blocks, const uint8_t key[]) {
+    constexpr size_t ways = 8;
+    const __m128i* src = (const __m128i*)(in);
+    __m128i* dst = (__m128i*)(out);
+    size_t i = 0;
+
+    // round keys are loaded once and kept in registers across the whole buffer
+    __m128i k[total_round + 1];
+#pragma GCC unroll 15
+    for (size_t round = 0; round <= total_round; ++round)
+        k[round] = _mm_loadu_si128((const __m128i*)(key) + round);
+
+    for (; i + ways <= blocks; i += ways) {
+        __m128i state[ways];
+        for (size_t j = 0; j < ways; ++j)
+            state[j] = _mm_xor_si128(_mm_loadu_si128(src + i + j), k[0]);
+
+#pragma GCC unroll 14
+        for (size_t round = 1; round < total_round; ++round) {
+#pragma GCC unroll 8
+            for (size_t j = 0; j < ways; ++j)
+                state[j] = _mm_aesenc_si128(state[j], k[round]);
+        }
+
+        for (size_t j = 0; j < ways; ++j)
+            _mm_storeu_si128(dst + i + j, _mm_aesenclast_si128(state[j], k[total_round]));
+    }
+
+    for (; i < blocks; ++i)
+        aesIterationAESNI<total_round>(in + 16 * i, out + 16 * i, key);
+}
+#else
+const bool aesni_supported = false;
+#endif
+
+// key expansion used by the modes below,
+// AES-NI when the CPU has it, T-tables otherwise
+void keyExpansion(const uint8_t key[], uint8_t keys[], const size_t key_length) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (aesni_supported) return keyExpansionAESNI(key, keys, key_length);
+#endif
+    keyExpansionSoftware(key, keys, key_length);
+}
+
+// Reduction constants of Shoup's table GHASH.
+// Bits are in GCM order, bit 0 of a block being the most significant bit of byte 0,
+// so multiplying by x is a right shift, and the bit shifted out of bit 127 folds back in as
+// 0xe1 at the top byte. r4[b] (r8[b]) is what the 4 (8) bits b shifted out fold back in as, 
+// in the top 16 bits of the high half.
+struct GHashReduction {
+    uint64_t r4[16], r8[256];
+
+    constexpr GHashReduction(): r4(), r8() {
+        for (size_t b = 0; b < 16; ++b)
+            for (size_t j = 0; j < 4; ++j)
+                if (b >> j & 1) r4[b] ^= uint64_t(0xe1) << (5 + j) << 48;
+        for (size_t b = 0; b < 256; ++b)
+            for (size_t j = 0; j < 8; ++j)
+                if (b >> j & 1) r8[b] ^= uint64_t(0xe1) << (1 + j) << 48;
+    }
+};
+
+constexpr GHashReduction GR;
+
+// GHASH cores selectable at the entry points
+// Auto: carry-less multiply when the CPU has it, Table8 otherwise
+// Table4: Shoup's 4-bit tables, 256 bytes per key
+// Table8: Shoup's 8-bit tables, 4 KiB per key
+// CLMUL: PCLMULQDQ with H^1 .. H^8, falls back to Table8 on CPUs without it
+enum class GHashEngine { Auto, Table4, Table8, CLMUL };
+
+// "table4", "table8" or "clmul", anything else is Auto
+GHashEngine parseGHashEngine(const char* name) {
+    if (!strcmp(name, "table4")) return GHashEngine::Table4;
+    if (!strcmp(name, "table8")) return GHashEngine::Table8;
+    if (!strcmp(name, "clmul")) return GHashEngine::CLMUL;
+    return GHashEngine::Auto;
+}
+
+// expanded keys, the cores specialized for their key size, hash key and GHASH tables,
+// built once per key by aesInit and shared by every call
+struct alignas(64) AESContext {
+    uint8_t keys[60 * 4];
+    // one block
+    void (*encrypt)(const uint8_t in[], uint8_t out[], const uint8_t key[]);
+    // 16 * blocks bytes
+    void (*encrypt_blocks)(const uint8_t in[], uint8_t out[], size_t blocks, const uint8_t key[]);
+    // H = E(K, 0^128)
+    uint8_t hash_key[16];
+    // h4[i] = i H, h8[i] = i H, i being a 4-bit (8-bit) polynomial in GCM bit order,
+    // as high and low 64-bit halves
+    uint64_t h4[16][2];
+    uint64_t h8[256][2];
+    // H^1 .. H^8 byte-reversed, for the carry-less multiply core
+    uint8_t h_powers[8][16];
+    // Y = (Y ^ block) H for each block, 16 * blocks bytes
+    void (*ghash_blocks)(uint8_t Y[], const uint8_t in[], size_t blocks, const AESContext& context);
+    // CTR over 16 * blocks bytes from counter, and GHASH of the ciphertext into Y, in one pass
+    void (*gcm_encrypt)(const AESContext& context, uint8_t counter[], 
+                        const uint8_t in[], uint8_t out[], size_t blocks, uint8_t Y[]);
+    void (*gcm_decrypt)(const AESContext& context, uint8_t counter[], 
+                        const uint8_t in[], uint8_t out[], size_t blocks, uint8_t Y[]);
+};
+
+inline uint64_t getDoubleWord(const uint8_t p[]) {
+    return uint64_t(getWord(p)) << 32 | getWord(p + 4);
+}
+
+inline void putDoubleWord(uint8_t p[], const uint64_t x) {
+    putWord(p, x >> 32);
+    putWord(p + 4, x);
+}
+
+// table[i] = i H for the bits of i, the top bit of i being x^0
+// bits: 4 or 8, table: 2^bits entries
+void gHashTable(const uint8_t hash_key[], uint64_t table[][2], const size_t bits) {
+    const size_t top = 1 << (bits - 1);
+    uint64_t hi = getDoubleWord(hash_key), lo = getDoubleWord(hash_key + 8);
+
+    table[0][0] = table[0][1] = 0;
+    table[top][0] = hi, table[top][1] = lo;
+    // x^k H, one right shift each
+    for (size_t i = top >> 1; i > 0; i >>= 1) {
+        const uint64_t carry = lo & 1;
+        lo = hi << 63 | lo >> 1;
+        hi = hi >> 1 ^ (0xe100000000000000 & -carry);
+        table[i][0] = hi, table[i][1] = lo;
+    }
+    // the rest by linearity
+    for (size_t i = 2; i <= top; i <<= 1)
+        for (size_t j = 1; j < i; ++j)
+            table[i + j][0] = table[i][0] ^ table[j][0], table[i + j][1] = table[i][1] ^ table[j][1];
+}
+
+// Y = Y H, 4 bits at a time from the end of the block:
+// Z = Z x^4 + h4[nibble], the 4 bits shifted out reduced through r4
+inline void gMultiply4(uint8_t Y[], const AESContext& context) {
+    uint64_t hi = 0, lo = 0;
+    for (size_t i = 16; i-- > 0; ) {
+        for (size_t half = 0; half < 2; ++half) {
+            const size_t nibble = half? Y[i] >> 4: Y[i] & 0xf;
+            const size_t rem = lo & 0xf;
+            lo = hi << 60 | lo >> 4;
+            hi = hi >> 4 ^ GR.r4[rem];
+            hi ^= context.h4[nibble][0], lo ^= context.h4[nibble][1];
+        }
+    }
+    putDoubleWord(Y, hi);
+    putDoubleWord(Y + 8, lo);
+}
+
+// Y = Y H, a byte at a time: Z = Z x^8 + h8[byte]
+inline void gMultiply8(uint8_t Y[], const AESContext& context) {
+    uint64_t hi = 0, lo = 0;
+    for (size_t i = 16; i-- > 0; ) {
+        const size_t rem = lo & 0xff;
+        lo = hi << 56 | lo >> 8;
+        hi = hi >> 8 ^ GR.r8[rem];
+        hi ^= context.h8[Y[i]][0], lo ^= context.h8[Y[i]][1];
+    }
+    putDoubleWord(Y, hi);
+    putDoubleWord(Y + 8, lo);
+}
+
+template <void (*multiply)(uint8_t[], const AESContext&)>
+void gHashBlocks(uint8_t Y[], const uint8_t in[], size_t blocks, const AESContext& context) {
+    for (size_t i = 0; i < blocks; ++i) {
         for (size_t j = 0; j < 16; ++j)
-            tmp[j] = out[j] ^ in[i * 16 + j];
-        galois_multiply(tmp, hash_key, out);
+            Y[j] ^= in[16 * i + j];
+        multiply(Y, context);
     }
 }
 
-// plain: plain_len bytes
-// key: 16 bytes
-// IV: 12 bytes
-// add: add_len bytes
-// tag: 16 bytes
-void aes_gcm(const void* plain, const size_t plain_len, 
-            const void* key, const void* IV,
-            const void* add, const size_t add_len, 
-            void* cipher, void* tag) {
-    const uint8_t* plain_text = (const uint8_t*)(plain);
-    const uint8_t* key_ = (const uint8_t*)(key);
-    const uint8_t* IV_ = (const uint8_t*)(IV);
-    uint8_t* cipher_text = (uint8_t*)(cipher);
-    uint8_t* tag_ = (uint8_t*)(tag);
+#if defined(__x86_64__) || defined(__i386__)
+// carry-less multiply kernels, compiled for the pclmul target only and selected at runtime
+#define CLMUL_TARGET __attribute__((target("pclmul,ssse3,sse2")))
 
-    uint8_t keys[44 * 4];
-    keyExpansion((uint8_t*)(key), keys);
+inline bool cpuSupportsCLMUL() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+    return (ecx & bit_PCLMUL) && (ecx & bit_SSSE3);
+}
 
-    uint8_t counter[16] = { IV_[ 0], IV_[ 1], IV_[ 2], IV_[ 3],
-                            IV_[ 4], IV_[ 5], IV_[ 6], IV_[ 7],
-                            IV_[ 8], IV_[ 9], IV_[10], IV_[11],
-                                  0,       0,       0,       1 };
-    // counter mode AES
-    {
-        uint8_t CB[16];
-        uint8_t encrypt_CB[16];
-        // why initialize to 1?
-        uint32_t ctr = 1;
-        memcpy(CB, counter, 16);
-
-        for (size_t i = 0; i < plain_len / 16; ++i) {
-            ++ctr;
-            if (ctr == 0) ctr = 1;
-            CB[12] = ctr >> 24;
-            CB[13] = ctr >> 16;
-            CB[14] = ctr >>  8;
-            CB[15] = ctr;
-
-            aesIteration(CB, encrypt_CB, keys);
-
-            for (size_t j = 0; j < 16; ++j)
-                cipher_text[i * 16 + j] = encrypt_CB[j] ^ plain_text[i * 16 + j];
+const bool clmul_supported = cpuSupportsCLMUL();
+
+// blocks are byte-reversed on load, so that bit 0 of a block in GCM order is bit 127 of the register
+CLMUL_TARGET inline __m128i clmulByteSwap(const __m128i x) {
+    return _mm_shuffle_epi8(x, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+// lo, mid, hi ^= a b, unreduced, Karatsuba with 3 carry-less multiplies;
+// the middle term is folded in by clmulReduce, once for all the products summed
+CLMUL_TARGET inline void clmulAccumulate(const __m128i a, const __m128i b, __m128i& lo, __m128i& mid, __m128i& hi) {
+    lo = _mm_xor_si128(lo, _mm_clmulepi64_si128(a, b, 0x00));
+    hi = _mm_xor_si128(hi, _mm_clmulepi64_si128(a, b, 0x11));
+    mid = _mm_xor_si128(mid, _mm_clmulepi64_si128(_mm_xor_si128(a, _mm_shuffle_epi32(a, 0x4e)),
+                                                  _mm_xor_si128(b, _mm_shuffle_epi32(b, 0x4e)), 0x00));
+}
+
+// the 256-bit sum of products down to GF(2^128).
+// The operands are bit-reflected, so the product is shifted left by 1 first,
+// then reduced modulo x^128 + x^7 + x^2 + x + 1 with shifts by 31, 30, 25 and 1, 2, 7.
+CLMUL_TARGET inline __m128i clmulReduce(__m128i lo, __m128i mid, __m128i hi) {
+    mid = _mm_xor_si128(mid, _mm_xor_si128(lo, hi));
+    lo = _mm_xor_si128(lo, _mm_slli_si128(mid, 8));
+    hi = _mm_xor_si128(hi, _mm_srli_si128(mid, 8));
+
+    __m128i t7 = _mm_srli_epi32(lo, 31), t8 = _mm_srli_epi32(hi, 31);
+    lo = _mm_slli_epi32(lo, 1), hi = _mm_slli_epi32(hi, 1);
+    const __m128i t9 = _mm_srli_si128(t7, 12);
+    t8 = _mm_slli_si128(t8, 4), t7 = _mm_slli_si128(t7, 4);
+    lo = _mm_or_si128(lo, t7);
+    hi = _mm_or_si128(_mm_or_si128(hi, t8), t9);
+
+    t7 = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)), _mm_slli_epi32(lo, 25));
+    t8 = _mm_srli_si128(t7, 4);
+    lo = _mm_xor_si128(lo, _mm_slli_si128(t7, 12));
+    const __m128i t2 = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_srli_epi32(lo, 2)),
+                                     _mm_xor_si128(_mm_srli_epi32(lo, 7), t8));
+    return _mm_xor_si128(hi, _mm_xor_si128(lo, t2));
+}
+
+// h_powers[i] = H^(i + 1), byte-reversed
+CLMUL_TARGET void gHashPowersCLMUL(const uint8_t hash_key[], uint8_t h_powers[][16]) {
+    const __m128i h = clmulByteSwap(_mm_loadu_si128((const __m128i*)(hash_key)));
+    __m128i p = h;
+    _mm_storeu_si128((__m128i*)(h_powers[0]), p);
+    for (size_t i = 1; i < 8; ++i) {
+        __m128i lo = _mm_setzero_si128(), mid = lo, hi = lo;
+        clmulAccumulate(p, h, lo, mid, hi);
+        p = clmulReduce(lo, mid, hi);
+        _mm_storeu_si128((__m128i*)(h_powers[i]), p);
+    }
+}
+
+// Y = (Y ^ block) H for each block, with aggregated reduction: 
+// ways blocks are multiplied by H^ways .. H^1 and summed before a single reduction,
+// Y_(i + ways) = (Y_i ^ X_1) H^ways ^ X_2 H^(ways - 1) ^ .. ^ X_ways H
+template <size_t ways>
+CLMUL_TARGET inline __m128i clmulFold(__m128i y, const __m128i x[], const __m128i h[]) {
+    __m128i lo = _mm_setzero_si128(), mid = lo, hi = lo;
+    clmulAccumulate(_mm_xor_si128(x[0], y), h[ways - 1], lo, mid, hi);
+    for (size_t j = 1; j < ways; ++j)
+        clmulAccumulate(x[j], h[ways - 1 - j], lo, mid, hi);
+    return clmulReduce(lo, mid, hi);
+}
+
+// 8 blocks per reduction, then 4, then 1
+CLMUL_TARGET void gHashBlocksCLMUL(uint8_t Y[], const uint8_t in[], size_t blocks, const AESContext& context) {
+    __m128i h[8], x[8];
+    for (size_t j = 0; j < 8; ++j)
+        h[j] = _mm_loadu_si128((const __m128i*)(context.h_powers[j]));
+
+    const __m128i* src = (const __m128i*)(in);
+    __m128i y = clmulByteSwap(_mm_loadu_si128((const __m128i*)(Y)));
+    size_t i = 0;
+
+    for (; i + 8 <= blocks; i += 8) {
+        for (size_t j = 0; j < 8; ++j)
+            x[j] = clmulByteSwap(_mm_loadu_si128(src + i + j));
+        y = clmulFold<8>(y, x, h);
+    }
+
+    for (; i + 4 <= blocks; i += 4) {
+        for (size_t j = 0; j < 4; ++j)
+            x[j] = clmulByteSwap(_mm_loadu_si128(src + i + j));
+        y = clmulFold<4>(y, x, h);
+    }
+
+    for (; i < blocks; ++i) {
+        x[0] = clmulByteSwap(_mm_loadu_si128(src + i));
+        y = clmulFold<1>(y, x, h);
+    }
+
+    _mm_storeu_si128((__m128i*)(Y), clmulByteSwap(y));
+}
+#else
+const bool clmul_supported = false;
+#endif
+
+// adds 1 to the last 32 bits of the counter block, modulo 2^32 (inc32 of SP 800-38D)
+inline void incrementCounter32(uint8_t counter[]) {
+    putWord(counter + 12, getWord(counter + 12) + 1);
+}
+
+inline void xorBlock(uint8_t out[], const uint8_t a[], const uint8_t b[]) {
+    uint64_t x[2], y[2];
+    memcpy(x, a, 16);
+    memcpy(y, b, 16);
+    x[0] ^= y[0], x[1] ^= y[1];
+    memcpy(out, x, 16);
+}
+
+// counter mode alone, 32 counter blocks encrypted at a time
+// counter: 16 bytes, advanced past the blocks
+// in: 16 * blocks bytes
+// out: 16 * blocks bytes, may be the same as in
+void gcmCTR(const AESContext& context, uint8_t counter[], 
+            const uint8_t in[], uint8_t out[], size_t blocks) {
+    constexpr size_t batch = 32;
+    uint8_t CB[16 * batch];
+
+    for (size_t i = 0; i < blocks; i += batch) {
+        const size_t n = std::min(batch, blocks - i);
+
+        for (size_t b = 0; b < n; ++b) {
+            memcpy(CB + 16 * b, counter, 16);
+            incrementCounter32(counter);
         }
+        context.encrypt_blocks(CB, CB, n, context.keys);
+
+        for (size_t b = 0; b < n; ++b)
+            xorBlock(out + 16 * (i + b), in + 16 * (i + b), CB + 16 * b);
     }
+}
+
+// CTR and GHASH stitched over chunks small enough to stay in L1:
+// each chunk of ciphertext is hashed right after it is produced (or right before it is decrypted),
+// instead of a second pass over the whole message
+// counter: 16 bytes, advanced past the blocks
+// in: 16 * blocks bytes
+// out: 16 * blocks bytes, may be the same as in
+template <bool decrypt>
+void gcmCryptChunked(const AESContext& context, uint8_t counter[], 
+                     const uint8_t in[], uint8_t out[], size_t blocks, uint8_t Y[]) {
+    constexpr size_t chunk = 32;
+
+    for (size_t i = 0; i < blocks; i += chunk) {
+        const size_t n = std::min(chunk, blocks - i);
+
+        if (decrypt) context.ghash_blocks(Y, in + 16 * i, n, context);
+        gcmCTR(context, counter, in + 16 * i, out + 16 * i, n);
+        if (!decrypt) context.ghash_blocks(Y, out + 16 * i, n, context);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define GCM_TARGET __attribute__((target("aes,pclmul,ssse3,sse2")))
+
+// 8 blocks of CTR, with the 8 ciphertext blocks x folded into y between the rounds
+// ctr: counter block byte-reversed, advanced by 8
+// k: round keys
+// h: H^1 .. H^8 byte-reversed
+template <size_t total_round>
+GCM_TARGET inline void gcmStepAESNI(__m128i& ctr, const __m128i k[], const __m128i h[], __m128i& y, 
+                                    const __m128i* src, __m128i* dst, const __m128i x[], const bool hash) {
+    constexpr size_t ways = 8;
+    const __m128i one = _mm_set_epi32(0, 0, 0, 1);
+    __m128i state[ways];
+#pragma GCC unroll 8
+    for (size_t j = 0; j < ways; ++j) {
+        state[j] = _mm_xor_si128(clmulByteSwap(ctr), k[0]);
+        ctr = _mm_add_epi32(ctr, one);
+    }
+
+    __m128i lo = _mm_setzero_si128(), mid = lo, hi = lo;
+#pragma GCC unroll 14
+    for (size_t round = 1; round < total_round; ++round) {
+#pragma GCC unroll 8
+        for (size_t j = 0; j < ways; ++j)
+            state[j] = _mm_aesenc_si128(state[j], k[round]);
+        // at least 9 middle rounds, one multiply in each of the first 8
+        if (hash && round <= ways)
+            clmulAccumulate(round == 1? _mm_xor_si128(x[0], y): x[round - 1], h[ways - round], lo, mid, hi);
+    }
+    if (hash) y = clmulReduce(lo, mid, hi);
+
+#pragma GCC unroll 8
+    for (size_t j = 0; j < ways; ++j)
+        _mm_storeu_si128(dst + j, _mm_xor_si128(_mm_aesenclast_si128(state[j], k[total_round]), 
+                                                _mm_loadu_si128(src + j)));
+}
+
+// One pass of AES-NI CTR and carry-less multiply GHASH, 8 blocks at a time.
+// The multiplies of 8 ciphertext blocks are issued between the rounds of 8 counter blocks, 
+// so the AES and PCLMULQDQ units work in parallel.
+// Encryption hashes the previous 8 blocks of its own output while producing the next 8;
+// decryption hashes the 8 blocks of input it is decrypting.
+// counter: 16 bytes, advanced past the blocks
+// in: 16 * blocks bytes
+// out: 16 * blocks bytes, may be the same as in
+template <size_t total_round, bool decrypt>
+GCM_TARGET void gcmCryptAESNI(const AESContext& context, uint8_t counter[], 
+                              const uint8_t in[], uint8_t out[], size_t blocks, uint8_t Y[]) {
+    constexpr size_t ways = 8;
+    const __m128i* src = (const __m128i*)(in);
+    __m128i* dst = (__m128i*)(out);
+
+    __m128i k[total_round + 1], h[ways];
+#pragma GCC unroll 15
+    for (size_t round = 0; round <= total_round; ++round)
+        k[round] = _mm_loadu_si128((const __m128i*)(context.keys) + round);
+    for (size_t j = 0; j < ways; ++j)
+        h[j] = _mm_loadu_si128((const __m128i*)(context.h_powers[j]));
 
-    uint8_t* add_cipher = new uint8_t[add_len + plain_len + 16];
-    memcpy(add_cipher, add, add_len);
-    memcpy(add_cipher + add_len, cipher_text, plain_len);
-    uint64_t len_in_bit = add_len * 8;
-    add_cipher[add_len + plain_len + 0] = len_in_bit >> 56;
-    add_cipher[add_len + plain_len + 1] = len_in_bit >> 48;
-    add_cipher[add_len + plain_len + 2] = len_in_bit >> 40;
-    add_cipher[add_len + plain_len + 3] = len_in_bit >> 32;
-    add_cipher[add_len + plain_len + 4] = len_in_bit >> 24;
-    add_cipher[add_len + plain_len + 5] = len_in_bit >> 16;
-    add_cipher[add_len + plain_len + 6] = len_in_bit >>  8;
-    add_cipher[add_len + plain_len + 7] = len_in_bit >>  0;
-    len_in_bit = plain_len * 8;
-    add_cipher[add_len + plain_len +  8] = len_in_bit >> 56;
-    add_cipher[add_len + plain_len +  9] = len_in_bit >> 48;
-    add_cipher[add_len + plain_len + 10] = len_in_bit >> 40;
-    add_cipher[add_len + plain_len + 11] = len_in_bit >> 32;
-    add_cipher[add_len + plain_len + 12] = len_in_bit >> 24;
-    add_cipher[add_len + plain_len + 13] = len_in_bit >> 16;
-    add_cipher[add_len + plain_len + 14] = len_in_bit >>  8;
-    add_cipher[add_len + plain_len + 15] = len_in_bit >>  0;
-
- 
+    // the counter block byte-reversed, so inc32 is an add to the lowest 32-bit lane
+    const __m128i one = _mm_set_epi32(0, 0, 0, 1);
+    __m128i ctr = clmulByteSwap(_mm_loadu_si128((const __m128i*)(counter)));
+    __m128i y = clmulByteSwap(_mm_loadu_si128((const __m128i*)(Y)));
+
+    __m128i x[ways];
+    size_t i = 0;
+    if (decrypt) {
+        for (; i + ways <= blocks; i += ways) {
+            for (size_t j = 0; j < ways; ++j)
+                x[j] = clmulByteSwap(_mm_loadu_si128(src + i + j));
+            gcmStepAESNI<total_round>(ctr, k, h, y, src + i, dst + i, x, true);
+        }
+    } else if (blocks >= ways) {
+        // the hash lags one step behind, the first step has nothing to hash yet
+        gcmStepAESNI<total_round>(ctr, k, h, y, src, dst, nullptr, false);
+        for (i = ways; i + ways <= blocks; i += ways) {
+            for (size_t j = 0; j < ways; ++j)
+                x[j] = clmulByteSwap(_mm_loadu_si128(dst + i - ways + j));
+            gcmStepAESNI<total_round>(ctr, k, h, y, src + i, dst + i, x, true);
+        }
+        for (size_t j = 0; j < ways; ++j)
+            x[j] = clmulByteSwap(_mm_loadu_si128(dst + i - ways + j));
+        y = clmulFold<ways>(y, x, h);
+    }
+
+    // fewer than 8 blocks left
+    for (; i < blocks; ++i) {
+        __m128i state = _mm_xor_si128(clmulByteSwap(ctr), k[0]);
+        ctr = _mm_add_epi32(ctr, one);
+#pragma GCC unroll 14
+        for (size_t round = 1; round < total_round; ++round)
+            state = _mm_aesenc_si128(state, k[round]);
+
+        const __m128i block = _mm_loadu_si128(src + i);
+        const __m128i result = _mm_xor_si128(_mm_aesenclast_si128(state, k[total_round]), block);
+        _mm_storeu_si128(dst + i, result);
+        x[0] = clmulByteSwap(decrypt? block: result);
+        y = clmulFold<1>(y, x, h);
+    }
+
+    _mm_storeu_si128((__m128i*)(counter), clmulByteSwap(ctr));
+    _mm_storeu_si128((__m128i*)(Y), clmulByteSwap(y));
+}
+#endif
+
+// H = E(K, 0^128) and the GHASH core with its tables, after the block cipher is selected
+void gHashInit(AESContext& context, const GHashEngine engine) {
     uint8_t zero_data[16] = { 0 };
-    uint8_t zero_data_cipher[16];
-    aesIteration(zero_data, zero_data_cipher, keys);
+    context.encrypt(zero_data, context.hash_key, context.keys);
+
+    // only the tables of the selected core are built
+#if defined(__x86_64__) || defined(__i386__)
+    if (clmul_supported && (engine == GHashEngine::Auto || engine == GHashEngine::CLMUL)) {
+        gHashPowersCLMUL(context.hash_key, context.h_powers);
+        context.ghash_blocks = gHashBlocksCLMUL;
+        return;
+    }
+#endif
 
+    if (engine == GHashEngine::Table4) {
+        gHashTable(context.hash_key, context.h4, 4);
+        context.ghash_blocks = gHashBlocks<gMultiply4>;
+    } else {
+        gHashTable(context.hash_key, context.h8, 8);
+        context.ghash_blocks = gHashBlocks<gMultiply8>;
+    }
+}
+
+// AES-NI when the CPU has it, T-tables otherwise;
+// CTR and GHASH stitched in registers when both AES-NI and the carry-less multiply core are used
+template <size_t total_round>
+void aesSelectCores(AESContext& context, const GHashEngine engine) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (aesni_supported) {
+        context.encrypt = aesIterationAESNI<total_round>;
+        context.encrypt_blocks = aesEncryptBlocksAESNI<total_round>;
+        gHashInit(context, engine);
+
+        if (context.ghash_blocks == gHashBlocksCLMUL) {
+            context.gcm_encrypt = gcmCryptAESNI<total_round, false>;
+            context.gcm_decrypt = gcmCryptAESNI<total_round, true>;
+        } else {
+            context.gcm_encrypt = gcmCryptChunked<false>;
+            context.gcm_decrypt = gcmCryptChunked<true>;
+        }
+        return;
+    }
+#endif
+    context.encrypt = aesIterationTable<total_round>;
+    context.encrypt_blocks = aesEncryptBlocksTable<total_round>;
+    gHashInit(context, engine);
+    context.gcm_encrypt = gcmCryptChunked<false>;
+    context.gcm_decrypt = gcmCryptChunked<true>;
+}
+
+// key_length: 16, 24 or 32 bytes
+// the only dispatch on key size, the modes call the specialized cores directly
+void aesInit(AESContext& context, const void* key, const size_t key_length, 
+             const GHashEngine engine = GHashEngine::Auto) {
+    keyExpansion((const uint8_t*)(key), context.keys, key_length);
+    if (key_length == 16) aesSelectCores<10>(context, engine);
+    else if (key_length == 24) aesSelectCores<12>(context, engine);
+    else aesSelectCores<14>(context, engine);
+}
+
+// state of one message sealed a piece at a time:
+// aes_gcm_init, any number of aes_gcm_update_aad, any number of aes_gcm_update, then aes_gcm_final
+struct GCMStream {
+    const AESContext* context;
+    // J0 = IV || 1, encrypted into the tag
+    uint8_t J0[16];
+    // next counter block
+    uint8_t counter[16];
+    // GHASH so far
     uint8_t Y[16];
-    gHash(add_cipher, add_len + plain_len + 16, zero_data_cipher, Y);
+    // bytes of the current block not hashed yet, fill bytes of it,
+    // and in the text phase the keystream of that block
+    uint8_t partial[16];
+    uint8_t keystream[16];
+    size_t fill;
+    // set by the first aes_gcm_update, aes_gcm_update_aad refuses additional data after it
+    bool text;
+    uint64_t add_len;
+    uint64_t text_len;
+};
+
+// IV: IV_length bytes, at least 1.
+// A 12-byte IV is used as is, J0 = IV || 1; 
+// any other length is hashed, J0 = GHASH(IV || 0-padding || 0^64 || [len(IV) in bits]64)
+void aes_gcm_init(GCMStream& stream, const AESContext& context, const void* IV, const size_t IV_length) {
+    stream.context = &context;
+    if (IV_length == 12) {
+        memcpy(stream.J0, IV, 12);
+        putWord(stream.J0 + 12, 1);
+    } else {
+        const uint8_t* IV_ = (const uint8_t*)(IV);
+        memset(stream.J0, 0x00, 16);
+        context.ghash_blocks(stream.J0, IV_, IV_length / 16, context);
+
+        uint8_t last[16] = { 0 };
+        if (IV_length % 16) {
+            memcpy(last, IV_ + IV_length / 16 * 16, IV_length % 16);
+            context.ghash_blocks(stream.J0, last, 1, context);
+        }
+
+        memset(last, 0x00, 16);
+        putWord(last +  8, uint64_t(IV_length) * 8 >> 32);
+        putWord(last + 12, uint64_t(IV_length) * 8);
+        context.ghash_blocks(stream.J0, last, 1, context);
+    }
+    memcpy(stream.counter, stream.J0, 16);
+    incrementCounter32(stream.counter);
+
+    memset(stream.Y, 0x00, 16);
+    stream.fill = 0;
+    stream.text = false;
+    stream.add_len = stream.text_len = 0;
+}
+
+// add: add_len bytes, hashed straight from the caller's buffer except for partial blocks
+// returns false, leaving the stream untouched, once text has been passed to the stream:
+// the partial block then holds ciphertext, and the tag would silently come out wrong
+bool aes_gcm_update_aad(GCMStream& stream, const void* add, size_t add_len) {
+    if (stream.text) return false;
+
+    const AESContext& context = *stream.context;
+    const uint8_t* add_ = (const uint8_t*)(add);
+    stream.add_len += add_len;
+
+    if (stream.fill) {
+        const size_t n = std::min(add_len, 16 - stream.fill);
+        memcpy(stream.partial + stream.fill, add_, n);
+        stream.fill += n, add_ += n, add_len -= n;
+        if (stream.fill < 16) return true;
+        context.ghash_blocks(stream.Y, stream.partial, 1, context);
+        stream.fill = 0;
+    }
+
+    context.ghash_blocks(stream.Y, add_, add_len / 16, context);
+    add_ += add_len / 16 * 16;
+
+    stream.fill = add_len % 16;
+    memcpy(stream.partial, add_, stream.fill);
+    return true;
+}
+
+// the additional data ends at the first text, zero-padded to a block
+inline void gcmCloseAAD(GCMStream& stream) {
+    if (stream.text) return;
+    stream.text = true;
+
+    if (stream.fill) {
+        memset(stream.partial + stream.fill, 0x00, 16 - stream.fill);
+        stream.context->ghash_blocks(stream.Y, stream.partial, 1, *stream.context);
+        stream.fill = 0;
+    }
+}
+
+// Any chunk size: a partial block is carried to the next call with its keystream,
+// whole blocks go through the stitched CTR + GHASH core in place
+// in: len bytes
+// out: len bytes, may be the same as in
+template <bool decrypt>
+void gcmStreamCrypt(GCMStream& stream, const uint8_t in[], uint8_t out[], size_t len) {
+    const AESContext& context = *stream.context;
+    gcmCloseAAD(stream);
+    stream.text_len += len;
+
+    if (stream.fill) {
+        const size_t n = std::min(len, 16 - stream.fill);
+        for (size_t i = 0; i < n; ++i) {
+            const uint8_t c = decrypt? in[i]: in[i] ^ stream.keystream[stream.fill + i];
+            out[i] = in[i] ^ stream.keystream[stream.fill + i];
+            stream.partial[stream.fill + i] = c;
+        }
+        stream.fill += n, in += n, out += n, len -= n;
+        if (stream.fill < 16) return;
+        context.ghash_blocks(stream.Y, stream.partial, 1, context);
+        stream.fill = 0;
+    }
+
+    const size_t blocks = len / 16;
+    (decrypt? context.gcm_decrypt: context.gcm_encrypt)(context, stream.counter, in, out, blocks, stream.Y);
+    in += 16 * blocks, out += 16 * blocks;
+
+    stream.fill = len % 16;
+    if (stream.fill) {
+        context.encrypt(stream.counter, stream.keystream, context.keys);
+        incrementCounter32(stream.counter);
+        for (size_t i = 0; i < stream.fill; ++i) {
+            const uint8_t c = decrypt? in[i]: in[i] ^ stream.keystream[i];
+            out[i] = in[i] ^ stream.keystream[i];
+            stream.partial[i] = c;
+        }
+    }
+}
+
+// plain: len bytes
+// cipher: len bytes, may be the same as plain
+void aes_gcm_update(GCMStream& stream, const void* plain, const size_t len, void* cipher) {
+    gcmStreamCrypt<false>(stream, (const uint8_t*)(plain), (uint8_t*)(cipher), len);
+}
+
+// tag: 16 bytes
+void aes_gcm_final(GCMStream& stream, void* tag) {
+    const AESContext& context = *stream.context;
+    gcmCloseAAD(stream);
+
+    if (stream.fill) {
+        memset(stream.partial + stream.fill, 0x00, 16 - stream.fill);
+        context.ghash_blocks(stream.Y, stream.partial, 1, context);
+        stream.fill = 0;
+    }
+
+    // len(A) || len(C) in bits
+    uint8_t lengths[16];
+    putWord(lengths +  0, stream.add_len * 8 >> 32);
+    putWord(lengths +  4, stream.add_len * 8);
+    putWord(lengths +  8, stream.text_len * 8 >> 32);
+    putWord(lengths + 12, stream.text_len * 8);
+    context.ghash_blocks(stream.Y, lengths, 1, context);
 
     uint8_t en_counter[16];
-    aesIteration(counter, en_counter, keys);
+    context.encrypt(stream.J0, en_counter, context.keys);
 
+    uint8_t* tag_ = (uint8_t*)(tag);
     for (size_t i = 0; i < 16; ++i)
-        tag_[i] = en_counter[i] ^ Y[i];
+        tag_[i] = en_counter[i] ^ stream.Y[i];
+}
+
+// plain: plain_len bytes
+// IV: IV_length bytes, 12 recommended
+// add: add_len bytes
+// cipher: plain_len bytes
+// tag: 16 bytes
+void aes_gcm(const void* plain, const size_t plain_len, 
+            const AESContext& context, const void* IV, const size_t IV_length, 
+            const void* add, const size_t add_len, 
+            void* cipher, void* tag) {
+    GCMStream stream;
+    aes_gcm_init(stream, context, IV, IV_length);
+    aes_gcm_update_aad(stream, add, add_len);
+    aes_gcm_update(stream, plain, plain_len, cipher);
+    aes_gcm_final(stream, tag);
 }
             
 
+// cipher: len bytes
+// plain: len bytes, may be the same as cipher
+// the plaintext is released as it is decrypted, check aes_gcm_final_verify before trusting it
+void aes_gcm_update_decrypt(GCMStream& stream, const void* cipher, const size_t len, void* plain) {
+    gcmStreamCrypt<true>(stream, (const uint8_t*)(cipher), (uint8_t*)(plain), len);
+}
+
+// returns whether tag (16 bytes) is authentic, 
+// the comparison takes the same time wherever the tags differ
+bool aes_gcm_final_verify(GCMStream& stream, const void* tag) {
+    uint8_t expected[16];
+    aes_gcm_final(stream, expected);
+
+    uint8_t diff = 0;
+    for (size_t i = 0; i < 16; ++i)
+        diff |= expected[i] ^ ((const uint8_t*)(tag))[i];
+    return diff == 0;
+}
+
+// cipher: len bytes, hashed without being decrypted
+void gcmStreamHash(GCMStream& stream, const uint8_t cipher[], size_t len) {
+    const AESContext& context = *stream.context;
+    gcmCloseAAD(stream);
+    stream.text_len += len;
+
+    if (stream.fill) {
+        const size_t n = std::min(len, 16 - stream.fill);
+        memcpy(stream.partial + stream.fill, cipher, n);
+        stream.fill += n, cipher += n, len -= n;
+        if (stream.fill < 16) return;
+        context.ghash_blocks(stream.Y, stream.partial, 1, context);
+        stream.fill = 0;
+    }
+
+    context.ghash_blocks(stream.Y, cipher, len / 16, context);
+    cipher += len / 16 * 16;
+
+    stream.fill = len % 16;
+    memcpy(stream.partial, cipher, stream.fill);
+}
+
+// cipher: cipher_len bytes
+// IV: IV_length bytes
+// add: add_len bytes
+// tag: 16 bytes
+// plain: cipher_len bytes, may be the same as cipher
+// returns whether the tag is authentic.
+// By default the ciphertext is decrypted and hashed in one pass, at the speed of aes_gcm,
+// and plain is zeroed if the tag does not match.
+// With verify_first, the ciphertext is hashed and the tag checked before anything is decrypted,
+// so plain is never written unless the tag matches; this costs a second pass over the data.
+bool aes_gcm_open(const void* cipher, const size_t cipher_len, 
+                  const AESContext& context, const void* IV, const size_t IV_length, 
+                  const void* add, const size_t add_len, 
+                  const void* tag, void* plain, const bool verify_first = false) {
+    const uint8_t* cipher_text = (const uint8_t*)(cipher);
+    uint8_t* plain_text = (uint8_t*)(plain);
+
+    GCMStream stream;
+    aes_gcm_init(stream, context, IV, IV_length);
+    aes_gcm_update_aad(stream, add, add_len);
+
+    if (!verify_first) {
+        aes_gcm_update_decrypt(stream, cipher, cipher_len, plain);
+        if (aes_gcm_final_verify(stream, tag)) return true;
+        memset(plain, 0, cipher_len);
+        return false;
+    }
+
+    uint8_t counter[16];
+    memcpy(counter, stream.counter, 16);
+    gcmStreamHash(stream, cipher_text, cipher_len);
+    if (!aes_gcm_final_verify(stream, tag)) return false;
+
+    const size_t blocks = cipher_len / 16;
+    gcmCTR(context, counter, cipher_text, plain_text, blocks);
+    if (cipher_len % 16) {
+        uint8_t keystream[16];
+        context.encrypt(counter, keystream, context.keys);
+        for (size_t i = blocks * 16; i < cipher_len; ++i)
+            plain_text[i] = cipher_text[i] ^ keystream[i - blocks * 16];
+    }
+    return true;
+}
+
+// LRU cache of key contexts, for many short messages under a small set of keys.
+// A hit is a hash lookup and a splice to the front of the recency list; 
+// a miss expands the key and rebuilds H and the GHASH tables in a free or the least recently used slot.
+// Key IDs are the caller's, an ID whose key changes must be dropped with gcmCacheErase first.
+struct GCMContextCache {
+    // contexts points into storage, a copy would point into the original's buffer
+    GCMContextCache() = default;
+    GCMContextCache(const GCMContextCache&) = delete;
+    GCMContextCache& operator=(const GCMContextCache&) = delete;
+
+    // contexts, aligned by hand since new does not honour alignas(64) before C++17
+    std::vector<uint8_t> storage;
+    AESContext* contexts = nullptr;
+    // key IDs, most recently used first
+    std::list<uint64_t> recency;
+    // key ID to its slot in contexts and its node in recency
+    std::unordered_map<uint64_t, std::pair<size_t, std::list<uint64_t>::iterator>> slots;
+    std::vector<size_t> free_slots;
+};
+
+// capacity: number of contexts kept
+// returns false, leaving the cache unusable, when capacity is 0
+bool gcmCacheInit(GCMContextCache& cache, const size_t capacity) {
+    if (capacity == 0) return false;
+
+    cache.storage.assign(capacity * sizeof(AESContext) + alignof(AESContext), 0);
+    cache.contexts = (AESContext*)((uintptr_t(cache.storage.data()) + alignof(AESContext) - 1) & 
+                                   ~uintptr_t(alignof(AESContext) - 1));
+    cache.recency.clear();
+    cache.slots.clear();
+    cache.slots.reserve(capacity);
+    cache.free_slots.resize(capacity);
+    for (size_t i = 0; i < capacity; ++i)
+        cache.free_slots[i] = capacity - 1 - i;
+    return true;
+}
+
+// key: key_length bytes, only read on a miss
+// returns the context of key_id, valid until it is evicted or erased
+const AESContext& gcmCacheGet(GCMContextCache& cache, const uint64_t key_id, 
+                              const void* key, const size_t key_length, 
+                              const GHashEngine engine = GHashEngine::Auto) {
+    auto found = cache.slots.find(key_id);
+    if (found != cache.slots.end()) {
+        cache.recency.splice(cache.recency.begin(), cache.recency, found->second.second);
+        return cache.contexts[found->second.first];
+    }
+
+    // a cache that gcmCacheInit accepted always has a free or a used slot
+    assert(!cache.free_slots.empty() || !cache.recency.empty());
+
+    size_t slot;
+    if (!cache.free_slots.empty()) {
+        slot = cache.free_slots.back();
+        cache.free_slots.pop_back();
+        cache.recency.push_front(key_id);
+    } else {
+        // the least recently used node is reused for the new ID
+        auto victim = cache.slots.find(cache.recency.back());
+        slot = victim->second.first;
+        cache.slots.erase(victim);
+        cache.recency.splice(cache.recency.begin(), cache.recency, std::prev(cache.recency.end()));
+        cache.recency.front() = key_id;
+    }
+
+    aesInit(cache.contexts[slot], key, key_length, engine);
+    cache.slots.emplace(key_id, std::make_pair(slot, cache.recency.begin()));
+    return cache.contexts[slot];
+}
+
+// drops the context of key_id, if cached
+void gcmCacheErase(GCMContextCache& cache, const uint64_t key_id) {
+    auto found = cache.slots.find(key_id);
+    if (found == cache.slots.end()) return;
+
+    memset(&cache.contexts[found->second.first], 0, sizeof(AESContext));
+    cache.free_slots.push_back(found->second.first);
+    cache.recency.erase(found->second.second);
+    cache.slots.erase(found);
+}
+
 int main(int argc, char** argv) {
     {
         /*
@@ -324,7 +1231,9 @@ int main(int argc, char** argv) {
         unsigned char ciphertext[4096];
         unsigned char tag[4096];
 
-        aes_gcm(plaintext, 48, key, IV, add_data, 48, ciphertext, tag);
+        AESContext context;
+        aesInit(context, key, 16);
+        aes_gcm(plaintext, 48, context, IV, 12, add_data, 48, ciphertext, tag);
 
         for (size_t i = 0; i < 16; ++i) printf("%02x ", tag[i]); printf("\n");
 				 
@@ -334,59 +1243,129 @@ int main(int argc, char** argv) {
     }
     if (argc == 1) return 0;
 
-    std::ifstream fin(argv[1]);
+    std::ifstream fin;
 
-    fin.seekg(0, std::ios::end);
-    std::string buffer;
-    size_t len = fin.tellg();
-    fin.seekg(0, std::ios::beg);
+    // 128 bit or 192 bit or 256 bit key size
+    unsigned char key[32] = { 0 };
+    size_t key_length = 0;
 
-    uint8_t pad = 0;
-    if (len % 16) {
-        pad = 16 - len % 16;
-        len = len / 16 * 16 + 16;
+    if (argc >= 3) {
+        fin.open(argv[2]);
+        fin.seekg(0, std::ios::beg);
+        char buffer[3] = { 0 };
+        for (size_t i = 0; i < 32; ++i) {
+            if (!fin.read(buffer, 2)) break;
+            key[i] = std::stoi(buffer, 0, 16);
+            ++key_length;
+        }
+        fin.close();
     }
 
-    buffer.reserve(len);
+    if (key_length != 16 && key_length != 24 && key_length != 32) {
+        printf("Length of key should be 16 or 24 or 32 bytes. \n");
+        return 0;
+    }
+    
+    unsigned char tag[16];
 
-    buffer.assign((std::istreambuf_iterator<char>(fin)),
-                   std::istreambuf_iterator<char>());
-    // PKCS7 padding
-    for (size_t i = 0; i < pad; ++i)
-        buffer += pad;
+    // optional arguments: "decrypt", the input is then ciphertext || tag,
+    // "verify" to decrypt only after the tag checks out, 
+    // "iv=N" for an all-zero IV of N bytes, 12 by default, 
+    // "records=N" to seal every N bytes as a message of its own, the record number in the last bytes of IV, 
+    // and a GHASH engine name
+    GHashEngine engine = GHashEngine::Auto;
+    bool decrypt = false;
+    bool verify_first = false;
+    size_t IV_length = 12;
+    size_t record = 0;
+    for (int i = 3; i < argc; ++i) {
+        if (!strcmp(argv[i], "decrypt")) decrypt = true;
+        else if (!strcmp(argv[i], "verify")) decrypt = verify_first = true;
+        else if (!strncmp(argv[i], "iv=", 3)) IV_length = std::atoi(argv[i] + 3);
+        else if (!strncmp(argv[i], "records=", 8)) record = std::atoi(argv[i] + 8);
+        else engine = parseGHashEngine(argv[i]);
+    }
 
-    assert(buffer.length() == len);
+    if (IV_length == 0) {
+        printf("IV should be at least 1 byte. \n");
+        return 0;
+    }
+    std::vector<unsigned char> IV(IV_length, 0);
 
-    fin.close();
+    AESContext context;
+    aesInit(context, key, key_length, engine);
 
-    // 128 bit key size
-    unsigned char key[16] = { 0 };
+    if (decrypt) {
+        fin.open(argv[1], std::ios::binary);
+        std::string buffer((std::istreambuf_iterator<char>(fin)), std::istreambuf_iterator<char>());
+        fin.close();
 
-    if (argc == 3) {
-        fin.open(argv[2]);
-        fin.seekg(0, std::ios::beg);
-        char buffer[3] = { 0 };
-        for (size_t i = 0; i < 16; ++i) {
-            fin.read(buffer, 2);
-            key[i] = std::stoi(buffer, 0, 16);
+        if (buffer.length() < 16) {
+            printf("Input is shorter than the tag. \n");
+            return 0;
+        }
+
+        const size_t length = buffer.length() - 16;
+        std::vector<char> plain(length + 1, 0);
+        if (!aes_gcm_open(buffer.data(), length, context, &IV[0], IV_length, nullptr, 0, 
+                          buffer.data() + length, &plain[0], verify_first)) {
+            printf("Authentication failed. \n");
+            return 0;
+        }
+
+        for (size_t i = 0; i < length; ++i)
+            printf("%02x", int(plain[i]) & 0xff);
+        printf("\n");
+        return 0;
+    }
+
+    // records are sealed with the context looked up per record, as a gateway would per packet
+    if (record) {
+        fin.open(argv[1], std::ios::binary);
+        GCMContextCache cache;
+        gcmCacheInit(cache, 4);
+
+        std::vector<char> buffer(record);
+        for (uint64_t n = 0; fin; ++n) {
+            fin.read(&buffer[0], record);
+            const size_t len = fin.gcount();
+            if (!len) break;
+
+            for (size_t i = 0; i < 8 && i < IV_length; ++i)
+                IV[IV_length - 1 - i] = n >> (8 * i);
+            const AESContext& context = gcmCacheGet(cache, 0, key, key_length, engine);
+            aes_gcm(&buffer[0], len, context, &IV[0], IV_length, nullptr, 0, &buffer[0], tag);
+
+            for (size_t i = 0; i < len; ++i)
+                printf("%02x", int(buffer[i]) & 0xff);
+            printf("\n");
+            for (size_t i = 0; i < 16; ++i)
+                printf("%02x", tag[i]);
+            printf("\n");
         }
         fin.close();
+        return 0;
     }
-    
-    unsigned char IV[12] = { 0 };
-    unsigned char add_data[0];
-    unsigned char tag[16];
 
-    std::vector<char> cipher(buffer.length(), 0);
-    aes_gcm(buffer.data(), buffer.length(), key, IV, add_data, 0, &cipher[0], tag);
+    // the file is sealed a chunk at a time, no padding, in constant memory
+    fin.open(argv[1], std::ios::binary);
+    GCMStream stream;
+    aes_gcm_init(stream, context, &IV[0], IV_length);
+
+    std::vector<char> buffer(64 * 1024);
+    while (fin) {
+        fin.read(&buffer[0], buffer.size());
+        const size_t len = fin.gcount();
+        aes_gcm_update(stream, &buffer[0], len, &buffer[0]);
 
-    for (size_t i = 0; i < buffer.length(); ++i)
-        printf("%02x", int(cipher[i]) & 0xff);
+        for (size_t i = 0; i < len; ++i)
+            printf("%02x", int(buffer[i]) & 0xff);
+    }
+    fin.close();
     printf("\n\n");
 
+    aes_gcm_final(stream, tag);
     for (size_t i = 0; i < 16; ++i)
         printf("%02x", tag[i]);
     printf("\n");
-    
 }
-
@@ -10,15 +10,20 @@
  *  E-mail: hoojamis@gmail.com
  *  Date: May 16, 2015
  *  Time: 15:51:03
- *  Description: AES(128, 192, 256 bit), Output Feedback Block(in 8 bit) Mode (OFB)
+ *  Description: AES(128, 192, 256 bit), Output Feedback Mode (OFB-128, OFB-8)
  *****************************************************************************/
 #include <cstdio>
+#include <cstring>
 #include <iostream>
 #include <fstream>
 #include <cinttypes>
 #include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <wmmintrin.h>
+#endif
 
-inline uint8_t gmult(uint8_t a, uint8_t b) {
+constexpr uint8_t gmult(uint8_t a, uint8_t b) {
     uint8_t p = 0, hbs = 0;
 
     for (size_t i = 0; i < 8; i++) {
@@ -55,7 +60,7 @@ constexpr uint8_t SubBytes[256] = {
 
 // key: initial key: 16 or 24 or 32 bytes
 // keys : 4 * (6 + key_length / 4 + 1) * 4 bytes
-void keyExpansion(const uint8_t key[], uint8_t keys[], const size_t key_length) {
+void keyExpansionSoftware(const uint8_t key[], uint8_t keys[], const size_t key_length) {
     constexpr uint8_t RCON[10][4] = {
         { 0x01, 0x00, 0x00, 0x00 },
         { 0x02, 0x00, 0x00, 0x00 },
@@ -103,95 +108,298 @@ void keyExpansion(const uint8_t key[], uint8_t keys[], const size_t key_length)
 
 }
 
-inline void subBytes(uint8_t state[]) {
-    for (size_t i = 0; i < 16; ++i)
-        state[i] = SubBytes[state[i]];
+inline uint32_t getWord(const uint8_t p[]) {
+    return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | uint32_t(p[3]);
+}
+
+inline void putWord(uint8_t p[], const uint32_t x) {
+    p[0] = x >> 24, p[1] = x >> 16, p[2] = x >> 8, p[3] = x;
 }
 
-inline void shiftRows(uint8_t state[]) {
-    uint8_t tmp = state[1];
-    state[1] = state[5];
-    state[5] = state[9];
-    state[9] = state[13];
-    state[13] = tmp;
+// T-tables, generated at compile time from SubBytes
+// Te0[x] is column (2s, s, s, 3s) where s = SubBytes[x], 
+// i.e. SubBytes and MixColumns of one byte at row 0 in one lookup,
+// Te1..Te3 are Te0 rotated right by 8, 16, 24 bits for rows 1..3.
+// Te4[x] is (s, s, s, s), used by the final round which has no MixColumns.
+struct AESTables {
+    uint32_t Te0[256], Te1[256], Te2[256], Te3[256], Te4[256];
 
-    tmp = state[2];
-    state[2] = state[10];
-    state[10] = tmp;
-    tmp = state[6];
-    state[6] = state[14];
-    state[14] = tmp;
-    
-    tmp = state[3];
-    state[3] = state[15];
-    state[15] = state[11];
-    state[11] = state[7];
-    state[7] = tmp;
-}
-
-inline void mixColumns(uint8_t state[]) {
-    uint8_t tmp[4];
-    for (size_t i = 0; i < 4; ++i) {
-        tmp[0] = gmult(2, state[4 * i + 0]) ^ 
-                 gmult(3, state[4 * i + 1]) ^
-                 gmult(1, state[4 * i + 2]) ^ 
-                 gmult(1, state[4 * i + 3]);
-        tmp[1] = gmult(1, state[4 * i + 0]) ^
-                 gmult(2, state[4 * i + 1]) ^
-                 gmult(3, state[4 * i + 2]) ^
-                 gmult(1, state[4 * i + 3]);
-        tmp[2] = gmult(1, state[4 * i + 0]) ^
-                 gmult(1, state[4 * i + 1]) ^
-                 gmult(2, state[4 * i + 2]) ^
-                 gmult(3, state[4 * i + 3]);
-        tmp[3] = gmult(3, state[4 * i + 0]) ^
-                 gmult(1, state[4 * i + 1]) ^
-                 gmult(1, state[4 * i + 2]) ^
-                 gmult(2, state[4 * i + 3]);
-        state[4 * i + 0] = tmp[0], state[4 * i + 1] = tmp[1],
-        state[4 * i + 2] = tmp[2], state[4 * i + 3] = tmp[3];
+    constexpr AESTables(): Te0(), Te1(), Te2(), Te3(), Te4() {
+        for (size_t x = 0; x < 256; ++x) {
+            const uint32_t s1 = SubBytes[x], s2 = gmult(2, s1), s3 = gmult(3, s1);
+            Te0[x] = s2 << 24 | s1 << 16 | s1 <<  8 | s3;
+            Te1[x] = s3 << 24 | s2 << 16 | s1 <<  8 | s1;
+            Te2[x] = s1 << 24 | s3 << 16 | s2 <<  8 | s1;
+            Te3[x] = s1 << 24 | s1 << 16 | s3 <<  8 | s2;
+            Te4[x] = s1 << 24 | s1 << 16 | s1 <<  8 | s1;
+        }
     }
-}
+};
 
-inline void addRoundKey(uint8_t state[], const uint8_t word[]) {
-    for (size_t i = 0; i < 16; ++i) 
-        state[i] ^= word[i];
-}
+constexpr AESTables T;
 
 // in: 16 bytes
 // out: 16 bytes
 // key: 4 * (round + 1) * 4 bytes
-void aesIteration(const uint8_t in[], uint8_t out[], const uint8_t key[], size_t total_round) {
-    uint8_t* state = out;
-    memcpy(state, in, 16);
-    
-    // add round key
-    addRoundKey(state, key);
-
-    for (size_t round = 0; round < total_round - 1; ++round) {
-        subBytes(state);
-        shiftRows(state);
-        mixColumns(state);
-        addRoundKey(state, key + 16 * round + 16);
+template <size_t total_round>
+void aesIterationTable(const uint8_t in[], uint8_t out[], const uint8_t key[]) {
+    // state is kept as 4 big-endian columns
+    uint32_t s0 = getWord(in +  0) ^ getWord(key +  0);
+    uint32_t s1 = getWord(in +  4) ^ getWord(key +  4);
+    uint32_t s2 = getWord(in +  8) ^ getWord(key +  8);
+    uint32_t s3 = getWord(in + 12) ^ getWord(key + 12);
+    uint32_t t0, t1, t2, t3;
+
+#pragma GCC unroll 14
+    for (size_t round = 1; round < total_round; ++round) {
+        const uint8_t* rk = key + 16 * round;
+        t0 = T.Te0[s0 >> 24] ^ T.Te1[s1 >> 16 & 0xff] ^ T.Te2[s2 >> 8 & 0xff] ^ T.Te3[s3 & 0xff] ^ getWord(rk +  0);
+        t1 = T.Te0[s1 >> 24] ^ T.Te1[s2 >> 16 & 0xff] ^ T.Te2[s3 >> 8 & 0xff] ^ T.Te3[s0 & 0xff] ^ getWord(rk +  4);
+        t2 = T.Te0[s2 >> 24] ^ T.Te1[s3 >> 16 & 0xff] ^ T.Te2[s0 >> 8 & 0xff] ^ T.Te3[s1 & 0xff] ^ getWord(rk +  8);
+        t3 = T.Te0[s3 >> 24] ^ T.Te1[s0 >> 16 & 0xff] ^ T.Te2[s1 >> 8 & 0xff] ^ T.Te3[s2 & 0xff] ^ getWord(rk + 12);
+        s0 = t0, s1 = t1, s2 = t2, s3 = t3;
+    }
+
+    // final round: SubBytes, ShiftRows, AddRoundKey
+    const uint8_t* rk = key + 16 * total_round;
+    t0 = (T.Te4[s0 >> 24] & 0xff000000) ^ (T.Te4[s1 >> 16 & 0xff] & 0x00ff0000) ^
+         (T.Te4[s2 >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s3 & 0xff] & 0x000000ff) ^ getWord(rk +  0);
+    t1 = (T.Te4[s1 >> 24] & 0xff000000) ^ (T.Te4[s2 >> 16 & 0xff] & 0x00ff0000) ^
+         (T.Te4[s3 >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s0 & 0xff] & 0x000000ff) ^ getWord(rk +  4);
+    t2 = (T.Te4[s2 >> 24] & 0xff000000) ^ (T.Te4[s3 >> 16 & 0xff] & 0x00ff0000) ^
+         (T.Te4[s0 >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s1 & 0xff] & 0x000000ff) ^ getWord(rk +  8);
+    t3 = (T.Te4[s3 >> 24] & 0xff000000) ^ (T.Te4[s0 >> 16 & 0xff] & 0x00ff0000) ^
+         (T.Te4[s1 >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s2 & 0xff] & 0x000000ff) ^ getWord(rk + 12);
+
+    putWord(out +  0, t0);
+    putWord(out +  4, t1);
+    putWord(out +  8, t2);
+    putWord(out + 12, t3);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// AES-NI kernels, compiled for the aes target only and selected at runtime
+#define AESNI_TARGET __attribute__((target("aes,sse2")))
+
+inline bool cpuSupportsAESNI() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+    return ecx & bit_AES;
+}
+
+const bool aesni_supported = cpuSupportsAESNI();
+
+AESNI_TARGET inline __m128i keyExpansionAssist(__m128i key, __m128i keygened) {
+    // prefix XOR of the 4 words: w0, w0^w1, w0^w1^w2, w0^w1^w2^w3
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 8));
+    return _mm_xor_si128(key, keygened);
+}
+
+// next 4 words of a 128-bit schedule, or of the even half of a 256-bit schedule
+template <int rcon>
+AESNI_TARGET inline __m128i keyExpansionStep(__m128i key, __m128i prev) {
+    return keyExpansionAssist(key, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(prev, rcon), 0xff));
+}
+
+// odd half of a 256-bit schedule: SubWord without RotWord and round constant
+AESNI_TARGET inline __m128i keyExpansionStep256(__m128i key, __m128i prev) {
+    return keyExpansionAssist(key, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(prev, 0x00), 0xaa));
+}
+
+// next 6 words of a 192-bit schedule, 
+// temp1 holds words 0..3, low half of temp3 holds words 4..5
+template <int rcon>
+AESNI_TARGET inline void keyExpansionStep192(__m128i& temp1, __m128i& temp3) {
+    temp1 = keyExpansionAssist(temp1, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(temp3, rcon), 0x55));
+    __m128i temp2 = _mm_shuffle_epi32(temp1, 0xff);
+    temp3 = _mm_xor_si128(temp3, _mm_slli_si128(temp3, 4));
+    temp3 = _mm_xor_si128(temp3, temp2);
+}
+
+// low half of lo, low half of hi
+AESNI_TARGET inline __m128i shuffleLowLow(__m128i lo, __m128i hi) {
+    return _mm_castpd_si128(_mm_shuffle_pd(_mm_castsi128_pd(lo), _mm_castsi128_pd(hi), 0));
+}
+
+// high half of lo, low half of hi
+AESNI_TARGET inline __m128i shuffleHighLow(__m128i lo, __m128i hi) {
+    return _mm_castpd_si128(_mm_shuffle_pd(_mm_castsi128_pd(lo), _mm_castsi128_pd(hi), 1));
+}
+
+// same layout of keys as keyExpansionSoftware
+AESNI_TARGET void keyExpansionAESNI(const uint8_t key[], uint8_t keys[], const size_t key_length) {
+    __m128i* ks = (__m128i*)(keys);
+
+    if (key_length == 16) {
+        __m128i k = _mm_loadu_si128((const __m128i*)(key));
+        _mm_storeu_si128(ks +  0, k);
+        _mm_storeu_si128(ks +  1, k = keyExpansionStep<0x01>(k, k));
+        _mm_storeu_si128(ks +  2, k = keyExpansionStep<0x02>(k, k));
+        _mm_storeu_si128(ks +  3, k = keyExpansionStep<0x04>(k, k));
+        _mm_storeu_si128(ks +  4, k = keyExpansionStep<0x08>(k, k));
+        _mm_storeu_si128(ks +  5, k = keyExpansionStep<0x10>(k, k));
+        _mm_storeu_si128(ks +  6, k = keyExpansionStep<0x20>(k, k));
+        _mm_storeu_si128(ks +  7, k = keyExpansionStep<0x40>(k, k));
+        _mm_storeu_si128(ks +  8, k = keyExpansionStep<0x80>(k, k));
+        _mm_storeu_si128(ks +  9, k = keyExpansionStep<0x1b>(k, k));
+        _mm_storeu_si128(ks + 10, k = keyExpansionStep<0x36>(k, k));
+    } else if (key_length == 24) {
+        // 6-word steps straddle the 4-word round keys, 
+        // so join the halves together with 64-bit shuffles
+        __m128i temp1 = _mm_loadu_si128((const __m128i*)(key));
+        __m128i temp3 = _mm_loadl_epi64((const __m128i*)(key + 16));
+        __m128i prev;
+        _mm_storeu_si128(ks + 0, temp1);
+        prev = temp3;
+        keyExpansionStep192<0x01>(temp1, temp3);
+        _mm_storeu_si128(ks + 1, shuffleLowLow(prev, temp1));
+        _mm_storeu_si128(ks + 2, shuffleHighLow(temp1, temp3));
+        keyExpansionStep192<0x02>(temp1, temp3);
+        _mm_storeu_si128(ks + 3, temp1);
+        prev = temp3;
+        keyExpansionStep192<0x04>(temp1, temp3);
+        _mm_storeu_si128(ks + 4, shuffleLowLow(prev, temp1));
+        _mm_storeu_si128(ks + 5, shuffleHighLow(temp1, temp3));
+        keyExpansionStep192<0x08>(temp1, temp3);
+        _mm_storeu_si128(ks + 6, temp1);
+        prev = temp3;
+        keyExpansionStep192<0x10>(temp1, temp3);
+        _mm_storeu_si128(ks + 7, shuffleLowLow(prev, temp1));
+        _mm_storeu_si128(ks + 8, shuffleHighLow(temp1, temp3));
+        keyExpansionStep192<0x20>(temp1, temp3);
+        _mm_storeu_si128(ks + 9, temp1);
+        prev = temp3;
+        keyExpansionStep192<0x40>(temp1, temp3);
+        _mm_storeu_si128(ks + 10, shuffleLowLow(prev, temp1));
+        _mm_storeu_si128(ks + 11, shuffleHighLow(temp1, temp3));
+        keyExpansionStep192<0x80>(temp1, temp3);
+        _mm_storeu_si128(ks + 12, temp1);
+    } else {
+        __m128i k0 = _mm_loadu_si128((const __m128i*)(key));
+        __m128i k1 = _mm_loadu_si128((const __m128i*)(key + 16));
+        _mm_storeu_si128(ks +  0, k0);
+        _mm_storeu_si128(ks +  1, k1);
+        _mm_storeu_si128(ks +  2, k0 = keyExpansionStep<0x01>(k0, k1));
+        _mm_storeu_si128(ks +  3, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks +  4, k0 = keyExpansionStep<0x02>(k0, k1));
+        _mm_storeu_si128(ks +  5, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks +  6, k0 = keyExpansionStep<0x04>(k0, k1));
+        _mm_storeu_si128(ks +  7, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks +  8, k0 = keyExpansionStep<0x08>(k0, k1));
+        _mm_storeu_si128(ks +  9, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks + 10, k0 = keyExpansionStep<0x10>(k0, k1));
+        _mm_storeu_si128(ks + 11, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks + 12, k0 = keyExpansionStep<0x20>(k0, k1));
+        _mm_storeu_si128(ks + 13, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks + 14, k0 = keyExpansionStep<0x40>(k0, k1));
     }
-    subBytes(state);
-    shiftRows(state);
-    addRoundKey(state, key + 16 * total_round);
 }
 
-void aes_ofb(const void* plain, size_t length, const void* key, const size_t key_length, const void* IV, void* cipher) {
+template <size_t total_round>
+AESNI_TARGET void aesIterationAESNI(const uint8_t in[], uint8_t out[], const uint8_t key[]) {
+    const __m128i* rk = (const __m128i*)(key);
+    __m128i state = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in)), _mm_loadu_si128(rk));
+
+#pragma GCC unroll 14
+    for (size_t round = 1; round < total_round; ++round)
+        state = _mm_aesenc_si128(state, _mm_loadu_si128(rk + round));
+    state = _mm_aesenclast_si128(state, _mm_loadu_si128(rk + total_round));
+
+    _mm_storeu_si128((__m128i*)(out), state);
+}
+#else
+const bool aesni_supported = false;
+#endif
+
+// key expansion used by the modes below,
+// AES-NI when the CPU has it, T-tables otherwise
+void keyExpansion(const uint8_t key[], uint8_t keys[], const size_t key_length) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (aesni_supported) return keyExpansionAESNI(key, keys, key_length);
+#endif
+    keyExpansionSoftware(key, keys, key_length);
+}
+
+// expanded keys and the cores specialized for their key size,
+// built once per key by aesInit and shared by every call
+struct alignas(64) AESContext {
     uint8_t keys[60 * 4];
-    keyExpansion((uint8_t*)(key), keys, key_length);
+    // one block
+    void (*encrypt)(const uint8_t in[], uint8_t out[], const uint8_t key[]);
+};
+
+// AES-NI when the CPU has it, T-tables otherwise
+template <size_t total_round>
+void aesSelectCores(AESContext& context) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (aesni_supported) {
+        context.encrypt = aesIterationAESNI<total_round>;
+        return;
+    }
+#endif
+    context.encrypt = aesIterationTable<total_round>;
+}
+
+// key_length: 16, 24 or 32 bytes
+// the only dispatch on key size, the modes call the specialized cores directly
+void aesInit(AESContext& context, const void* key, const size_t key_length) {
+    keyExpansion((const uint8_t*)(key), context.keys, key_length);
+    if (key_length == 16) aesSelectCores<10>(context);
+    else if (key_length == 24) aesSelectCores<12>(context);
+    else aesSelectCores<14>(context);
+}
+
+// out = a ^ b, 16 bytes
+inline void xorBlock(uint8_t out[], const uint8_t a[], const uint8_t b[]) {
+    uint64_t x[2], y[2];
+    memcpy(x, a, 16);
+    memcpy(y, b, 16);
+    x[0] ^= y[0], x[1] ^= y[1];
+    memcpy(out, x, 16);
+}
+
+// OFB-128: each keystream block is the encryption of the previous one, starting from IV,
+// the last block may be partial. 
+// plain and cipher may be the same buffer.
+void aes_ofb(const void* plain, size_t length, const AESContext& context, const void* IV, void* cipher) {
+    const uint8_t* plain_ = (const uint8_t*)(plain);
+    uint8_t* cipher_ = (uint8_t*)(cipher);
 
     uint8_t buffer[16];
     memcpy(buffer, IV, 16);
 
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        context.encrypt(buffer, buffer, context.keys);
+        xorBlock(cipher_ + i, plain_ + i, buffer);
+    }
+
+    if (i < length) {
+        context.encrypt(buffer, buffer, context.keys);
+        for (size_t j = 0; i + j < length; ++j)
+            cipher_[i + j] = plain_[i + j] ^ buffer[j];
+    }
+}
+
+// OFB is symmetric
+void aes_ofb_decrypt(const void* cipher, size_t length, const AESContext& context, const void* IV, void* plain) {
+    aes_ofb(cipher, length, context, IV, plain);
+}
+
+// OFB with 8-bit feedback of earlier versions of this program, for old ciphertext:
+// one block cipher call per byte, the first byte of each output is both 
+// the keystream byte and shifted into the register.
+// plain and cipher may be the same buffer, decryption is the same operation.
+void aes_ofb8(const void* plain, size_t length, const AESContext& context, const void* IV, void* cipher) {
+    uint8_t buffer[16], output[16];
+    memcpy(buffer, IV, 16);
+
     for (size_t i = 0; i < length; ++i) {
-        aesIteration(buffer, (uint8_t*)(cipher) + i, keys, 6 + key_length / 4);
-        for (size_t j = 0; j < 15; ++j) 
-            buffer[j] = buffer[j + 1];
-        buffer[15] = ((uint8_t*)(cipher))[i];
-        ((uint8_t*)(cipher))[i] ^= ((uint8_t*)(plain))[i];
+        context.encrypt(buffer, output, context.keys);
+        memmove(buffer, buffer + 1, 15);
+        buffer[15] = output[0];
+        ((uint8_t*)(cipher))[i] = ((uint8_t*)(plain))[i] ^ output[0];
     }
 }
 
@@ -216,7 +424,7 @@ int main(int argc, char** argv) {
     unsigned char IV[16] = { 0 };
     size_t key_length = 0;
 
-    if (argc == 3) {
+    if (argc >= 3) {
         fin.open(argv[2]);
         fin.seekg(0, std::ios::beg);
         char buffer[3] = { 0 };
@@ -233,8 +441,15 @@ int main(int argc, char** argv) {
         return 0;
     }
 
-    std::vector<char> cipher(buffer.length() + 16, 0);
-    aes_ofb(buffer.data(), buffer.length(), key, key_length, IV, &cipher[0]);
+    AESContext context;
+    aesInit(context, key, key_length);
+
+    // optional argument "ofb8" for the 8-bit feedback of earlier versions
+    std::vector<char> cipher(buffer.length(), 0);
+    if (argc >= 4 && !strcmp(argv[3], "ofb8"))
+        aes_ofb8(buffer.data(), buffer.length(), context, IV, &cipher[0]);
+    else
+        aes_ofb(buffer.data(), buffer.length(), context, IV, &cipher[0]);
 
     for (size_t i = 0; i < buffer.length(); ++i)
         printf("%02x", int(cipher[i]) & 0xff);
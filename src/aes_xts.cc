@@ -0,0 +1,875 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: 
+ *  Filename: aes_xts.cc 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: May 16, 2015
+ *  Time: 16:20:37
+ *  Description: AES(128, 256 bit) XEX-based Tweaked CodeBook Mode with ciphertext Stealing (XTS), IEEE 1619
+ *****************************************************************************/
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+#include <fstream>
+#include <cinttypes>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <atomic>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <wmmintrin.h>
+#endif
+
+constexpr uint8_t gmult(uint8_t a, uint8_t b) {
+    uint8_t p = 0, hbs = 0;
+
+    for (size_t i = 0; i < 8; i++) {
+        if (b & 1) 
+            p ^= a;
+
+        hbs = a & 0x80;
+        a <<= 1;
+        if (hbs) a ^= 0x1b; // 0000 0001 0001 1011    
+        b >>= 1;
+    }
+
+    return (uint8_t)p;
+}
+
+constexpr uint8_t SubBytes[256] = {
+   0x63, 0x7C, 0x77, 0x7B, 0xF2, 0x6B, 0x6F, 0xC5, 0x30, 0x01, 0x67, 0x2B, 0xFE, 0xD7, 0xAB, 0x76,
+   0xCA, 0x82, 0xC9, 0x7D, 0xFA, 0x59, 0x47, 0xF0, 0xAD, 0xD4, 0xA2, 0xAF, 0x9C, 0xA4, 0x72, 0xC0,
+   0xB7, 0xFD, 0x93, 0x26, 0x36, 0x3F, 0xF7, 0xCC, 0x34, 0xA5, 0xE5, 0xF1, 0x71, 0xD8, 0x31, 0x15,
+   0x04, 0xC7, 0x23, 0xC3, 0x18, 0x96, 0x05, 0x9A, 0x07, 0x12, 0x80, 0xE2, 0xEB, 0x27, 0xB2, 0x75,
+   0x09, 0x83, 0x2C, 0x1A, 0x1B, 0x6E, 0x5A, 0xA0, 0x52, 0x3B, 0xD6, 0xB3, 0x29, 0xE3, 0x2F, 0x84,
+   0x53, 0xD1, 0x00, 0xED, 0x20, 0xFC, 0xB1, 0x5B, 0x6A, 0xCB, 0xBE, 0x39, 0x4A, 0x4C, 0x58, 0xCF,
+   0xD0, 0xEF, 0xAA, 0xFB, 0x43, 0x4D, 0x33, 0x85, 0x45, 0xF9, 0x02, 0x7F, 0x50, 0x3C, 0x9F, 0xA8,
+   0x51, 0xA3, 0x40, 0x8F, 0x92, 0x9D, 0x38, 0xF5, 0xBC, 0xB6, 0xDA, 0x21, 0x10, 0xFF, 0xF3, 0xD2,
+   0xCD, 0x0C, 0x13, 0xEC, 0x5F, 0x97, 0x44, 0x17, 0xC4, 0xA7, 0x7E, 0x3D, 0x64, 0x5D, 0x19, 0x73,
+   0x60, 0x81, 0x4F, 0xDC, 0x22, 0x2A, 0x90, 0x88, 0x46, 0xEE, 0xB8, 0x14, 0xDE, 0x5E, 0x0B, 0xDB,
+   0xE0, 0x32, 0x3A, 0x0A, 0x49, 0x06, 0x24, 0x5C, 0xC2, 0xD3, 0xAC, 0x62, 0x91, 0x95, 0xE4, 0x79,
+   0xE7, 0xC8, 0x37, 0x6D, 0x8D, 0xD5, 0x4E, 0xA9, 0x6C, 0x56, 0xF4, 0xEA, 0x65, 0x7A, 0xAE, 0x08,
+   0xBA, 0x78, 0x25, 0x2E, 0x1C, 0xA6, 0xB4, 0xC6, 0xE8, 0xDD, 0x74, 0x1F, 0x4B, 0xBD, 0x8B, 0x8A,
+   0x70, 0x3E, 0xB5, 0x66, 0x48, 0x03, 0xF6, 0x0E, 0x61, 0x35, 0x57, 0xB9, 0x86, 0xC1, 0x1D, 0x9E,
+   0xE1, 0xF8, 0x98, 0x11, 0x69, 0xD9, 0x8E, 0x94, 0x9B, 0x1E, 0x87, 0xE9, 0xCE, 0x55, 0x28, 0xDF,
+   0x8C, 0xA1, 0x89, 0x0D, 0xBF, 0xE6, 0x42, 0x68, 0x41, 0x99, 0x2D, 0x0F, 0xB0, 0x54, 0xBB, 0x16
+};
+
+// key: initial key: 16 or 24 or 32 bytes
+// keys : 4 * (6 + key_length / 4 + 1) * 4 bytes
+void keyExpansionSoftware(const uint8_t key[], uint8_t keys[], const size_t key_length) {
+    constexpr uint8_t RCON[10][4] = {
+        { 0x01, 0x00, 0x00, 0x00 },
+        { 0x02, 0x00, 0x00, 0x00 },
+        { 0x04, 0x00, 0x00, 0x00 },
+        { 0x08, 0x00, 0x00, 0x00 },
+        { 0x10, 0x00, 0x00, 0x00 },
+        { 0x20, 0x00, 0x00, 0x00 },
+        { 0x40, 0x00, 0x00, 0x00 },
+        { 0x80, 0x00, 0x00, 0x00 },
+        { 0x1b, 0x00, 0x00, 0x00 },
+        { 0x36, 0x00, 0x00, 0x00 }
+    };
+
+
+    memcpy(keys, key, key_length);
+
+    for (size_t i = key_length / 4; i < 4 * (6 + key_length / 4 + 1); ++i) {
+        uint8_t tmp[4] = { keys[4 * (i - 1) + 0], keys[4 * (i - 1) + 1],
+                           keys[4 * (i - 1) + 2], keys[4 * (i - 1) + 3] };
+        if (i % (key_length / 4) == 0) {
+            // rotate left one byte
+            uint8_t temp = tmp[0];
+            tmp[0] = tmp[1], tmp[1] = tmp[2], tmp[2] = tmp[3], tmp[3] = temp;
+            // SubBytes
+            tmp[0] = SubBytes[tmp[0]];
+            tmp[1] = SubBytes[tmp[1]];
+            tmp[2] = SubBytes[tmp[2]];
+            tmp[3] = SubBytes[tmp[3]];
+            // XOR round constants
+            tmp[0] ^= RCON[i / (key_length / 4) - 1][0], tmp[1] ^= RCON[i / (key_length / 4) - 1][1], 
+            tmp[2] ^= RCON[i / (key_length / 4) - 1][2], tmp[3] ^= RCON[i / (key_length / 4) - 1][3];
+        } else if (key_length > 24 && i % (key_length / 4) == 4) {
+            tmp[0] = SubBytes[tmp[0]];
+            tmp[1] = SubBytes[tmp[1]];
+            tmp[2] = SubBytes[tmp[2]];
+            tmp[3] = SubBytes[tmp[3]];
+        }
+        keys[4 * i + 0] = tmp[0], keys[4 * i + 1] = tmp[1],
+        keys[4 * i + 2] = tmp[2], keys[4 * i + 3] = tmp[3];
+        keys[4 * i + 0] ^= keys[4 * (i - key_length / 4) + 0], 
+        keys[4 * i + 1] ^= keys[4 * (i - key_length / 4) + 1],
+        keys[4 * i + 2] ^= keys[4 * (i - key_length / 4) + 2],
+        keys[4 * i + 3] ^= keys[4 * (i - key_length / 4) + 3];
+    }
+
+}
+
+
+inline uint32_t getWord(const uint8_t p[]) {
+    return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | uint32_t(p[3]);
+}
+
+inline void putWord(uint8_t p[], const uint32_t x) {
+    p[0] = x >> 24, p[1] = x >> 16, p[2] = x >> 8, p[3] = x;
+}
+
+// T-tables, generated at compile time from SubBytes
+// Te0[x] is column (2s, s, s, 3s) where s = SubBytes[x], 
+// i.e. SubBytes and MixColumns of one byte at row 0 in one lookup,
+// Te1..Te3 are Te0 rotated right by 8, 16, 24 bits for rows 1..3.
+// Te4[x] is (s, s, s, s), used by the final round which has no MixColumns.
+struct AESTables {
+    uint32_t Te0[256], Te1[256], Te2[256], Te3[256], Te4[256];
+
+    constexpr AESTables(): Te0(), Te1(), Te2(), Te3(), Te4() {
+        for (size_t x = 0; x < 256; ++x) {
+            const uint32_t s1 = SubBytes[x], s2 = gmult(2, s1), s3 = gmult(3, s1);
+            Te0[x] = s2 << 24 | s1 << 16 | s1 <<  8 | s3;
+            Te1[x] = s3 << 24 | s2 << 16 | s1 <<  8 | s1;
+            Te2[x] = s1 << 24 | s3 << 16 | s2 <<  8 | s1;
+            Te3[x] = s1 << 24 | s1 << 16 | s3 <<  8 | s2;
+            Te4[x] = s1 << 24 | s1 << 16 | s1 <<  8 | s1;
+        }
+    }
+};
+
+constexpr AESTables T;
+
+// in: 16 bytes
+// out: 16 bytes
+// key: 4 * (round + 1) * 4 bytes
+template <size_t total_round>
+void aesIterationTable(const uint8_t in[], uint8_t out[], const uint8_t key[]) {
+    // state is kept as 4 big-endian columns
+    uint32_t s0 = getWord(in +  0) ^ getWord(key +  0);
+    uint32_t s1 = getWord(in +  4) ^ getWord(key +  4);
+    uint32_t s2 = getWord(in +  8) ^ getWord(key +  8);
+    uint32_t s3 = getWord(in + 12) ^ getWord(key + 12);
+    uint32_t t0, t1, t2, t3;
+
+#pragma GCC unroll 14
+    for (size_t round = 1; round < total_round; ++round) {
+        const uint8_t* rk = key + 16 * round;
+        t0 = T.Te0[s0 >> 24] ^ T.Te1[s1 >> 16 & 0xff] ^ T.Te2[s2 >> 8 & 0xff] ^ T.Te3[s3 & 0xff] ^ getWord(rk +  0);
+        t1 = T.Te0[s1 >> 24] ^ T.Te1[s2 >> 16 & 0xff] ^ T.Te2[s3 >> 8 & 0xff] ^ T.Te3[s0 & 0xff] ^ getWord(rk +  4);
+        t2 = T.Te0[s2 >> 24] ^ T.Te1[s3 >> 16 & 0xff] ^ T.Te2[s0 >> 8 & 0xff] ^ T.Te3[s1 & 0xff] ^ getWord(rk +  8);
+        t3 = T.Te0[s3 >> 24] ^ T.Te1[s0 >> 16 & 0xff] ^ T.Te2[s1 >> 8 & 0xff] ^ T.Te3[s2 & 0xff] ^ getWord(rk + 12);
+        s0 = t0, s1 = t1, s2 = t2, s3 = t3;
+    }
+
+    // final round: SubBytes, ShiftRows, AddRoundKey
+    const uint8_t* rk = key + 16 * total_round;
+    t0 = (T.Te4[s0 >> 24] & 0xff000000) ^ (T.Te4[s1 >> 16 & 0xff] & 0x00ff0000) ^
+         (T.Te4[s2 >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s3 & 0xff] & 0x000000ff) ^ getWord(rk +  0);
+    t1 = (T.Te4[s1 >> 24] & 0xff000000) ^ (T.Te4[s2 >> 16 & 0xff] & 0x00ff0000) ^
+         (T.Te4[s3 >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s0 & 0xff] & 0x000000ff) ^ getWord(rk +  4);
+    t2 = (T.Te4[s2 >> 24] & 0xff000000) ^ (T.Te4[s3 >> 16 & 0xff] & 0x00ff0000) ^
+         (T.Te4[s0 >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s1 & 0xff] & 0x000000ff) ^ getWord(rk +  8);
+    t3 = (T.Te4[s3 >> 24] & 0xff000000) ^ (T.Te4[s0 >> 16 & 0xff] & 0x00ff0000) ^
+         (T.Te4[s1 >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s2 & 0xff] & 0x000000ff) ^ getWord(rk + 12);
+
+    putWord(out +  0, t0);
+    putWord(out +  4, t1);
+    putWord(out +  8, t2);
+    putWord(out + 12, t3);
+}
+
+// 4 independent blocks interleaved round by round, 
+// so the table lookups of one block overlap the latency of the others
+// in: 16 * blocks bytes
+// out: 16 * blocks bytes, may be the same as in
+template <size_t total_round>
+void aesEncryptBlocksTable(const uint8_t in[], uint8_t out[], size_t blocks, const uint8_t key[]) {
+    constexpr size_t ways = 4;
+    size_t i = 0;
+
+    for (; i + ways <= blocks; i += ways) {
+        uint32_t s[ways][4], t[ways][4];
+        for (size_t j = 0; j < ways; ++j)
+            for (size_t c = 0; c < 4; ++c)
+                s[j][c] = getWord(in + 16 * (i + j) + 4 * c) ^ getWord(key + 4 * c);
+
+#pragma GCC unroll 14
+        for (size_t round = 1; round < total_round; ++round) {
+            const uint8_t* rk = key + 16 * round;
+#pragma GCC unroll 4
+            for (size_t j = 0; j < ways; ++j)
+#pragma GCC unroll 4
+                for (size_t c = 0; c < 4; ++c)
+                    t[j][c] = T.Te0[s[j][c] >> 24] ^ T.Te1[s[j][(c + 1) & 3] >> 16 & 0xff] ^ 
+                              T.Te2[s[j][(c + 2) & 3] >> 8 & 0xff] ^ T.Te3[s[j][(c + 3) & 3] & 0xff] ^ 
+                              getWord(rk + 4 * c);
+            memcpy(s, t, sizeof(s));
+        }
+
+        const uint8_t* rk = key + 16 * total_round;
+        for (size_t j = 0; j < ways; ++j)
+            for (size_t c = 0; c < 4; ++c)
+                putWord(out + 16 * (i + j) + 4 * c,
+                        (T.Te4[s[j][c] >> 24] & 0xff000000) ^ (T.Te4[s[j][(c + 1) & 3] >> 16 & 0xff] & 0x00ff0000) ^
+                        (T.Te4[s[j][(c + 2) & 3] >> 8 & 0xff] & 0x0000ff00) ^ (T.Te4[s[j][(c + 3) & 3] & 0xff] & 0x000000ff) ^
+                        getWord(rk + 4 * c));
+    }
+
+    for (; i < blocks; ++i)
+        aesIterationTable<total_round>(in + 16 * i, out + 16 * i, key);
+}
+
+// inverse T-tables, generated at compile time from SubBytes
+// Td0[x] is column (14s, 9s, 13s, 11s) where s = InvSubBytes[x],
+// Td1..Td3 are Td0 rotated right by 8, 16, 24 bits,
+// Td4[x] is (s, s, s, s) for the final round.
+struct AESInverseTables {
+    uint8_t InvSubBytes[256];
+    uint32_t Td0[256], Td1[256], Td2[256], Td3[256], Td4[256];
+
+    constexpr AESInverseTables(): InvSubBytes(), Td0(), Td1(), Td2(), Td3(), Td4() {
+        for (size_t x = 0; x < 256; ++x)
+            InvSubBytes[SubBytes[x]] = x;
+
+        for (size_t x = 0; x < 256; ++x) {
+            const uint32_t s = InvSubBytes[x];
+            const uint32_t s9 = gmult(9, s), s11 = gmult(11, s), s13 = gmult(13, s), s14 = gmult(14, s);
+            Td0[x] = s14 << 24 | s9  << 16 | s13 << 8 | s11;
+            Td1[x] = s11 << 24 | s14 << 16 | s9  << 8 | s13;
+            Td2[x] = s13 << 24 | s11 << 16 | s14 << 8 | s9;
+            Td3[x] = s9  << 24 | s13 << 16 | s11 << 8 | s14;
+            Td4[x] = s   << 24 | s   << 16 | s   << 8 | s;
+        }
+    }
+};
+
+constexpr AESInverseTables TI;
+
+inline void invMixColumns(uint8_t state[]) {
+    for (size_t i = 0; i < 4; ++i) {
+        const uint8_t a0 = state[4 * i + 0], a1 = state[4 * i + 1], 
+                      a2 = state[4 * i + 2], a3 = state[4 * i + 3];
+        state[4 * i + 0] = gmult(14, a0) ^ gmult(11, a1) ^ gmult(13, a2) ^ gmult( 9, a3);
+        state[4 * i + 1] = gmult( 9, a0) ^ gmult(14, a1) ^ gmult(11, a2) ^ gmult(13, a3);
+        state[4 * i + 2] = gmult(13, a0) ^ gmult( 9, a1) ^ gmult(14, a2) ^ gmult(11, a3);
+        state[4 * i + 3] = gmult(11, a0) ^ gmult(13, a1) ^ gmult( 9, a2) ^ gmult(14, a3);
+    }
+}
+
+// equivalent inverse cipher schedule (FIPS-197 5.3.5):
+// round keys in reverse order, InvMixColumns applied to all but the first and last
+// keys: 4 * (round + 1) * 4 bytes, from keyExpansion
+// dkeys: 4 * (round + 1) * 4 bytes
+void keyExpansionInverseSoftware(const uint8_t keys[], uint8_t dkeys[], size_t total_round) {
+    memcpy(dkeys, keys + 16 * total_round, 16);
+    for (size_t round = 1; round < total_round; ++round) {
+        memcpy(dkeys + 16 * round, keys + 16 * (total_round - round), 16);
+        invMixColumns(dkeys + 16 * round);
+    }
+    memcpy(dkeys + 16 * total_round, keys, 16);
+}
+
+// in: 16 bytes
+// out: 16 bytes
+// key: 4 * (round + 1) * 4 bytes, from keyExpansionInverse
+template <size_t total_round>
+void aesInverseIterationTable(const uint8_t in[], uint8_t out[], const uint8_t key[]) {
+    uint32_t s0 = getWord(in +  0) ^ getWord(key +  0);
+    uint32_t s1 = getWord(in +  4) ^ getWord(key +  4);
+    uint32_t s2 = getWord(in +  8) ^ getWord(key +  8);
+    uint32_t s3 = getWord(in + 12) ^ getWord(key + 12);
+    uint32_t t0, t1, t2, t3;
+
+#pragma GCC unroll 14
+    for (size_t round = 1; round < total_round; ++round) {
+        const uint8_t* rk = key + 16 * round;
+        t0 = TI.Td0[s0 >> 24] ^ TI.Td1[s3 >> 16 & 0xff] ^ TI.Td2[s2 >> 8 & 0xff] ^ TI.Td3[s1 & 0xff] ^ getWord(rk +  0);
+        t1 = TI.Td0[s1 >> 24] ^ TI.Td1[s0 >> 16 & 0xff] ^ TI.Td2[s3 >> 8 & 0xff] ^ TI.Td3[s2 & 0xff] ^ getWord(rk +  4);
+        t2 = TI.Td0[s2 >> 24] ^ TI.Td1[s1 >> 16 & 0xff] ^ TI.Td2[s0 >> 8 & 0xff] ^ TI.Td3[s3 & 0xff] ^ getWord(rk +  8);
+        t3 = TI.Td0[s3 >> 24] ^ TI.Td1[s2 >> 16 & 0xff] ^ TI.Td2[s1 >> 8 & 0xff] ^ TI.Td3[s0 & 0xff] ^ getWord(rk + 12);
+        s0 = t0, s1 = t1, s2 = t2, s3 = t3;
+    }
+
+    // final round: InvShiftRows, InvSubBytes, AddRoundKey
+    const uint8_t* rk = key + 16 * total_round;
+    t0 = (TI.Td4[s0 >> 24] & 0xff000000) ^ (TI.Td4[s3 >> 16 & 0xff] & 0x00ff0000) ^
+         (TI.Td4[s2 >> 8 & 0xff] & 0x0000ff00) ^ (TI.Td4[s1 & 0xff] & 0x000000ff) ^ getWord(rk +  0);
+    t1 = (TI.Td4[s1 >> 24] & 0xff000000) ^ (TI.Td4[s0 >> 16 & 0xff] & 0x00ff0000) ^
+         (TI.Td4[s3 >> 8 & 0xff] & 0x0000ff00) ^ (TI.Td4[s2 & 0xff] & 0x000000ff) ^ getWord(rk +  4);
+    t2 = (TI.Td4[s2 >> 24] & 0xff000000) ^ (TI.Td4[s1 >> 16 & 0xff] & 0x00ff0000) ^
+         (TI.Td4[s0 >> 8 & 0xff] & 0x0000ff00) ^ (TI.Td4[s3 & 0xff] & 0x000000ff) ^ getWord(rk +  8);
+    t3 = (TI.Td4[s3 >> 24] & 0xff000000) ^ (TI.Td4[s2 >> 16 & 0xff] & 0x00ff0000) ^
+         (TI.Td4[s1 >> 8 & 0xff] & 0x0000ff00) ^ (TI.Td4[s0 & 0xff] & 0x000000ff) ^ getWord(rk + 12);
+
+    putWord(out +  0, t0);
+    putWord(out +  4, t1);
+    putWord(out +  8, t2);
+    putWord(out + 12, t3);
+}
+
+// 4 independent blocks interleaved round by round
+// in: 16 * blocks bytes
+// out: 16 * blocks bytes, may be the same as in
+template <size_t total_round>
+void aesDecryptBlocksTable(const uint8_t in[], uint8_t out[], size_t blocks, const uint8_t key[]) {
+    constexpr size_t ways = 4;
+    size_t i = 0;
+
+    for (; i + ways <= blocks; i += ways) {
+        uint32_t s[ways][4], t[ways][4];
+        for (size_t j = 0; j < ways; ++j)
+            for (size_t c = 0; c < 4; ++c)
+                s[j][c] = getWord(in + 16 * (i + j) + 4 * c) ^ getWord(key + 4 * c);
+
+#pragma GCC unroll 14
+        for (size_t round = 1; round < total_round; ++round) {
+            const uint8_t* rk = key + 16 * round;
+#pragma GCC unroll 4
+            for (size_t j = 0; j < ways; ++j)
+#pragma GCC unroll 4
+                for (size_t c = 0; c < 4; ++c)
+                    t[j][c] = TI.Td0[s[j][c] >> 24] ^ TI.Td1[s[j][(c + 3) & 3] >> 16 & 0xff] ^ 
+                              TI.Td2[s[j][(c + 2) & 3] >> 8 & 0xff] ^ TI.Td3[s[j][(c + 1) & 3] & 0xff] ^ 
+                              getWord(rk + 4 * c);
+            memcpy(s, t, sizeof(s));
+        }
+
+        const uint8_t* rk = key + 16 * total_round;
+        for (size_t j = 0; j < ways; ++j)
+            for (size_t c = 0; c < 4; ++c)
+                putWord(out + 16 * (i + j) + 4 * c,
+                        (TI.Td4[s[j][c] >> 24] & 0xff000000) ^ (TI.Td4[s[j][(c + 3) & 3] >> 16 & 0xff] & 0x00ff0000) ^
+                        (TI.Td4[s[j][(c + 2) & 3] >> 8 & 0xff] & 0x0000ff00) ^ (TI.Td4[s[j][(c + 1) & 3] & 0xff] & 0x000000ff) ^
+                        getWord(rk + 4 * c));
+    }
+
+    for (; i < blocks; ++i)
+        aesInverseIterationTable<total_round>(in + 16 * i, out + 16 * i, key);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// AES-NI kernels, compiled for the aes target only and selected at runtime
+#define AESNI_TARGET __attribute__((target("aes,sse2")))
+
+inline bool cpuSupportsAESNI() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+    return ecx & bit_AES;
+}
+
+const bool aesni_supported = cpuSupportsAESNI();
+
+AESNI_TARGET inline __m128i keyExpansionAssist(__m128i key, __m128i keygened) {
+    // prefix XOR of the 4 words: w0, w0^w1, w0^w1^w2, w0^w1^w2^w3
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 8));
+    return _mm_xor_si128(key, keygened);
+}
+
+// next 4 words of a 128-bit schedule, or of the even half of a 256-bit schedule
+template <int rcon>
+AESNI_TARGET inline __m128i keyExpansionStep(__m128i key, __m128i prev) {
+    return keyExpansionAssist(key, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(prev, rcon), 0xff));
+}
+
+// odd half of a 256-bit schedule: SubWord without RotWord and round constant
+AESNI_TARGET inline __m128i keyExpansionStep256(__m128i key, __m128i prev) {
+    return keyExpansionAssist(key, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(prev, 0x00), 0xaa));
+}
+
+// next 6 words of a 192-bit schedule, 
+// temp1 holds words 0..3, low half of temp3 holds words 4..5
+template <int rcon>
+AESNI_TARGET inline void keyExpansionStep192(__m128i& temp1, __m128i& temp3) {
+    temp1 = keyExpansionAssist(temp1, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(temp3, rcon), 0x55));
+    __m128i temp2 = _mm_shuffle_epi32(temp1, 0xff);
+    temp3 = _mm_xor_si128(temp3, _mm_slli_si128(temp3, 4));
+    temp3 = _mm_xor_si128(temp3, temp2);
+}
+
+// low half of lo, low half of hi
+AESNI_TARGET inline __m128i shuffleLowLow(__m128i lo, __m128i hi) {
+    return _mm_castpd_si128(_mm_shuffle_pd(_mm_castsi128_pd(lo), _mm_castsi128_pd(hi), 0));
+}
+
+// high half of lo, low half of hi
+AESNI_TARGET inline __m128i shuffleHighLow(__m128i lo, __m128i hi) {
+    return _mm_castpd_si128(_mm_shuffle_pd(_mm_castsi128_pd(lo), _mm_castsi128_pd(hi), 1));
+}
+
+// same layout of keys as keyExpansionSoftware
+AESNI_TARGET void keyExpansionAESNI(const uint8_t key[], uint8_t keys[], const size_t key_length) {
+    __m128i* ks = (__m128i*)(keys);
+
+    if (key_length == 16) {
+        __m128i k = _mm_loadu_si128((const __m128i*)(key));
+        _mm_storeu_si128(ks +  0, k);
+        _mm_storeu_si128(ks +  1, k = keyExpansionStep<0x01>(k, k));
+        _mm_storeu_si128(ks +  2, k = keyExpansionStep<0x02>(k, k));
+        _mm_storeu_si128(ks +  3, k = keyExpansionStep<0x04>(k, k));
+        _mm_storeu_si128(ks +  4, k = keyExpansionStep<0x08>(k, k));
+        _mm_storeu_si128(ks +  5, k = keyExpansionStep<0x10>(k, k));
+        _mm_storeu_si128(ks +  6, k = keyExpansionStep<0x20>(k, k));
+        _mm_storeu_si128(ks +  7, k = keyExpansionStep<0x40>(k, k));
+        _mm_storeu_si128(ks +  8, k = keyExpansionStep<0x80>(k, k));
+        _mm_storeu_si128(ks +  9, k = keyExpansionStep<0x1b>(k, k));
+        _mm_storeu_si128(ks + 10, k = keyExpansionStep<0x36>(k, k));
+    } else if (key_length == 24) {
+        // 6-word steps straddle the 4-word round keys, 
+        // so join the halves together with 64-bit shuffles
+        __m128i temp1 = _mm_loadu_si128((const __m128i*)(key));
+        __m128i temp3 = _mm_loadl_epi64((const __m128i*)(key + 16));
+        __m128i prev;
+        _mm_storeu_si128(ks + 0, temp1);
+        prev = temp3;
+        keyExpansionStep192<0x01>(temp1, temp3);
+        _mm_storeu_si128(ks + 1, shuffleLowLow(prev, temp1));
+        _mm_storeu_si128(ks + 2, shuffleHighLow(temp1, temp3));
+        keyExpansionStep192<0x02>(temp1, temp3);
+        _mm_storeu_si128(ks + 3, temp1);
+        prev = temp3;
+        keyExpansionStep192<0x04>(temp1, temp3);
+        _mm_storeu_si128(ks + 4, shuffleLowLow(prev, temp1));
+        _mm_storeu_si128(ks + 5, shuffleHighLow(temp1, temp3));
+        keyExpansionStep192<0x08>(temp1, temp3);
+        _mm_storeu_si128(ks + 6, temp1);
+        prev = temp3;
+        keyExpansionStep192<0x10>(temp1, temp3);
+        _mm_storeu_si128(ks + 7, shuffleLowLow(prev, temp1));
+        _mm_storeu_si128(ks + 8, shuffleHighLow(temp1, temp3));
+        keyExpansionStep192<0x20>(temp1, temp3);
+        _mm_storeu_si128(ks + 9, temp1);
+        prev = temp3;
+        keyExpansionStep192<0x40>(temp1, temp3);
+        _mm_storeu_si128(ks + 10, shuffleLowLow(prev, temp1));
+        _mm_storeu_si128(ks + 11, shuffleHighLow(temp1, temp3));
+        keyExpansionStep192<0x80>(temp1, temp3);
+        _mm_storeu_si128(ks + 12, temp1);
+    } else {
+        __m128i k0 = _mm_loadu_si128((const __m128i*)(key));
+        __m128i k1 = _mm_loadu_si128((const __m128i*)(key + 16));
+        _mm_storeu_si128(ks +  0, k0);
+        _mm_storeu_si128(ks +  1, k1);
+        _mm_storeu_si128(ks +  2, k0 = keyExpansionStep<0x01>(k0, k1));
+        _mm_storeu_si128(ks +  3, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks +  4, k0 = keyExpansionStep<0x02>(k0, k1));
+        _mm_storeu_si128(ks +  5, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks +  6, k0 = keyExpansionStep<0x04>(k0, k1));
+        _mm_storeu_si128(ks +  7, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks +  8, k0 = keyExpansionStep<0x08>(k0, k1));
+        _mm_storeu_si128(ks +  9, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks + 10, k0 = keyExpansionStep<0x10>(k0, k1));
+        _mm_storeu_si128(ks + 11, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks + 12, k0 = keyExpansionStep<0x20>(k0, k1));
+        _mm_storeu_si128(ks + 13, k1 = keyExpansionStep256(k1, k0));
+        _mm_storeu_si128(ks + 14, k0 = keyExpansionStep<0x40>(k0, k1));
+    }
+}
+
+template <size_t total_round>
+AESNI_TARGET void aesIterationAESNI(const uint8_t in[], uint8_t out[], const uint8_t key[]) {
+    const __m128i* rk = (const __m128i*)(key);
+    __m128i state = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in)), _mm_loadu_si128(rk));
+
+#pragma GCC unroll 14
+    for (size_t round = 1; round < total_round; ++round)
+        state = _mm_aesenc_si128(state, _mm_loadu_si128(rk + round));
+    state = _mm_aesenclast_si128(state, _mm_loadu_si128(rk + total_round));
+
+    _mm_storeu_si128((__m128i*)(out), state);
+}
+
+// 8 independent blocks interleaved round by round, 
+// which keeps the pipelined AES unit busy instead of waiting on each aesenc
+// in: 16 * blocks bytes
+// out: 16 * blocks bytes, may be the same as in
+template <size_t total_round>
+AESNI_TARGET void aesEncryptBlocksAESNI(const uint8_t in[], uint8_t out[], size_t blocks, const uint8_t key[]) {
+    constexpr size_t ways = 8;
+    const __m128i* src = (const __m128i*)(in);
+    __m128i* dst = (__m128i*)(out);
+    size_t i = 0;
+
+    // round keys are loaded once and kept in registers across the whole buffer
+    __m128i k[total_round + 1];
+#pragma GCC unroll 15
+    for (size_t round = 0; round <= total_round; ++round)
+        k[round] = _mm_loadu_si128((const __m128i*)(key) + round);
+
+    for (; i + ways <= blocks; i += ways) {
+        __m128i state[ways];
+        for (size_t j = 0; j < ways; ++j)
+            state[j] = _mm_xor_si128(_mm_loadu_si128(src + i + j), k[0]);
+
+#pragma GCC unroll 14
+        for (size_t round = 1; round < total_round; ++round) {
+#pragma GCC unroll 8
+            for (size_t j = 0; j < ways; ++j)
+                state[j] = _mm_aesenc_si128(state[j], k[round]);
+        }
+
+        for (size_t j = 0; j < ways; ++j)
+            _mm_storeu_si128(dst + i + j, _mm_aesenclast_si128(state[j], k[total_round]));
+    }
+
+    for (; i < blocks; ++i)
+        aesIterationAESNI<total_round>(in + 16 * i, out + 16 * i, key);
+}
+
+// equivalent inverse cipher schedule through aesimc, same layout as keyExpansionInverseSoftware
+AESNI_TARGET void keyExpansionInverseAESNI(const uint8_t keys[], uint8_t dkeys[], size_t total_round) {
+    const __m128i* ks = (const __m128i*)(keys);
+    __m128i* dks = (__m128i*)(dkeys);
+
+    _mm_storeu_si128(dks, _mm_loadu_si128(ks + total_round));
+    for (size_t round = 1; round < total_round; ++round)
+        _mm_storeu_si128(dks + round, _mm_aesimc_si128(_mm_loadu_si128(ks + total_round - round)));
+    _mm_storeu_si128(dks + total_round, _mm_loadu_si128(ks));
+}
+
+template <size_t total_round>
+AESNI_TARGET void aesInverseIterationAESNI(const uint8_t in[], uint8_t out[], const uint8_t key[]) {
+    const __m128i* rk = (const __m128i*)(key);
+    __m128i state = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(in)), _mm_loadu_si128(rk));
+
+#pragma GCC unroll 14
+    for (size_t round = 1; round < total_round; ++round)
+        state = _mm_aesdec_si128(state, _mm_loadu_si128(rk + round));
+    state = _mm_aesdeclast_si128(state, _mm_loadu_si128(rk + total_round));
+
+    _mm_storeu_si128((__m128i*)(out), state);
+}
+
+// 8 independent blocks interleaved round by round
+// in: 16 * blocks bytes
+// out: 16 * blocks bytes, may be the same as in
+template <size_t total_round>
+AESNI_TARGET void aesDecryptBlocksAESNI(const uint8_t in[], uint8_t out[], size_t blocks, const uint8_t key[]) {
+    constexpr size_t ways = 8;
+    const __m128i* src = (const __m128i*)(in);
+    __m128i* dst = (__m128i*)(out);
+    size_t i = 0;
+
+    // round keys are loaded once and kept in registers across the whole buffer
+    __m128i k[total_round + 1];
+#pragma GCC unroll 15
+    for (size_t round = 0; round <= total_round; ++round)
+        k[round] = _mm_loadu_si128((const __m128i*)(key) + round);
+
+    for (; i + ways <= blocks; i += ways) {
+        __m128i state[ways];
+        for (size_t j = 0; j < ways; ++j)
+            state[j] = _mm_xor_si128(_mm_loadu_si128(src + i + j), k[0]);
+
+#pragma GCC unroll 14
+        for (size_t round = 1; round < total_round; ++round) {
+#pragma GCC unroll 8
+            for (size_t j = 0; j < ways; ++j)
+                state[j] = _mm_aesdec_si128(state[j], k[round]);
+        }
+
+        for (size_t j = 0; j < ways; ++j)
+            _mm_storeu_si128(dst + i + j, _mm_aesdeclast_si128(state[j], k[total_round]));
+    }
+
+    for (; i < blocks; ++i)
+        aesInverseIterationAESNI<total_round>(in + 16 * i, out + 16 * i, key);
+}
+#else
+const bool aesni_supported = false;
+#endif
+
+// key expansion used by the modes below,
+// AES-NI when the CPU has it, T-tables otherwise
+void keyExpansion(const uint8_t key[], uint8_t keys[], const size_t key_length) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (aesni_supported) return keyExpansionAESNI(key, keys, key_length);
+#endif
+    keyExpansionSoftware(key, keys, key_length);
+}
+
+// keys: from keyExpansion
+// dkeys: 4 * (round + 1) * 4 bytes, decryption round keys
+void keyExpansionInverse(const uint8_t keys[], uint8_t dkeys[], size_t total_round) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (aesni_supported) return keyExpansionInverseAESNI(keys, dkeys, total_round);
+#endif
+    keyExpansionInverseSoftware(keys, dkeys, total_round);
+}
+
+// expanded keys and the cores specialized for their key size,
+// built once per key by aesInit and shared by every call
+struct alignas(64) AESContext {
+    uint8_t keys[60 * 4];
+    // decryption round keys, see keyExpansionInverse
+    uint8_t dkeys[60 * 4];
+    // 16 * blocks bytes
+    void (*encrypt_blocks)(const uint8_t in[], uint8_t out[], size_t blocks, const uint8_t key[]);
+    // 16 * blocks bytes, with dkeys
+    void (*decrypt_blocks)(const uint8_t in[], uint8_t out[], size_t blocks, const uint8_t key[]);
+};
+
+// AES-NI when the CPU has it, T-tables otherwise
+template <size_t total_round>
+void aesSelectCores(AESContext& context) {
+#if defined(__x86_64__) || defined(__i386__)
+    if (aesni_supported) {
+        context.encrypt_blocks = aesEncryptBlocksAESNI<total_round>;
+        context.decrypt_blocks = aesDecryptBlocksAESNI<total_round>;
+        return;
+    }
+#endif
+    context.encrypt_blocks = aesEncryptBlocksTable<total_round>;
+    context.decrypt_blocks = aesDecryptBlocksTable<total_round>;
+}
+
+// key_length: 16, 24 or 32 bytes
+// the only dispatch on key size, the modes call the specialized cores directly
+void aesInit(AESContext& context, const void* key, const size_t key_length) {
+    keyExpansion((const uint8_t*)(key), context.keys, key_length);
+    keyExpansionInverse(context.keys, context.dkeys, 6 + key_length / 4);
+    if (key_length == 16) aesSelectCores<10>(context);
+    else if (key_length == 24) aesSelectCores<12>(context);
+    else aesSelectCores<14>(context);
+}
+
+// an XTS key is two AES keys of the same size, K1 || K2:
+// K1 encrypts the data, K2 encrypts the sector number into the initial tweak
+struct XTSContext {
+    AESContext data_key;
+    AESContext tweak_key;
+};
+
+// key_length: 32 (XTS-AES-128) or 64 (XTS-AES-256) bytes
+void xtsInit(XTSContext& context, const void* key, const size_t key_length) {
+    aesInit(context.data_key, key, key_length / 2);
+    aesInit(context.tweak_key, (const uint8_t*)(key) + key_length / 2, key_length / 2);
+}
+
+#if defined(__SSE2__)
+// tweak times alpha in GF(2^128), the tweak being a 128-bit little-endian integer:
+// a 1-bit left shift, the bit shifted out folds back in as 0x87.
+// Both 64-bit halves shift in one instruction, the carry between them 
+// and the carry out are picked out of the sign bits, no branch on the tweak.
+inline __m128i xtsMultiplyAlpha(const __m128i t) {
+    const __m128i carries = _mm_shuffle_epi32(_mm_srai_epi32(t, 31), 0x13);
+    return _mm_xor_si128(_mm_slli_epi64(t, 1), _mm_and_si128(carries, _mm_set_epi32(0, 1, 0, 0x87)));
+}
+
+// tweaks: 16 * blocks bytes, the tweaks of the next blocks
+// tweak: advanced past them
+inline void xtsTweaks(uint8_t tweak[], uint8_t tweaks[], const size_t blocks) {
+    __m128i t = _mm_loadu_si128((const __m128i*)(tweak));
+    for (size_t b = 0; b < blocks; ++b) {
+        _mm_storeu_si128((__m128i*)(tweaks) + b, t);
+        t = xtsMultiplyAlpha(t);
+    }
+    _mm_storeu_si128((__m128i*)(tweak), t);
+}
+#else
+inline void xtsTweaks(uint8_t tweak[], uint8_t tweaks[], const size_t blocks) {
+    for (size_t b = 0; b < blocks; ++b) {
+        memcpy(tweaks + 16 * b, tweak, 16);
+        const uint8_t carry = tweak[15] >> 7;
+        for (size_t i = 15; i > 0; --i)
+            tweak[i] = tweak[i] << 1 | tweak[i - 1] >> 7;
+        tweak[0] = tweak[0] << 1 ^ (0x87 & -carry);
+    }
+}
+#endif
+
+// out = a ^ b, 16 bytes
+inline void xorBlock(uint8_t out[], const uint8_t a[], const uint8_t b[]) {
+    uint64_t x[2], y[2];
+    memcpy(x, a, 16);
+    memcpy(y, b, 16);
+    x[0] ^= y[0], x[1] ^= y[1];
+    memcpy(out, x, 16);
+}
+
+inline void xtsCipherBlocks(const AESContext& context, uint8_t buffer[], const size_t blocks, const bool decrypt) {
+    if (decrypt) context.decrypt_blocks(buffer, buffer, blocks, context.dkeys);
+    else context.encrypt_blocks(buffer, buffer, blocks, context.keys);
+}
+
+// one data unit of length >= 16 bytes, the last block may be partial 
+// and is handled by ciphertext stealing.
+// in and out may be the same buffer.
+void xtsDataUnit(const uint8_t in[], const size_t length, const XTSContext& context, const uint64_t sector,
+                 uint8_t out[], const bool decrypt) {
+    // initial tweak: the sector number as a 128-bit little-endian integer, encrypted with K2
+    uint8_t tweak[16] = { 0 };
+    for (size_t i = 0; i < 8; ++i)
+        tweak[i] = sector >> (8 * i);
+    context.tweak_key.encrypt_blocks(tweak, tweak, 1, context.tweak_key.keys);
+
+    const size_t tail = length % 16;
+    // with a partial last block, the last full block takes part in the stealing
+    const size_t blocks = length / 16 - (tail? 1: 0);
+
+    // blocks are encrypted a batch at a time
+    constexpr size_t batch = 32;
+    uint8_t tweaks[16 * batch], buffer[16 * batch];
+
+    for (size_t i = 0; i < blocks; i += batch) {
+        const size_t n = std::min(batch, blocks - i);
+        xtsTweaks(tweak, tweaks, n);
+        for (size_t b = 0; b < n; ++b)
+            xorBlock(buffer + 16 * b, in + 16 * (i + b), tweaks + 16 * b);
+        xtsCipherBlocks(context.data_key, buffer, n, decrypt);
+        for (size_t b = 0; b < n; ++b)
+            xorBlock(out + 16 * (i + b), buffer + 16 * b, tweaks + 16 * b);
+    }
+
+    if (!tail) return;
+
+    // ciphertext stealing over the last full block and the partial block, 
+    // decryption takes their tweaks in the opposite order
+    xtsTweaks(tweak, tweaks, 2);
+    const uint8_t* first = tweaks + (decrypt? 16: 0);
+    const uint8_t* second = tweaks + (decrypt? 0: 16);
+    const size_t offset = 16 * blocks;
+
+    uint8_t block[16], last[16];
+    xorBlock(block, in + offset, first);
+    xtsCipherBlocks(context.data_key, block, 1, decrypt);
+    xorBlock(block, block, first);
+
+    // the partial output is the head of that block, its tail pads the partial input
+    memcpy(last, in + offset + 16, tail);
+    memcpy(last + tail, block + tail, 16 - tail);
+    memcpy(out + offset + 16, block, tail);
+
+    xorBlock(last, last, second);
+    xtsCipherBlocks(context.data_key, last, 1, decrypt);
+    xorBlock(out + offset, last, second);
+}
+
+// XTS-AES of one data unit (sector) of at least 16 bytes
+// plain and cipher may be the same buffer.
+void aes_xts(const void* plain, const size_t length, const XTSContext& context, const uint64_t sector, void* cipher) {
+    xtsDataUnit((const uint8_t*)(plain), length, context, sector, (uint8_t*)(cipher), false);
+}
+
+void aes_xts_decrypt(const void* cipher, const size_t length, const XTSContext& context, const uint64_t sector, 
+                     void* plain) {
+    xtsDataUnit((const uint8_t*)(cipher), length, context, sector, (uint8_t*)(plain), true);
+}
+
+// count data units of sector_size bytes each, unit i at in + i * sector_size with sector number sectors[i],
+// on `threads` workers including the calling thread. Data units are independent,
+// so scattered sectors of a device go through in one call.
+void xtsSectors(const void* in, const size_t sector_size, const uint64_t sectors[], const size_t count,
+                const XTSContext& context, void* out, const bool decrypt, size_t threads) {
+    // sectors taken by a worker at a time, about 64 KiB
+    const size_t group = std::max<size_t>(1, (64 << 10) / sector_size);
+    const size_t groups = (count + group - 1) / group;
+    threads = std::max<size_t>(1, std::min(threads, groups));
+
+    std::atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t g; (g = next++) < groups; )
+            for (size_t i = g * group; i < std::min(count, g * group + group); ++i)
+                xtsDataUnit((const uint8_t*)(in) + i * sector_size, sector_size, context, sectors[i], 
+                            (uint8_t*)(out) + i * sector_size, decrypt);
+    };
+
+    std::vector<std::thread> pool;
+    for (size_t t = 1; t < threads; ++t)
+        pool.emplace_back(worker);
+    worker();
+    for (auto& t: pool)
+        t.join();
+}
+
+void aes_xts_sectors(const void* plain, const size_t sector_size, const uint64_t sectors[], const size_t count,
+                     const XTSContext& context, void* cipher, const size_t threads) {
+    xtsSectors(plain, sector_size, sectors, count, context, cipher, false, threads);
+}
+
+void aes_xts_decrypt_sectors(const void* cipher, const size_t sector_size, const uint64_t sectors[], const size_t count,
+                             const XTSContext& context, void* plain, const size_t threads) {
+    xtsSectors(cipher, sector_size, sectors, count, context, plain, true, threads);
+}
+
+int main(int argc, char** argv) {
+    if (argc == 1) return 0;
+
+    std::ifstream fin(argv[1]);
+
+    fin.seekg(0, std::ios::end);
+    std::string buffer;
+    size_t len = fin.tellg();
+    buffer.reserve(len);
+    fin.seekg(0, std::ios::beg);
+
+    buffer.assign((std::istreambuf_iterator<char>(fin)),
+                   std::istreambuf_iterator<char>());
+
+    fin.close();
+
+    // 256 bit or 512 bit key size, K1 || K2
+    unsigned char key[64] = { 0 };
+    size_t key_length = 0;
+
+    if (argc >= 3) {
+        fin.open(argv[2]);
+        fin.seekg(0, std::ios::beg);
+        char buffer[3] = { 0 };
+        for (size_t i = 0; i < 64; ++i) {
+            if (!fin.read(buffer, 2)) break;
+            key[i] = std::stoi(buffer, 0, 16);
+            ++key_length;
+        }
+        fin.close();
+    }
+    
+    if (key_length != 32 && key_length != 64) {
+        printf("Length of key should be 32 or 64 bytes. \n");
+        return 0;
+    }
+
+    // optional arguments: "decrypt", "sector=N" for the data unit size, 4096 by default,
+    // "threads=N" for the number of workers, all hardware threads by default
+    bool decrypt = false;
+    size_t sector_size = 4096;
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 3; i < argc; ++i) {
+        if (!strcmp(argv[i], "decrypt")) decrypt = true;
+        else if (!strncmp(argv[i], "sector=", 7)) sector_size = std::atoi(argv[i] + 7);
+        else if (!strncmp(argv[i], "threads=", 8)) threads = std::max(1, std::atoi(argv[i] + 8));
+    }
+
+    // sectors are numbered from 0, the last one may be short
+    const size_t count = buffer.length() / sector_size;
+    const size_t rest = buffer.length() % sector_size;
+
+    if (sector_size < 16 || (rest && rest < 16)) {
+        printf("Length of every sector should be at least 16 bytes. \n");
+        return 0;
+    }
+
+    XTSContext context;
+    xtsInit(context, key, key_length);
+
+    std::vector<uint64_t> sectors(count + 1);
+    for (size_t i = 0; i <= count; ++i) sectors[i] = i;
+
+    std::vector<char> cipher(buffer.length(), 0);
+    if (decrypt) {
+        aes_xts_decrypt_sectors(buffer.data(), sector_size, &sectors[0], count, context, &cipher[0], threads);
+        if (rest) aes_xts_decrypt(buffer.data() + count * sector_size, rest, context, count, &cipher[count * sector_size]);
+    } else {
+        aes_xts_sectors(buffer.data(), sector_size, &sectors[0], count, context, &cipher[0], threads);
+        if (rest) aes_xts(buffer.data() + count * sector_size, rest, context, count, &cipher[count * sector_size]);
+    }
+
+    for (size_t i = 0; i < buffer.length(); ++i)
+        printf("%02x", int(cipher[i]) & 0xff);
+    printf("\n");
+    
+}
@@ -32,51 +32,86 @@ inline bool getbit(const void* ptr, size_t i) {
 }
 
 
+// PC-1 and PC-2 as byte-indexed tables, generated at compile time:
+// PC1[i][b] is the part of C || D (56 bits) contributed by key byte i equal to b,
+// PC2[i][b] the part of a subkey (48 bits) contributed by byte i of C || D equal to b.
+// Bits are numbered from the most significant, as in the standard.
+struct DESKeyTables {
+    uint64_t PC1[8][256];
+    uint64_t PC2[7][256];
+
+    constexpr DESKeyTables(): PC1(), PC2() {
+        constexpr size_t pc1[56] = { 57, 49, 41, 33, 25, 17,  9,
+                                      1, 58, 50, 42, 34, 26, 18,
+                                     10,  2, 59, 51, 43, 35, 27, 
+                                     19, 11,  3, 60, 52, 44, 36, 
+                                     63, 55, 47, 39, 31, 23, 15,
+                                      7, 62, 54, 46, 38, 30, 22, 
+                                     14,  6, 61, 53, 45, 37, 29, 
+                                     21, 13,  5, 28, 20, 12,  4 };
+        constexpr size_t pc2[48] = { 14, 17, 11, 24,  1,  5,  3, 28, 
+                                     15,  6, 21, 10, 23, 19, 12,  4, 
+                                     26,  8, 16,  7, 27, 20, 13,  2, 
+                                     41, 52, 31, 37, 47, 55, 30, 40, 
+                                     51, 45, 33, 48, 44, 49, 39, 56, 
+                                     34, 53, 46, 42, 50, 36, 29, 32 }; 
+
+        for (size_t i = 0; i < 56; ++i) {
+            const size_t bit = pc1[i] - 1;
+            for (size_t b = 0; b < 256; ++b)
+                if (b >> (7 - bit % 8) & 1) PC1[bit / 8][b] |= uint64_t(1) << (55 - i);
+        }
+        for (size_t i = 0; i < 48; ++i) {
+            const size_t bit = pc2[i] - 1;
+            for (size_t b = 0; b < 256; ++b)
+                if (b >> (7 - bit % 8) & 1) PC2[bit / 8][b] |= uint64_t(1) << (47 - i);
+        }
+    }
+};
+
+constexpr DESKeyTables DK;
+
 // key is 64 bits
 std::array<std::array<uint8_t, 6>, 16> generateSubkeys(const uint8_t key[]) {
-    constexpr size_t pc1[56] = { 57, 49, 41, 33, 25, 17,  9,
-                                  1, 58, 50, 42, 34, 26, 18,
-                                 10,  2, 59, 51, 43, 35, 27, 
-                                 19, 11,  3, 60, 52, 44, 36, 
-                                 63, 55, 47, 39, 31, 23, 15,
-                                  7, 62, 54, 46, 38, 30, 22, 
-                                 14,  6, 61, 53, 45, 37, 29, 
-                                 21, 13,  5, 28, 20, 12,  4 };
-    constexpr size_t pc2[48] = { 14, 17, 11, 24,  1,  5,  3, 28, 
-                                 15,  6, 21, 10, 23, 19, 12,  4, 
-                                 26,  8, 16,  7, 27, 20, 13,  2, 
-                                 41, 52, 31, 37, 47, 55, 30, 40, 
-                                 51, 45, 33, 48, 44, 49, 39, 56, 
-                                 34, 53, 46, 42, 50, 36, 29, 32 }; 
-    // left shift both half-keys 1 bit 
-    auto key_shift = [](uint8_t key[])->void {
-        bool a = getbit(key, 0);
-        bool b = getbit(key, 28);
-        for (size_t i = 0; i < 55; ++i)
-            setbit(key, i, getbit(key, i + 1));
-        setbit(key, 27, a);
-        setbit(key, 55, b);
+    // left rotate a 28-bit half-key
+    auto key_shift = [](uint32_t half, size_t n)->uint32_t {
+        return (half << n | half >> (28 - n)) & 0x0fffffff;
     };
 
-    uint8_t key_p[7] = { 0 };
+    uint64_t key_p = 0;
+    for (size_t i = 0; i < 8; ++i)
+        key_p |= DK.PC1[i][key[i]];
 
-    for (size_t i = 0; i < 56; ++i)
-        setbit(key_p, i, getbit(key, pc1[i] - 1));
+    uint32_t c = key_p >> 28, d = key_p & 0x0fffffff;
 
     std::array<std::array<uint8_t, 6>, 16> subkeys;
 
-    
     for (size_t i = 0; i < 16; ++i) {
-        key_shift(key_p);
-        if (i != 0 && i != 1 && i != 8 && i != 15) key_shift(key_p);
-        for (size_t j = 0; j < 48; ++j)
-            setbit(&subkeys[i][0], j, getbit(key_p, pc2[j] - 1));
+        const size_t n = (i == 0 || i == 1 || i == 8 || i == 15)? 1: 2;
+        c = key_shift(c, n);
+        d = key_shift(d, n);
+        key_p = uint64_t(c) << 28 | d;
+
+        uint64_t subkey = 0;
+        for (size_t j = 0; j < 7; ++j)
+            subkey |= DK.PC2[j][key_p >> (48 - 8 * j) & 0xff];
+        for (size_t j = 0; j < 6; ++j)
+            subkeys[i][j] = subkey >> (40 - 8 * j);
     }
-    
-    
+
     return subkeys;
 }
 
+// expanded keys, built once per key by desInit and shared by every call
+struct alignas(64) DESContext {
+    std::array<std::array<uint8_t, 6>, 16> subkeys;
+};
+
+// key is 64 bits
+void desInit(DESContext& context, const void* key) {
+    context.subkeys = generateSubkeys((const uint8_t*)(key));
+}
+
 inline uint32_t f_function(const uint32_t rn_1, const std::array<uint8_t, 6>& key_n) {
     constexpr size_t E[] = { 32,  1,  2,  3,  4,  5, 
                               4,  5,  6,  7,  8,  9, 
@@ -206,15 +241,14 @@ void des_cbc_iteration(const uint8_t* plain, const std::array<std::array<uint8_t
 }
 
 
-void des_cbc(const void* plain, const size_t length, const void* key, const void* IV, void* cipher) {
+void des_cbc(const void* plain, const size_t length, const DESContext& context, const void* IV, void* cipher) {
     uint8_t* plain_ = (uint8_t*)plain;
-    const uint8_t* key_ = (const uint8_t*)key;
     uint8_t* cipher_ = (uint8_t*)cipher;
 
     uint8_t buffer[8];
     memcpy(buffer, IV, 8);
 
-    auto subkeys = generateSubkeys(key_);
+    const auto& subkeys = context.subkeys;
     for (size_t i = 0; i < length / 8; ++i) { 
         for (size_t j = 0; j < 8; ++j)
             buffer[j] ^= plain_[8 * i + j];
@@ -261,7 +295,9 @@ int main(int argc, char** argv) {
 
 
     std::vector<char> cipher(buffer.length(), 0);
-    des_cbc(buffer.data(), buffer.length(), key, IV, &cipher[0]);
+    DESContext context;
+    desInit(context, key);
+    des_cbc(buffer.data(), buffer.length(), context, IV, &cipher[0]);
 
     for (size_t i = 0; i < buffer.length(); ++i)
         printf("%02x", int(cipher[i]) & 0xff);
@@ -0,0 +1,326 @@
+/******************************************************************************
+ *  Copyright (c) 2015 Jamis Hoo
+ *  Distributed under the MIT license 
+ *  (See accompanying file LICENSE or copy at http://opensource.org/licenses/MIT)
+ *  
+ *  Project: 
+ *  Filename: gcm_bench.cc 
+ *  Version: 1.0
+ *  Author: Jamis Hoo
+ *  E-mail: hoojamis@gmail.com
+ *  Date: May 17, 2015
+ *  Time: 18:02:44
+ *  Description: GHASH benchmark, cycles/byte of GHASH cores
+ *****************************************************************************/
+#include <cstdio>
+#include <cstring>
+#include <cinttypes>
+#include <cstdlib>
+#include <chrono>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#include <cpuid.h>
+#endif
+
+// bit-serial multiply, kept as the baseline
+// X: 16 bytes
+// Y: 16 bytes
+// out: 16 bytes
+void galois_multiply(const uint8_t X[], const uint8_t Y[], uint8_t out[]) {
+    uint8_t V[16];
+    memcpy(V, Y, 16);
+    uint8_t Z[16] = { 0 };
+
+    for (size_t i = 0; i < 16; ++i) {
+        for (size_t j = 0; j < 8; ++j) {
+            if (X[i] & 1 << (7 - j))
+                for (size_t k = 0; k < 16; ++k) Z[k] ^= V[k];
+
+            if (V[15] & 1) {
+                for (size_t k = 0; k < 16; ++k) {
+                    if (k && V[15 - k] & 1)
+                        V[16 - k] |= 0x80;
+                    V[15 - k] >>= 1;
+                }
+                
+                V[0] ^= 0xe1;
+            } else {
+                for (size_t k = 0; k < 16; ++k) {
+                    if (k && V[15 - k] & 1)
+                        V[16 - k] |= 0x80;
+                    V[15 - k] >>= 1;
+                }
+            }
+        }
+    }
+    
+    memcpy(out, Z, 16);
+}
+
+inline uint64_t getDoubleWord(const uint8_t p[]) {
+    uint64_t x = 0;
+    for (size_t i = 0; i < 8; ++i) x = x << 8 | p[i];
+    return x;
+}
+
+inline void putDoubleWord(uint8_t p[], const uint64_t x) {
+    for (size_t i = 0; i < 8; ++i) p[i] = x >> (56 - 8 * i);
+}
+
+// reduction constants of Shoup's tables, as in aes_gcm.cc
+struct GHashReduction {
+    uint64_t r4[16], r8[256];
+
+    constexpr GHashReduction(): r4(), r8() {
+        for (size_t b = 0; b < 16; ++b)
+            for (size_t j = 0; j < 4; ++j)
+                if (b >> j & 1) r4[b] ^= uint64_t(0xe1) << (5 + j) << 48;
+        for (size_t b = 0; b < 256; ++b)
+            for (size_t j = 0; j < 8; ++j)
+                if (b >> j & 1) r8[b] ^= uint64_t(0xe1) << (1 + j) << 48;
+    }
+};
+
+constexpr GHashReduction GR;
+
+// table[i] = i H, bits: 4 or 8
+void gHashTable(const uint8_t hash_key[], uint64_t table[][2], const size_t bits) {
+    const size_t top = 1 << (bits - 1);
+    uint64_t hi = getDoubleWord(hash_key), lo = getDoubleWord(hash_key + 8);
+
+    table[0][0] = table[0][1] = 0;
+    table[top][0] = hi, table[top][1] = lo;
+    for (size_t i = top >> 1; i > 0; i >>= 1) {
+        const uint64_t carry = lo & 1;
+        lo = hi << 63 | lo >> 1;
+        hi = hi >> 1 ^ (0xe100000000000000 & -carry);
+        table[i][0] = hi, table[i][1] = lo;
+    }
+    for (size_t i = 2; i <= top; i <<= 1)
+        for (size_t j = 1; j < i; ++j)
+            table[i + j][0] = table[i][0] ^ table[j][0], table[i + j][1] = table[i][1] ^ table[j][1];
+}
+
+inline void gMultiply4(uint8_t Y[], const uint64_t h4[][2]) {
+    uint64_t hi = 0, lo = 0;
+    for (size_t i = 16; i-- > 0; ) {
+        for (size_t half = 0; half < 2; ++half) {
+            const size_t nibble = half? Y[i] >> 4: Y[i] & 0xf;
+            const size_t rem = lo & 0xf;
+            lo = hi << 60 | lo >> 4;
+            hi = hi >> 4 ^ GR.r4[rem];
+            hi ^= h4[nibble][0], lo ^= h4[nibble][1];
+        }
+    }
+    putDoubleWord(Y, hi);
+    putDoubleWord(Y + 8, lo);
+}
+
+inline void gMultiply8(uint8_t Y[], const uint64_t h8[][2]) {
+    uint64_t hi = 0, lo = 0;
+    for (size_t i = 16; i-- > 0; ) {
+        const size_t rem = lo & 0xff;
+        lo = hi << 56 | lo >> 8;
+        hi = hi >> 8 ^ GR.r8[rem];
+        hi ^= h8[Y[i]][0], lo ^= h8[Y[i]][1];
+    }
+    putDoubleWord(Y, hi);
+    putDoubleWord(Y + 8, lo);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CLMUL_TARGET __attribute__((target("pclmul,ssse3,sse2")))
+
+inline bool cpuSupportsCLMUL() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return false;
+    return (ecx & bit_PCLMUL) && (ecx & bit_SSSE3);
+}
+
+const bool clmul_supported = cpuSupportsCLMUL();
+
+// blocks are byte-reversed on load, so that bit 0 of a block in GCM order is bit 127 of the register
+CLMUL_TARGET inline __m128i clmulByteSwap(const __m128i x) {
+    return _mm_shuffle_epi8(x, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+// lo, mid, hi ^= a b, unreduced, Karatsuba with 3 carry-less multiplies;
+// the middle term is folded in by clmulReduce, once for all the products summed
+CLMUL_TARGET inline void clmulAccumulate(const __m128i a, const __m128i b, __m128i& lo, __m128i& mid, __m128i& hi) {
+    lo = _mm_xor_si128(lo, _mm_clmulepi64_si128(a, b, 0x00));
+    hi = _mm_xor_si128(hi, _mm_clmulepi64_si128(a, b, 0x11));
+    mid = _mm_xor_si128(mid, _mm_clmulepi64_si128(_mm_xor_si128(a, _mm_shuffle_epi32(a, 0x4e)),
+                                                  _mm_xor_si128(b, _mm_shuffle_epi32(b, 0x4e)), 0x00));
+}
+
+// the 256-bit sum of products down to GF(2^128).
+// The operands are bit-reflected, so the product is shifted left by 1 first,
+// then reduced modulo x^128 + x^7 + x^2 + x + 1 with shifts by 31, 30, 25 and 1, 2, 7.
+CLMUL_TARGET inline __m128i clmulReduce(__m128i lo, __m128i mid, __m128i hi) {
+    mid = _mm_xor_si128(mid, _mm_xor_si128(lo, hi));
+    lo = _mm_xor_si128(lo, _mm_slli_si128(mid, 8));
+    hi = _mm_xor_si128(hi, _mm_srli_si128(mid, 8));
+
+    __m128i t7 = _mm_srli_epi32(lo, 31), t8 = _mm_srli_epi32(hi, 31);
+    lo = _mm_slli_epi32(lo, 1), hi = _mm_slli_epi32(hi, 1);
+    const __m128i t9 = _mm_srli_si128(t7, 12);
+    t8 = _mm_slli_si128(t8, 4), t7 = _mm_slli_si128(t7, 4);
+    lo = _mm_or_si128(lo, t7);
+    hi = _mm_or_si128(_mm_or_si128(hi, t8), t9);
+
+    t7 = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)), _mm_slli_epi32(lo, 25));
+    t8 = _mm_srli_si128(t7, 4);
+    lo = _mm_xor_si128(lo, _mm_slli_si128(t7, 12));
+    const __m128i t2 = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_srli_epi32(lo, 2)),
+                                     _mm_xor_si128(_mm_srli_epi32(lo, 7), t8));
+    return _mm_xor_si128(hi, _mm_xor_si128(lo, t2));
+}
+
+// h_powers[i] = H^(i + 1), byte-reversed
+CLMUL_TARGET void gHashPowersCLMUL(const uint8_t hash_key[], uint8_t h_powers[][16]) {
+    const __m128i h = clmulByteSwap(_mm_loadu_si128((const __m128i*)(hash_key)));
+    __m128i p = h;
+    _mm_storeu_si128((__m128i*)(h_powers[0]), p);
+    for (size_t i = 1; i < 8; ++i) {
+        __m128i lo = _mm_setzero_si128(), mid = lo, hi = lo;
+        clmulAccumulate(p, h, lo, mid, hi);
+        p = clmulReduce(lo, mid, hi);
+        _mm_storeu_si128((__m128i*)(h_powers[i]), p);
+    }
+}
+
+// Y = (Y ^ block) H for each block, with aggregated reduction: 
+// ways blocks are multiplied by H^ways .. H^1 and summed before a single reduction,
+// Y_(i + ways) = (Y_i ^ X_1) H^ways ^ X_2 H^(ways - 1) ^ .. ^ X_ways H
+template <size_t ways>
+CLMUL_TARGET inline __m128i clmulFold(__m128i y, const __m128i x[], const __m128i h[]) {
+    __m128i lo = _mm_setzero_si128(), mid = lo, hi = lo;
+    clmulAccumulate(_mm_xor_si128(x[0], y), h[ways - 1], lo, mid, hi);
+    for (size_t j = 1; j < ways; ++j)
+        clmulAccumulate(x[j], h[ways - 1 - j], lo, mid, hi);
+    return clmulReduce(lo, mid, hi);
+}
+
+// Y = GHASH over blocks, `ways` blocks per reduction
+template <size_t ways>
+CLMUL_TARGET void gHashCLMUL(uint8_t Y[], const uint8_t in[], size_t blocks, const uint8_t h_powers[][16]) {
+    __m128i h[8], x[8];
+    for (size_t j = 0; j < 8; ++j)
+        h[j] = _mm_loadu_si128((const __m128i*)(h_powers[j]));
+
+    const __m128i* src = (const __m128i*)(in);
+    __m128i y = clmulByteSwap(_mm_loadu_si128((const __m128i*)(Y)));
+    for (size_t i = 0; i + ways <= blocks; i += ways) {
+        for (size_t j = 0; j < ways; ++j)
+            x[j] = clmulByteSwap(_mm_loadu_si128(src + i + j));
+        y = clmulFold<ways>(y, x, h);
+    }
+    _mm_storeu_si128((__m128i*)(Y), clmulByteSwap(y));
+}
+#else
+const bool clmul_supported = false;
+#endif
+
+// cycle counter, falls back to nanoseconds where rdtsc is unavailable
+inline uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// runs fn over the buffer `repeat` times and returns the best ticks/byte
+template <class Function>
+double measure(Function fn, const size_t length, const size_t repeat) {
+    double best = 1e30;
+    for (size_t r = 0; r < repeat; ++r) {
+        uint64_t start = ticks();
+        fn();
+        uint64_t end = ticks();
+        if (double(end - start) / length < best) best = double(end - start) / length;
+    }
+    return best;
+}
+
+int main(int argc, char** argv) {
+    // size of test data in KiB, the bit-serial baseline runs over 1/16 of it
+    size_t length = 1024 * (argc > 1? std::atoi(argv[1]): 1024);
+    length = length / 256 * 256;
+
+    std::vector<uint8_t> data(length);
+    for (size_t i = 0; i < length; ++i) data[i] = uint8_t(i * 131 + 7);
+
+    uint8_t hash_key[16];
+    for (size_t i = 0; i < 16; ++i) hash_key[i] = uint8_t(0x66 + 17 * i);
+
+    uint64_t h4[16][2], h8[256][2];
+    gHashTable(hash_key, h4, 4);
+    gHashTable(hash_key, h8, 8);
+
+    // GHASH of the first `bytes` bytes of data into Y
+    uint8_t reference[16], Y[16];
+    auto ghash = [&](const size_t bytes, uint8_t Y[], const int engine) {
+        memset(Y, 0, 16);
+        for (size_t i = 0; i < bytes; i += 16) {
+            for (size_t j = 0; j < 16; ++j) Y[j] ^= data[i + j];
+            if (engine == 0) galois_multiply(Y, hash_key, Y);
+            else if (engine == 4) gMultiply4(Y, h4);
+            else gMultiply8(Y, h8);
+        }
+    };
+
+    // the carry-less multiply rows, whole buffer per call
+    uint8_t h_powers[8][16];
+#if defined(__x86_64__) || defined(__i386__)
+    if (clmul_supported) gHashPowersCLMUL(hash_key, h_powers);
+#endif
+    auto clmul = [&](const size_t bytes, uint8_t Y[], const size_t ways) {
+        memset(Y, 0, 16);
+#if defined(__x86_64__) || defined(__i386__)
+        if (ways == 1) gHashCLMUL<1>(Y, data.data(), bytes / 16, h_powers);
+        else if (ways == 4) gHashCLMUL<4>(Y, data.data(), bytes / 16, h_powers);
+        else gHashCLMUL<8>(Y, data.data(), bytes / 16, h_powers);
+#endif
+    };
+
+    const size_t short_length = length / 16;
+    double serial = measure([&]() { ghash(short_length, reference, 0); }, short_length, 3);
+
+    printf("%-26s %12s\n", "engine", "cycles/byte");
+    printf("%-26s %12.2f\n", "bit-serial (reference)", serial);
+
+    const char* names[] = { "Shoup 4-bit, 256 B table", "Shoup 8-bit, 4 KiB table" };
+    const int engines[] = { 4, 8 };
+    for (size_t e = 0; e < 2; ++e) {
+        ghash(short_length, Y, engines[e]);
+        if (memcmp(Y, reference, 16)) {
+            printf("%s: output differs from reference\n", names[e]);
+            return 1;
+        }
+
+        double table = measure([&]() { ghash(length, Y, engines[e]); }, length, 3);
+        printf("%-26s %12.2f %8.1fx\n", names[e], table, serial / table);
+    }
+
+    if (!clmul_supported) {
+        printf("PCLMULQDQ not supported, carry-less rows skipped\n");
+        return 0;
+    }
+
+    const char* clmul_names[] = { "PCLMULQDQ, 1 block/reduce", "PCLMULQDQ, 4 blocks/reduce",
+                                  "PCLMULQDQ, 8 blocks/reduce" };
+    const size_t clmul_ways[] = { 1, 4, 8 };
+    for (size_t e = 0; e < 3; ++e) {
+        clmul(short_length, Y, clmul_ways[e]);
+        if (memcmp(Y, reference, 16)) {
+            printf("%s: output differs from reference\n", clmul_names[e]);
+            return 1;
+        }
+
+        double cycles = measure([&]() { clmul(length, Y, clmul_ways[e]); }, length, 3);
+        printf("%-26s %12.2f %8.1fx\n", clmul_names[e], cycles, serial / cycles);
+    }
+}
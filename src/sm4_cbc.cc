@@ -16,6 +16,7 @@
 #include <iostream>
 #include <fstream>
 #include <cinttypes>
+#include <cstring>
 #include <vector>
 
 inline uint32_t left_rotate(const uint32_t x, const size_t i) {
@@ -97,6 +98,16 @@ void keyExpansion(const uint8_t key[], uint32_t keys[]) {
         keys[i] = k[i + 4] = k[i] ^ L1Transformation(tauTransformation(k[i + 1] ^ k[i + 2] ^ k[i + 3] ^ CK[i]));
 }
 
+// expanded keys, built once per key by sm4Init and shared by every call
+struct alignas(64) SM4Context {
+    uint32_t keys[32];
+};
+
+// key: 16 bytes
+void sm4Init(SM4Context& context, const void* key) {
+    keyExpansion((const uint8_t*)(key), context.keys);
+}
+
 void sm4Iteration(const uint32_t plain[], const uint32_t keys[], uint32_t cipher[]) {
     uint32_t x[36];
     x[0] = endianConvert(plain[0]);
@@ -113,12 +124,11 @@ void sm4Iteration(const uint32_t plain[], const uint32_t keys[], uint32_t cipher
     cipher[3] = endianConvert(x[32]);
 }
 
-void sm4_cbc(const void* plain, const size_t length, const void* key, const void* IV, void* cipher) {
+void sm4_cbc(const void* plain, const size_t length, const SM4Context& context, const void* IV, void* cipher) {
     const uint32_t* plain_ = (const uint32_t*)(plain);
     uint32_t* cipher_ = (uint32_t*)(cipher);
     
-    uint32_t keys[32];
-    keyExpansion((const uint8_t*)(key), keys);
+    const uint32_t* keys = context.keys;
 
     uint32_t buffer[4];
     memcpy(buffer, IV, 16);
@@ -168,7 +178,9 @@ int main(int argc, char** argv) {
     }
 
     std::vector<char> cipher(buffer.length(), 0);
-    sm4_cbc(buffer.data(), buffer.length(), key, IV, &cipher[0]);
+    SM4Context context;
+    sm4Init(context, key);
+    sm4_cbc(buffer.data(), buffer.length(), context, IV, &cipher[0]);
 
     for (size_t i = 0; i < buffer.length(); ++i)
         printf("%02x", int(cipher[i]) & 0xff);
@@ -16,6 +16,7 @@
 #include <iostream>
 #include <fstream>
 #include <cinttypes>
+#include <cstring>
 #include <vector>
 
 inline uint32_t left_rotate(const uint32_t x, const size_t i) {
@@ -97,6 +98,16 @@ void keyExpansion(const uint8_t key[], uint32_t keys[]) {
         keys[i] = k[i + 4] = k[i] ^ L1Transformation(tauTransformation(k[i + 1] ^ k[i + 2] ^ k[i + 3] ^ CK[i]));
 }
 
+// expanded keys, built once per key by sm4Init and shared by every call
+struct alignas(64) SM4Context {
+    uint32_t keys[32];
+};
+
+// key: 16 bytes
+void sm4Init(SM4Context& context, const void* key) {
+    keyExpansion((const uint8_t*)(key), context.keys);
+}
+
 void sm4Iteration(const uint32_t plain[], const uint32_t keys[], uint32_t cipher[]) {
     uint32_t x[36];
     x[0] = endianConvert(plain[0]);
@@ -113,36 +124,39 @@ void sm4Iteration(const uint32_t plain[], const uint32_t keys[], uint32_t cipher
     cipher[3] = endianConvert(x[32]);
 }
 
-void sm4_ctr(const void* plain, const size_t length, const void* key, const void* IV, void* cipher) {
+// Bytes [offset, offset + length) of the stream of sm4_ctr, in O(length) whatever the offset:
+// byte i of the stream uses counter i, so a window starts straight at its counter.
+// in and out may be the same buffer.
+void sm4_ctr_seek(const void* in, const size_t length, const SM4Context& context, const void* IV, 
+                  const uint64_t offset, void* out) {
     // I cannot guarantee this is correct.
     // The endian of SM4 is way too complicated
     // nor can I find any documentation about SM4 CTR mode
-    const uint8_t* plain_ = (const uint8_t*)(plain);
-    uint8_t* cipher_ = (uint8_t*)(cipher);
+    const uint8_t* in_ = (const uint8_t*)(in);
+    uint8_t* out_ = (uint8_t*)(out);
 
-    uint32_t keys[32];
-    keyExpansion((const uint8_t*)(key), keys);
-
-    uint8_t buffer[16];
+    const uint32_t* keys = context.keys;
 
-    uint8_t counter[8] = { 0 };
-    uint64_t* ctr = (uint64_t*)counter;
+    uint8_t buffer[16], output[16];
 
     for (size_t i = 0; i < length; ++i) {
+        const uint64_t ctr = offset + i;
         // any lossless operation is ok
         // we use XOR here
         memcpy(buffer, IV, 16);
         for (size_t j = 0; j < 8; ++j)
-            buffer[j] ^= counter[7 - j];
-
-        sm4Iteration((const uint32_t*)buffer, keys, (uint32_t*)(cipher_ + i));
+            buffer[j] ^= ctr >> (56 - 8 * j);
 
-        ++(*ctr);
+        sm4Iteration((const uint32_t*)buffer, keys, (uint32_t*)output);
 
-        cipher_[i] ^= plain_[i];
+        out_[i] = in_[i] ^ output[0];
     }
 }
 
+void sm4_ctr(const void* plain, const size_t length, const SM4Context& context, const void* IV, void* cipher) {
+    sm4_ctr_seek(plain, length, context, IV, 0, cipher);
+}
+
 int main(int argc, char** argv) {
     if (argc == 1) return 0;
 
@@ -176,7 +190,9 @@ int main(int argc, char** argv) {
     }
 
     std::vector<char> cipher(buffer.length() + 16, 0);
-    sm4_ctr(buffer.data(), buffer.length(), key, IV, &cipher[0]);
+    SM4Context context;
+    sm4Init(context, key);
+    sm4_ctr(buffer.data(), buffer.length(), context, IV, &cipher[0]);
 
     for (size_t i = 0; i < buffer.length(); ++i)
         printf("%02x", int(cipher[i]) & 0xff);